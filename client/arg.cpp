@@ -23,7 +23,6 @@
 
 #include "config.h"
 
-#include <fstream>
 #include <string>
 
 #include <stdio.h>
@@ -37,6 +36,7 @@
 #include <sys/stat.h>
 
 #include "client.h"
+#include "compdb.h"
 
 using namespace std;
 
@@ -59,87 +59,6 @@ inline int str_startswith(const char *head, const char *worm)
 }
 
 
-std::string trim(const std::string& str) {
-    const auto strBegin = str.find_first_not_of(" \t\r\n");
-    if (strBegin == std::string::npos) return "";
-
-    const auto strEnd = str.find_last_not_of(" \t\r\n");
-    return str.substr(strBegin, strEnd - strBegin + 1);
-}
-
-std::string unquote(const std::string& str) {
-    if (str.size() >= 2 && str.front() == '"' && str.back() == '"') {
-        return str.substr(1, str.size() - 2);
-    }
-    return str;
-}
-
-bool extractJsonStringField(const std::string& line, const std::string& key, std::string& value) {
-    std::string searchKey = "\"" + key + "\"";
-    size_t keyPos = line.find(searchKey);
-    if (keyPos == std::string::npos) return false;
-
-    size_t colonPos = line.find(':', keyPos);
-    if (colonPos == std::string::npos) return false;
-
-    size_t startQuote = line.find('"', colonPos + 1);
-    if (startQuote == std::string::npos) return false;
-
-    size_t endQuote = line.find('"', startQuote + 1);
-    if (endQuote == std::string::npos) return false;
-
-    value = unquote(line.substr(startQuote, endQuote - startQuote + 1));
-    return true;
-}
-
-std::string getCompileCommand(const std::string& compileCommandsPath, const std::string& targetFilePath) {
-    std::ifstream file(compileCommandsPath);
-    if (!file) {
-        throw std::runtime_error("Cannot open compile_commands.json file.");
-    }
-
-    std::string line;
-    std::string currentFilePath;
-    std::string currentCommand;
-
-    while (std::getline(file, line)) {
-        std::string trimmed = trim(line);
-        std::string value;
-
-        if (extractJsonStringField(trimmed, "file", value)) {
-            currentFilePath = value;
-        } else if (extractJsonStringField(trimmed, "command", value)) {
-            currentCommand = value;
-        }
-
-        if (!currentFilePath.empty() && !currentCommand.empty()) {
-            if (currentFilePath == targetFilePath) {
-                return currentCommand;
-            }
-            currentFilePath.clear();
-            currentCommand.clear();
-        }
-    }
-
-    throw std::runtime_error("Compile command for the specified file was not found.");
-}
-
-
-// TODO duplicated code from file_util.cpp
-vector<string> split(const string &s, char delim) {
-    vector<string> elems;
-    stringstream ss(s);
-    string item;
-    while (getline(ss, item, delim)) {
-        if (!item.empty()) {
-            elems.push_back(item);
-        }
-    }
-    return elems;
-}
-
-
-
 /* Some files should always be built locally... */
 static bool
 should_always_build_locally(const string &filepath)
@@ -965,12 +884,11 @@ int analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<st
     
     if(!compile_command_folder_path.empty()) {
         string compile_command_file_path = compile_command_folder_path + "/compile_commands.json";
-        string compile_command = getCompileCommand(compile_command_file_path, job.inputFile());
-        std::vector<string> splitted_compile_command = split(compile_command, ' ');
+        std::vector<string> splitted_compile_command = getCompileCommand(compile_command_file_path, job.inputFile());
         for(auto iter = splitted_compile_command.begin(); iter < splitted_compile_command.end(); ++iter) {
             if (str_startswith("-I", iter->data())) {
                 args.append(iter->data(), Arg_Local);
-            } else if (str_startswith("-isystem", iter->data())) {
+            } else if (str_startswith("-isystem", iter->data()) && iter + 1 < splitted_compile_command.end()) {
                 args.append(iter->data(), Arg_Local);
                 iter++;
                 args.append(iter->data(), Arg_Local);
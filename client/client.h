@@ -55,6 +55,7 @@ extern int analyse_argv(const char * const *argv, CompileJob &job, bool icerun,
                         std::list<std::string> *extrafiles);
 
 /* In cpp.cpp.  */
+extern bool dcc_is_preprocessed(const std::string &sfile);
 extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1);
 extern pid_t get_clang_tidy_config(CompileJob& job, int fdwrite, int fdread);
 
@@ -69,8 +70,12 @@ extern std::string clang_get_default_target(const CompileJob &job);
 extern bool compiler_get_arch_flags(const CompileJob& job, bool march, bool mcpu, bool mtune,
     std::list<std::string>& args);
 
-/* In remote.cpp - permill is the probability it will be compiled three times */
-extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill);
+/* In remote.cpp - permill is the probability it will be compiled three times. If native is set,
+   the local daemon finds the native environment when asked for a compile server.  */
+extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill,
+                        const GetNativeEnvMsg *native = nullptr);
+extern Environments get_native_environment(const CompileJob &job, MsgChannel *local_daemon,
+                                           const GetNativeEnvMsg &request);
 
 /* safeguard.cpp */
 // We allow several recursions if icerun is involved, just in case icerun is e.g. used to invoke a script
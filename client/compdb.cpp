@@ -0,0 +1,681 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Lookup of compile commands in a compilation database (compile_commands.json).
+ *
+ * Databases of large projects have many thousands of entries, and clang-tidy
+ * is run once for every file, so scanning the whole database for every
+ * lookup does not scale. The first lookup parses the database and writes
+ * an index next to it, sorted by file name, with the position of each entry
+ * in the database. Following lookups only map the index, binary-search it
+ * and parse the one entry. The index records size, mtime (with nanoseconds,
+ * where the system has them) and inode of the database and it is rebuilt
+ * whenever they do not match.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "compdb.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+namespace
+{
+
+const char index_magic[8] = { 'I', 'C', 'E', 'C', 'D', 'B', '0', '2' };
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t db_size;
+    int64_t db_mtime;
+    int64_t db_mtime_nsec;
+    uint64_t db_inode;
+    uint32_t count;
+    uint32_t strings_size;
+};
+
+struct IndexEntry {
+    uint32_t path_offset;   // in the string table following the entries
+    uint32_t path_length;
+    uint64_t object_offset; // of the entry in the database
+    uint64_t object_length;
+};
+
+struct CompileCommand {
+    string directory;
+    string file;
+    string command;
+    vector<string> arguments;
+    bool has_arguments = false;
+};
+
+// A minimal JSON parser, just enough for compilation databases.
+class JsonParser
+{
+public:
+    JsonParser(const char *data, size_t size)
+        : m_data(data)
+        , m_size(size)
+        , m_pos(0) {}
+
+    size_t pos() const
+    {
+        return m_pos;
+    }
+
+    bool consume(char c)
+    {
+        skipSpace();
+
+        if (m_pos < m_size && m_data[m_pos] == c) {
+            ++m_pos;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool peek(char c)
+    {
+        skipSpace();
+        return m_pos < m_size && m_data[m_pos] == c;
+    }
+
+    bool parseString(string *out)
+    {
+        if (!consume('"')) {
+            return false;
+        }
+
+        while (m_pos < m_size) {
+            char c = m_data[m_pos++];
+
+            if (c == '"') {
+                return true;
+            }
+
+            if (c != '\\') {
+                if (out) {
+                    out->push_back(c);
+                }
+                continue;
+            }
+
+            if (m_pos >= m_size) {
+                return false;
+            }
+
+            c = m_data[m_pos++];
+
+            switch (c) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': {
+                if (m_pos + 4 > m_size) {
+                    return false;
+                }
+
+                unsigned long code = strtoul(string(m_data + m_pos, 4).c_str(), nullptr, 16);
+                m_pos += 4;
+
+                if (out) {
+                    appendUtf8(out, code);
+                }
+                continue;
+            }
+            default: // '"', '\\', '/'
+                break;
+            }
+
+            if (out) {
+                out->push_back(c);
+            }
+        }
+
+        return false;
+    }
+
+    bool skipValue()
+    {
+        skipSpace();
+
+        if (m_pos >= m_size) {
+            return false;
+        }
+
+        switch (m_data[m_pos]) {
+        case '"':
+            return parseString(nullptr);
+        case '{':
+            ++m_pos;
+
+            if (consume('}')) {
+                return true;
+            }
+
+            do {
+                if (!parseString(nullptr) || !consume(':') || !skipValue()) {
+                    return false;
+                }
+            } while (consume(','));
+
+            return consume('}');
+        case '[':
+            ++m_pos;
+
+            if (consume(']')) {
+                return true;
+            }
+
+            do {
+                if (!skipValue()) {
+                    return false;
+                }
+            } while (consume(','));
+
+            return consume(']');
+        default: // numbers, true, false, null
+            while (m_pos < m_size && !strchr(",]} \t\r\n", m_data[m_pos])) {
+                ++m_pos;
+            }
+
+            return true;
+        }
+    }
+
+    bool parseCommand(CompileCommand *cmd)
+    {
+        if (!consume('{')) {
+            return false;
+        }
+
+        if (consume('}')) {
+            return true;
+        }
+
+        do {
+            string key;
+
+            if (!parseString(&key) || !consume(':')) {
+                return false;
+            }
+
+            bool ok;
+
+            if (key == "directory") {
+                ok = parseString(&cmd->directory);
+            } else if (key == "file") {
+                ok = parseString(&cmd->file);
+            } else if (key == "command") {
+                ok = parseString(&cmd->command);
+            } else if (key == "arguments") {
+                ok = parseStringArray(&cmd->arguments);
+                cmd->has_arguments = true;
+            } else {
+                ok = skipValue();
+            }
+
+            if (!ok) {
+                return false;
+            }
+        } while (consume(','));
+
+        return consume('}');
+    }
+
+private:
+    void skipSpace()
+    {
+        while (m_pos < m_size && (m_data[m_pos] == ' ' || m_data[m_pos] == '\t'
+                                  || m_data[m_pos] == '\r' || m_data[m_pos] == '\n')) {
+            ++m_pos;
+        }
+    }
+
+    bool parseStringArray(vector<string> *out)
+    {
+        if (!consume('[')) {
+            return false;
+        }
+
+        if (consume(']')) {
+            return true;
+        }
+
+        do {
+            out->push_back(string());
+
+            if (!parseString(&out->back())) {
+                return false;
+            }
+        } while (consume(','));
+
+        return consume(']');
+    }
+
+    static void appendUtf8(string *out, unsigned long code)
+    {
+        if (code < 0x80) {
+            out->push_back(code);
+        } else if (code < 0x800) {
+            out->push_back(0xc0 | (code >> 6));
+            out->push_back(0x80 | (code & 0x3f));
+        } else {
+            out->push_back(0xe0 | (code >> 12));
+            out->push_back(0x80 | ((code >> 6) & 0x3f));
+            out->push_back(0x80 | (code & 0x3f));
+        }
+    }
+
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos;
+};
+
+struct IndexKey {
+    string path;
+    uint64_t object_offset;
+    uint64_t object_length;
+
+    bool operator<(const IndexKey &other) const
+    {
+        return path < other.path;
+    }
+};
+
+string indexPath(const string &compileCommandsPath)
+{
+    return compileCommandsPath + ".icecc-index";
+}
+
+// The paths a lookup for targetFilePath may find an entry under.
+vector<string> lookupPaths(const string &targetFilePath)
+{
+    vector<string> paths;
+    paths.push_back(targetFilePath);
+
+    if (!targetFilePath.empty() && targetFilePath[0] != '/') {
+        paths.push_back(get_cwd() + "/" + targetFilePath);
+    }
+
+    return paths;
+}
+
+vector<string> commandArguments(const CompileCommand &cmd)
+{
+    if (cmd.has_arguments) {
+        return cmd.arguments;
+    }
+
+    return splitCommandLine(cmd.command);
+}
+
+// A database regenerated within the same second must not match the index.
+int64_t mtimeNsec(const struct stat &st)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+    return st.st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    return st.st_mtimespec.tv_nsec;
+#else
+    (void) st;
+    return 0;
+#endif
+}
+
+bool readFile(int fd, size_t size, string *data)
+{
+    data->resize(size);
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t ret = pread(fd, &(*data)[done], size - done, done);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return false;
+        }
+
+        done += ret;
+    }
+
+    return true;
+}
+
+void writeIndex(const string &compileCommandsPath, const struct stat &st, const vector<IndexKey> &keys)
+{
+    string strings;
+    vector<IndexEntry> entries;
+    entries.reserve(keys.size());
+
+    for (const IndexKey &key : keys) {
+        IndexEntry entry;
+        entry.path_offset = strings.size();
+        entry.path_length = key.path.size();
+        entry.object_offset = key.object_offset;
+        entry.object_length = key.object_length;
+        entries.push_back(entry);
+        strings += key.path;
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, index_magic, sizeof(header.magic));
+    header.db_size = st.st_size;
+    header.db_mtime = st.st_mtime;
+    header.db_mtime_nsec = mtimeNsec(st);
+    header.db_inode = st.st_ino;
+    header.count = entries.size();
+    header.strings_size = strings.size();
+
+    string data(reinterpret_cast<const char *>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(IndexEntry));
+    data += strings;
+
+    // Several clients may build the index at the same time, so write it to
+    // a temporary file and move it into place atomically.
+    string tmp_path = indexPath(compileCommandsPath) + ".XXXXXX";
+    vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+    tmp_name.push_back('\0');
+    int fd = mkstemp(tmp_name.data());
+
+    if (fd < 0) {
+        trace() << "cannot create compilation database index: " << strerror(errno) << endl;
+        return;
+    }
+
+    bool ok = true;
+
+    for (size_t done = 0; ok && done < data.size();) {
+        ssize_t ret = write(fd, data.data() + done, data.size() - done);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ok = ret > 0;
+        done += ok ? ret : 0;
+    }
+
+    if (close(fd) != 0 || !ok || rename(tmp_name.data(), indexPath(compileCommandsPath).c_str()) != 0) {
+        trace() << "cannot write compilation database index: " << strerror(errno) << endl;
+        unlink(tmp_name.data());
+    }
+}
+
+/* Finds the entry for one of paths in the index of the database,
+   sets object_offset and object_length and returns 1 if found,
+   0 if not found and -1 if the index cannot be used. */
+int lookupIndex(const string &compileCommandsPath, const struct stat &st, const vector<string> &paths,
+                uint64_t *object_offset, uint64_t *object_length)
+{
+    int fd = open(indexPath(compileCommandsPath).c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat index_st;
+
+    if (fstat(fd, &index_st) != 0 || index_st.st_size < (off_t)sizeof(IndexHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = index_st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const char *data = static_cast<const char *>(map);
+    const IndexHeader *header = reinterpret_cast<const IndexHeader *>(data);
+    int result = -1;
+
+    if (memcmp(header->magic, index_magic, sizeof(header->magic)) == 0
+            && header->db_size == (uint64_t)st.st_size && header->db_mtime == st.st_mtime
+            && header->db_mtime_nsec == mtimeNsec(st) && header->db_inode == (uint64_t)st.st_ino
+            && size == sizeof(IndexHeader) + header->count * sizeof(IndexEntry) + header->strings_size) {
+        const IndexEntry *entries = reinterpret_cast<const IndexEntry *>(data + sizeof(IndexHeader));
+        const char *strings = data + sizeof(IndexHeader) + header->count * sizeof(IndexEntry);
+        result = 0;
+
+        for (const string &path : paths) {
+            // Binary search for the first entry for path.
+            uint32_t low = 0;
+            uint32_t high = header->count;
+
+            while (low < high) {
+                uint32_t mid = low + (high - low) / 2;
+                const IndexEntry &entry = entries[mid];
+
+                if (entry.path_offset + (uint64_t)entry.path_length > header->strings_size) {
+                    result = -1;
+                    break;
+                }
+
+                if (path.compare(0, string::npos, strings + entry.path_offset, entry.path_length) > 0) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+
+            if (result < 0) {
+                break;
+            }
+
+            if (low < header->count
+                    && path.compare(0, string::npos, strings + entries[low].path_offset,
+                                    entries[low].path_length) == 0) {
+                *object_offset = entries[low].object_offset;
+                *object_length = entries[low].object_length;
+                result = 1;
+                break;
+            }
+        }
+    }
+
+    munmap(map, size);
+    return result;
+}
+
+}
+
+vector<string> splitCommandLine(const string &command)
+{
+    vector<string> args;
+    string current;
+    bool in_arg = false;
+    char quote = '\0';
+
+    for (size_t i = 0; i < command.size(); ++i) {
+        char c = command[i];
+
+        if (quote == '\'') {
+            if (c == '\'') {
+                quote = '\0';
+            } else {
+                current += c;
+            }
+        } else if (quote == '"') {
+            if (c == '"') {
+                quote = '\0';
+            } else if (c == '\\' && i + 1 < command.size() && strchr("\"\\$`", command[i + 1])) {
+                current += command[++i];
+            } else {
+                current += c;
+            }
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (in_arg) {
+                args.push_back(current);
+                current.clear();
+                in_arg = false;
+            }
+        } else {
+            in_arg = true;
+
+            if (c == '\'' || c == '"') {
+                quote = c;
+            } else if (c == '\\' && i + 1 < command.size()) {
+                current += command[++i];
+            } else {
+                current += c;
+            }
+        }
+    }
+
+    if (in_arg) {
+        args.push_back(current);
+    }
+
+    return args;
+}
+
+vector<string> getCompileCommand(const string &compileCommandsPath, const string &targetFilePath)
+{
+    int fd = open(compileCommandsPath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw runtime_error("Cannot open compile_commands.json file.");
+    }
+
+    vector<string> paths = lookupPaths(targetFilePath);
+    uint64_t object_offset;
+    uint64_t object_length;
+    int found = lookupIndex(compileCommandsPath, st, paths, &object_offset, &object_length);
+
+    if (found > 0) {
+        string object;
+
+        if (object_offset + object_length <= (uint64_t)st.st_size) {
+            object.resize(object_length);
+            ssize_t ret;
+
+            while ((ret = pread(fd, &object[0], object_length, object_offset)) < 0 && errno == EINTR) {
+            }
+
+            CompileCommand cmd;
+            JsonParser parser(object.data(), object.size());
+
+            if (ret == (ssize_t)object_length && parser.parseCommand(&cmd)) {
+                close(fd);
+                return commandArguments(cmd);
+            }
+        }
+
+        found = -1;
+    }
+
+    if (found == 0) {
+        close(fd);
+        throw runtime_error("Compile command for the specified file was not found.");
+    }
+
+    // No usable index, parse the whole database and (re)create it.
+    string data;
+    bool read_ok = readFile(fd, st.st_size, &data);
+    close(fd);
+
+    if (!read_ok) {
+        throw runtime_error("Cannot read compile_commands.json file.");
+    }
+
+    JsonParser parser(data.data(), data.size());
+    vector<IndexKey> keys;
+    vector<CompileCommand> commands;
+
+    if (!parser.consume('[')) {
+        throw runtime_error("Invalid compile_commands.json file.");
+    }
+
+    if (!parser.consume(']')) {
+        do {
+            CompileCommand cmd;
+            parser.peek('{');
+            size_t begin = parser.pos();
+
+            if (!parser.parseCommand(&cmd)) {
+                throw runtime_error("Invalid compile_commands.json file.");
+            }
+
+            IndexKey key;
+            key.path = cmd.file;
+            key.object_offset = begin;
+            key.object_length = parser.pos() - begin;
+            keys.push_back(key);
+
+            if (!cmd.file.empty() && cmd.file[0] != '/' && !cmd.directory.empty()) {
+                key.path = cmd.directory + "/" + cmd.file;
+                keys.push_back(key);
+            }
+
+            commands.push_back(cmd);
+        } while (parser.consume(','));
+
+        if (!parser.consume(']')) {
+            throw runtime_error("Invalid compile_commands.json file.");
+        }
+    }
+
+    stable_sort(keys.begin(), keys.end());
+    writeIndex(compileCommandsPath, st, keys);
+
+    // The first entry in the file wins, like with the index.
+    for (const string &path : paths) {
+        for (const CompileCommand &cmd : commands) {
+            if (cmd.file == path || (!cmd.directory.empty() && cmd.directory + "/" + cmd.file == path)) {
+                return commandArguments(cmd);
+            }
+        }
+    }
+
+    throw runtime_error("Compile command for the specified file was not found.");
+}
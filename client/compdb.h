@@ -0,0 +1,38 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef _CLIENT_COMPDB_H_
+#define _CLIENT_COMPDB_H_
+
+#include <string>
+#include <vector>
+
+/* Returns the arguments of the compile command for targetFilePath from the
+   compile_commands.json at compileCommandsPath. Both the "command" and the
+   "arguments" forms of entries are supported. Lookups use an index stored
+   next to the database (compile_commands.json.icecc-index), which is rebuilt
+   when the database changes. Throws std::runtime_error on failure. */
+std::vector<std::string> getCompileCommand(const std::string& compileCommandsPath,
+                                           const std::string& targetFilePath);
+
+// Splits a shell command line into arguments, handling quotes and backslashes.
+std::vector<std::string> splitCommandLine(const std::string& command);
+
+#endif
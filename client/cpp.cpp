@@ -37,6 +37,7 @@
 #include <fstream>
 
 #include "client.h"
+#include "includes.h"
 
 using namespace std;
 
@@ -173,12 +174,28 @@ pid_t call_cpp(CompileJob &job, int fdwrite, int fdread)
     } else {
         list<string> flags = job.localFlags();
         appendList(flags, job.restFlags());
+        // The compile server loads the precompiled header, the output only refers to it.
+        bool pch = !job.precompiledHeader().empty();
+        bool first_include = true;
+
+        if (pch) {
+            flags.push_back("-fpch-preprocess");
+        }
 
         for (list<string>::iterator it = flags.begin(); it != flags.end();) {
             /* This has a duplicate meaning. it can either include a file
                for preprocessing or a precompiled header. decide which one.  */
-            if ((*it) == "-include") {
+            if ((*it) == "-include" && pch && first_include) {
+                ++it;
+                first_include = false;
+
+                if (it != flags.end()) {
+                    *it = precompiled_header_include(job, *it);
+                    ++it;
+                }
+            } else if ((*it) == "-include") {
                 ++it;
+                first_include = false;
 
                 if (it != flags.end()) {
                     std::string p = (*it);
@@ -204,7 +221,7 @@ pid_t call_cpp(CompileJob &job, int fdwrite, int fdread)
                         flags.erase(o);
                     }
                 }
-            } else if ((*it) == "-fpch-preprocess") {
+            } else if ((*it) == "-fpch-preprocess" && !pch) {
                 // This would add #pragma GCC pch_preprocess to the preprocessed output, which would make
                 // the remote GCC try to load the PCH directly and fail. Just drop it. This may cause a build
                 // failure if the -include check above failed to detect usage of a PCH file (e.g. because
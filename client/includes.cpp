@@ -0,0 +1,1010 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <vector>
+
+#include "client.h"
+#include "includes.h"
+#include "logging.h"
+#include "md5.h"
+#include "util.h"
+
+using namespace std;
+
+namespace
+{
+
+// The include search path of the compiler, from the output of -v.
+struct SearchPath {
+    std::vector<std::string> dirs; // as the compiler names them, the ones only for "" first
+    std::vector<bool> user;        // given with -I, the others are system directories
+    size_t quote_count = 0;
+    bool clang = false;
+    int version = 0;
+};
+
+struct Directive {
+    std::string name;
+    bool angle;
+    bool next;
+};
+
+struct Include {
+    std::string name; // as the compiler names it
+    std::string path; // absolute
+    int dir;          // index in the search path it was found in, -1 if not found there
+    bool system;
+};
+
+// Files and directories a scan depends on.
+struct Stamps {
+    std::map<std::string, std::string> paths; // with their stamps
+    time_t newest = 0;                        // latest change of any of them
+};
+
+}
+
+static string normalize_path(const string &path, const string &cwd)
+{
+    string full = path[0] == '/' ? path : cwd + "/" + path;
+    vector<string> components;
+    size_t pos = 0;
+
+    while (pos < full.size()) {
+        size_t next = full.find('/', pos);
+
+        if (next == string::npos) {
+            next = full.size();
+        }
+
+        string component = full.substr(pos, next - pos);
+
+        if (component == "..") {
+            if (!components.empty()) {
+                components.pop_back();
+            }
+        } else if (!component.empty() && component != ".") {
+            components.push_back(component);
+        }
+
+        pos = next + 1;
+    }
+
+    string result;
+
+    for (const string &component : components) {
+        result += "/" + component;
+    }
+
+    return result.empty() ? "/" : result;
+}
+
+// Changes whenever the file or directory (or which one is at path) changes.
+static string file_stamp(const string &path, time_t *changed = nullptr)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0) {
+        return "-";
+    }
+
+    if (changed) {
+        *changed = max(st.st_mtime, st.st_ctime);
+    }
+
+    return toString(st.st_dev) + ":" + toString(st.st_ino) + ":" + toString(st.st_size) + ":"
+           + toString(st.st_mtime) + ":" + toString(st.st_ctime);
+}
+
+static void add_stamp(Stamps &stamps, const string &path)
+{
+    if (stamps.paths.find(path) == stamps.paths.end()) {
+        time_t changed = 0;
+        stamps.paths[path] = file_stamp(path, &changed);
+        stamps.newest = max(stamps.newest, changed);
+    }
+}
+
+// Whether the file exists, recording the directory, which changes when files
+// are added to it, so that a cached scan does not miss new files.
+static bool is_regular_file(const string &path, Stamps &stamps)
+{
+    size_t slash = path.rfind('/');
+    add_stamp(stamps, slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash));
+
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// The files are sent with their absolute paths, which with symlinks and ..
+// may be a different file than the one the compiler finds.
+static bool same_file(const string &a, const string &b)
+{
+    struct stat sta;
+    struct stat stb;
+    return stat(a.c_str(), &sta) == 0 && stat(b.c_str(), &stb) == 0
+           && sta.st_dev == stb.st_dev && sta.st_ino == stb.st_ino;
+}
+
+static bool read_file(const string &path, string &data)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+
+        data.append(buffer, bytes);
+    }
+
+    close(fd);
+    return true;
+}
+
+static string md5_hex(const string &data)
+{
+    md5_state_t state;
+    md5_byte_t digest[16];
+    char hex[33];
+
+    md5_init(&state);
+    md5_append(&state, (const md5_byte_t *)data.data(), data.size());
+    md5_finish(&state, digest);
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(hex + di * 2, "%02x", digest[di]);
+    }
+
+    return hex;
+}
+
+static const char *language_name(CompileJob::Language language)
+{
+    switch (language) {
+    case CompileJob::Lang_C:
+        return "c";
+    case CompileJob::Lang_CXX:
+        return "c++";
+    case CompileJob::Lang_OBJC:
+        return "objective-c";
+    case CompileJob::Lang_OBJCXX:
+        return "objective-c++";
+    default:
+        return nullptr;
+    }
+}
+
+// Runs the compiler with -v to get its search path for the given flags.
+static bool get_search_path(const CompileJob &job, const list<string> &flags, SearchPath &search)
+{
+    const char *language = language_name(job.language());
+
+    if (!language) {
+        return false;
+    }
+
+    vector<string> args;
+    args.push_back(find_compiler(job));
+    args.insert(args.end(), flags.begin(), flags.end());
+    args.push_back("-x");
+    args.push_back(language);
+    args.push_back("-E");
+    args.push_back("-v");
+    args.push_back("/dev/null");
+
+    int pipes[2];
+
+    if (pipe(pipes) != 0) {
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("failed to fork:");
+        close(pipes[0]);
+        close(pipes[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(pipes[0]);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(pipes[1], STDERR_FILENO);
+
+        vector<char *> argv;
+
+        for (string &arg : args) {
+            argv.push_back(&arg[0]);
+        }
+
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(pipes[1]);
+    string output;
+    char buffer[4096];
+    ssize_t bytes;
+
+    while ((bytes = read(pipes[0], buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        output.append(buffer, bytes);
+    }
+
+    close(pipes[0]);
+    int status = 255;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (shell_exit_status(status) != 0) {
+        trace() << "getting the include search path failed" << endl;
+        return false;
+    }
+
+    enum { Other, Quote, Angle } section = Other;
+    size_t pos = 0;
+
+    while (pos < output.size()) {
+        size_t end = output.find('\n', pos);
+
+        if (end == string::npos) {
+            end = output.size();
+        }
+
+        string line = output.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (line.compare(0, 35, "#include \"...\" search starts here:") == 0) {
+            section = Quote;
+        } else if (line.compare(0, 35, "#include <...> search starts here:") == 0) {
+            section = Angle;
+        } else if (line.compare(0, 19, "End of search list.") == 0) {
+            section = Other;
+        } else if (section != Other && !line.empty() && line[0] == ' ') {
+            string dir = line.substr(1);
+
+            // Frameworks and header maps are not handled by scan_includes().
+            if (dir.find(" (") != string::npos) {
+                trace() << "unsupported include directory " << dir << endl;
+                return false;
+            }
+
+            search.dirs.push_back(dir);
+            search.user.push_back(false);
+
+            if (section == Quote) {
+                search.quote_count++;
+            }
+        } else if (line.find("clang version ") != string::npos) {
+            search.clang = true;
+            search.version = atoi(line.c_str() + line.find("clang version ") + 14);
+        } else if (line.compare(0, 12, "gcc version ") == 0) {
+            search.version = atoi(line.c_str() + 12);
+        }
+    }
+
+    return true;
+}
+
+// Replaces comments with spaces, keeping the lines.
+static string strip_comments(const string &source)
+{
+    string data = source;
+    char quote = 0;
+
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (quote) {
+            if (data[i] == '\\') {
+                ++i;
+            } else if (data[i] == quote || data[i] == '\n') {
+                quote = 0;
+            }
+        } else if (data[i] == '"' || data[i] == '\'') {
+            quote = data[i];
+        } else if (data.compare(i, 2, "//") == 0) {
+            for (; i < data.size() && data[i] != '\n'; ++i) {
+                data[i] = ' ';
+            }
+        } else if (data.compare(i, 2, "/*") == 0) {
+            size_t end = data.find("*/", i + 2);
+            end = end == string::npos ? data.size() : end + 2;
+
+            for (; i < end; ++i) {
+                if (data[i] != '\n') {
+                    data[i] = ' ';
+                }
+            }
+
+            --i;
+        }
+    }
+
+    return data;
+}
+
+// Finds the #include directives of a file, returns false if some cannot be
+// handled without preprocessing, like #include MACRO.
+static bool scan_directives(const string &source, vector<Directive> &directives)
+{
+    string data = strip_comments(source);
+    size_t pos = 0;
+    size_t has = data.find("__has_include");
+
+    while (pos < data.size()) {
+        size_t end = data.find('\n', pos);
+
+        if (end == string::npos) {
+            end = data.size();
+        }
+
+        size_t p = data.find_first_not_of(" \t", pos);
+
+        if (p < end && data[p] == '#') {
+            p = data.find_first_not_of(" \t", p + 1);
+            size_t word_end = p < end ? data.find_first_not_of("abcdefghijklmnopqrstuvwxyz_", p) : end;
+            string word = p < end ? data.substr(p, min(word_end, end) - p) : string();
+
+            if (word == "include" || word == "include_next" || word == "import") {
+                p = data.find_first_not_of(" \t", word_end);
+
+                if (p >= end || (data[p] != '"' && data[p] != '<')) {
+                    trace() << "computed include: " << data.substr(pos, end - pos) << endl;
+                    return false;
+                }
+
+                size_t name_end = data.find(data[p] == '"' ? '"' : '>', p + 1);
+
+                if (name_end >= end) {
+                    return false;
+                }
+
+                Directive directive;
+                directive.name = data.substr(p + 1, name_end - p - 1);
+                directive.angle = data[p] == '<';
+                directive.next = word == "include_next";
+                directives.push_back(directive);
+            }
+        }
+
+        // __has_include() finds files like #include, so those need to be there too.
+        for (; has < end; has = data.find("__has_include", has + 1)) {
+            p = has + 13;
+            bool next = data.compare(p, 5, "_next") == 0;
+
+            if (next) {
+                p += 5;
+            }
+
+            p = data.find_first_not_of(" \t", p);
+
+            if (p >= end || data[p] != '(') {
+                continue;
+            }
+
+            p = data.find_first_not_of(" \t", p + 1);
+
+            if (p >= end || (data[p] != '"' && data[p] != '<')) {
+                trace() << "computed __has_include: " << data.substr(pos, end - pos) << endl;
+                return false;
+            }
+
+            size_t name_end = data.find(data[p] == '"' ? '"' : '>', p + 1);
+
+            if (name_end >= end) {
+                return false;
+            }
+
+            Directive directive;
+            directive.name = data.substr(p + 1, name_end - p - 1);
+            directive.angle = data[p] == '<';
+            directive.next = next;
+            directives.push_back(directive);
+        }
+
+        pos = end + 1;
+    }
+
+    return true;
+}
+
+// Finds an included file like the compiler does.
+static bool resolve(const Directive &directive, const Include &includer, const SearchPath &search,
+                    const string &cwd, Stamps &stamps, Include &result)
+{
+    if (directive.name.empty()) {
+        return false;
+    }
+
+    if (directive.name[0] == '/') {
+        if (!is_regular_file(directive.name, stamps)) {
+            return false;
+        }
+
+        result.name = directive.name;
+        result.dir = -1;
+        result.system = includer.system;
+    } else {
+        size_t start;
+
+        if (directive.next && includer.dir >= 0) {
+            start = includer.dir + 1;
+        } else if (directive.angle) {
+            start = search.quote_count;
+        } else {
+            size_t slash = includer.name.rfind('/');
+            string candidate = slash == string::npos
+                               ? directive.name : includer.name.substr(0, slash + 1) + directive.name;
+
+            if (is_regular_file(candidate, stamps)) {
+                result.name = candidate;
+                result.dir = -1;
+                result.system = includer.system;
+                result.path = normalize_path(candidate, cwd);
+                return true;
+            }
+
+            start = 0;
+        }
+
+        size_t i = start;
+
+        for (; i < search.dirs.size(); ++i) {
+            if (is_regular_file(search.dirs[i] + "/" + directive.name, stamps)) {
+                break;
+            }
+        }
+
+        if (i >= search.dirs.size()) {
+            return false;
+        }
+
+        result.name = search.dirs[i] + "/" + directive.name;
+        result.dir = i;
+        result.system = !search.user[i];
+    }
+
+    result.path = normalize_path(result.name, cwd);
+    return true;
+}
+
+// Gets a scan of the job from the local daemon, if it has one that is still valid.
+static bool get_cached_scan(const string &key, CompileJob &job, IncludeClosure &closure)
+{
+    MsgChannel *c = get_local_daemon();
+
+    if (!c) {
+        return false;
+    }
+
+    Msg *msg = nullptr;
+
+    if (IS_PROTOCOL_VERSION(50, c) && c->send_msg(GetIncludeScanMsg(key))) {
+        msg = c->get_msg(5);
+    }
+
+    delete c;
+    IncludeScanMsg *scan = dynamic_cast<IncludeScanMsg *>(msg);
+
+    if (!scan) {
+        delete msg;
+        return false;
+    }
+
+    for (list<string>::const_iterator path = scan->stamp_paths.begin(), stamp = scan->stamps.begin();
+            path != scan->stamp_paths.end() && stamp != scan->stamps.end(); ++path, ++stamp) {
+        if (file_stamp(*path) != *stamp) {
+            trace() << "cached include scan is outdated, " << *path << " changed" << endl;
+            delete msg;
+            return false;
+        }
+    }
+
+    closure.files = scan->files;
+    closure.hashes = scan->hashes;
+    closure.dependencies = scan->dependencies;
+    job.setPreprocessorFlags(scan->flags);
+    delete msg;
+    trace() << "using cached include scan with " << closure.files.size() << " files" << endl;
+    return true;
+}
+
+static void put_cached_scan(const string &key, const CompileJob &job, const IncludeClosure &closure,
+                            const Stamps &stamps)
+{
+    // Files changed this recently may change again without a different stamp.
+    if (stamps.newest >= time(nullptr) - 1) {
+        return;
+    }
+
+    IncludeScanMsg scan;
+    scan.key = key;
+    scan.flags = job.preprocessorFlags();
+    scan.files = closure.files;
+    scan.hashes = closure.hashes;
+    scan.dependencies = closure.dependencies;
+
+    for (const pair<const string, string> &stamp : stamps.paths) {
+        scan.stamp_paths.push_back(stamp.first);
+        scan.stamps.push_back(stamp.second);
+    }
+
+    MsgChannel *c = get_local_daemon();
+
+    if (c && IS_PROTOCOL_VERSION(50, c)) {
+        c->send_msg(scan);
+    }
+
+    delete c;
+}
+
+static string escape_make(const string &name)
+{
+    string result;
+
+    for (char c : name) {
+        if (c == ' ' || c == '#') {
+            result += '\\';
+        } else if (c == '$') {
+            result += '$';
+        }
+
+        result += c;
+    }
+
+    return result;
+}
+
+bool scan_includes(CompileJob &job, IncludeClosure &closure)
+{
+    string cwd = job.workingDirectory().empty() ? get_cwd() : job.workingDirectory();
+    list<string> local_flags = job.localFlags();
+    list<string> search_flags;
+    list<string> defines;
+    list<string> user_dirs;
+    list<pair<string, string> > forced_includes;
+    bool dependencies = false;
+    bool user_dependencies_only = false;
+
+    for (list<string>::const_iterator it = local_flags.begin(); it != local_flags.end(); ++it) {
+        const string &flag = *it;
+        list<string>::const_iterator arg = next(it);
+        bool has_arg = arg != local_flags.end();
+
+        if ((flag == "-D" || flag == "-U") && has_arg) {
+            defines.push_back(flag + *arg);
+            ++it;
+        } else if (flag.compare(0, 2, "-D") == 0 || flag.compare(0, 2, "-U") == 0 || flag == "-undef") {
+            defines.push_back(flag);
+        } else if (flag == "-I" && has_arg) {
+            user_dirs.push_back(normalize_path(*arg, cwd));
+            search_flags.push_back(flag);
+            search_flags.push_back(*++it);
+        } else if (flag.compare(0, 2, "-I") == 0) {
+            user_dirs.push_back(normalize_path(flag.substr(2), cwd));
+            search_flags.push_back(flag);
+        } else if ((flag == "-iquote" || flag == "-isystem" || flag == "-idirafter"
+                    || flag == "--include-directory-after" || flag == "-isysroot"
+                    || flag == "-cxx-isystem" || flag == "-c-isystem" || flag == "-isystem-after")
+                   && has_arg) {
+            search_flags.push_back(flag);
+            search_flags.push_back(*++it);
+        } else if ((flag == "-include" || flag == "-imacros") && has_arg) {
+            forced_includes.push_back(make_pair(flag, *++it));
+        } else if (flag == "-nostdinc" || flag == "-nostdinc++") {
+            search_flags.push_back(flag);
+        } else if (flag == "-MD" || flag == "-MMD") {
+            dependencies = true;
+            user_dependencies_only = flag == "-MMD";
+        } else if (flag == "-MF" && has_arg) {
+            closure.dep_file = *++it;
+        } else if (flag == "-MT" && has_arg) {
+            closure.dep_targets.push_back(*++it);
+        } else if (flag == "-MQ" && has_arg) {
+            closure.dep_targets.push_back(escape_make(*++it));
+        } else if (flag == "-MP") {
+            closure.dep_phony_targets = true;
+        } else if (flag.compare(0, 2, "-l") == 0 || flag.compare(0, 2, "-L") == 0
+                   || flag == "-Wmissing-include-dirs" || flag == "-Werror=missing-include-dirs") {
+            // not related to preprocessing
+        } else {
+            trace() << "argument " << flag << " needs local preprocessing" << endl;
+            return false;
+        }
+    }
+
+    if (!dependencies) {
+        closure.dep_file.clear();
+        closure.dep_targets.clear();
+    } else if (closure.dep_targets.empty()) {
+        closure.dep_targets.push_back(escape_make(job.outputFile()));
+    }
+
+    appendList(search_flags, job.restFlags());
+
+    // Everything the scan depends on besides the files it finds.
+    string key = "include-scan\n" + find_compiler(job) + "\n" + toString(job.language()) + "\n"
+                 + cwd + "\n" + job.inputFile() + "\n";
+
+    for (const string &flag : local_flags) {
+        key += flag + "\n";
+    }
+
+    for (const string &flag : job.restFlags()) {
+        key += flag + "\n";
+    }
+
+    // The compiler takes search directories and its own location from these too.
+    for (const char *name : { "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH",
+                              "GCC_EXEC_PREFIX", "COMPILER_PATH", "SDKROOT" }) {
+        const char *value = getenv(name);
+
+        if (value) {
+            key += string(name) + "=" + value + "\n";
+        }
+    }
+
+    key = md5_hex(key);
+
+    if (get_cached_scan(key, job, closure)) {
+        return true;
+    }
+
+    Stamps stamps;
+    add_stamp(stamps, find_compiler(job));
+    SearchPath search;
+
+    if (!get_search_path(job, search_flags, search)) {
+        return false;
+    }
+
+    // The compiler leaves out directories that do not exist.
+    for (const string &dir : search.dirs) {
+        add_stamp(stamps, dir);
+    }
+
+    for (const string &dir : user_dirs) {
+        add_stamp(stamps, dir);
+    }
+
+    // Directories from -I come first, after them -I would not keep the order.
+    for (size_t i = search.quote_count; i < search.dirs.size(); ++i) {
+        string dir = normalize_path(search.dirs[i], cwd);
+
+        for (const string &user_dir : user_dirs) {
+            if (user_dir == dir) {
+                search.user[i] = true;
+            }
+        }
+
+        if (!search.user[i]) {
+            break;
+        }
+    }
+
+    vector<Include> includes;
+    map<string, size_t> seen;
+    Include input;
+    input.name = job.inputFile();
+    input.path = normalize_path(input.name, cwd);
+    input.dir = -1;
+    input.system = false;
+    includes.push_back(input);
+    seen[input.path] = 0;
+
+    // Files from -include are looked for in the working directory first.
+    list<string> cpp_flags;
+    Include in_cwd;
+    in_cwd.dir = -1;
+    in_cwd.system = false;
+
+    for (const pair<string, string> &forced : forced_includes) {
+        Directive directive;
+        directive.name = forced.second;
+        directive.angle = false;
+        directive.next = false;
+        Include found;
+
+        if (!resolve(directive, in_cwd, search, cwd, stamps, found)) {
+            trace() << "cannot find " << forced.second << " for " << forced.first << endl;
+            return false;
+        }
+
+        cpp_flags.push_back(forced.first);
+        cpp_flags.push_back(found.name);
+
+        if (seen.insert(make_pair(found.path, includes.size())).second) {
+            includes.push_back(found);
+        }
+    }
+
+    // GCC includes this implicitly.
+    Directive predef;
+    predef.name = "stdc-predef.h";
+    predef.angle = true;
+    predef.next = false;
+    Include found_predef;
+
+    if (resolve(predef, input, search, cwd, stamps, found_predef)
+            && seen.insert(make_pair(found_predef.path, includes.size())).second) {
+        includes.push_back(found_predef);
+    }
+
+    for (size_t i = 0; i < includes.size(); ++i) {
+        // copied, includes may grow below
+        Include includer = includes[i];
+
+        if (includer.name != includer.path && !same_file(includer.name, includer.path)) {
+            trace() << includer.name << " is not at " << includer.path << endl;
+            return false;
+        }
+
+        string data;
+        vector<Directive> directives;
+        add_stamp(stamps, includer.path);
+
+        if (!read_file(includer.path, data)) {
+            log_perror("reading") << "\t" << includer.path << endl;
+            return false;
+        }
+
+        closure.files.push_back(includer.path);
+        closure.hashes.push_back(md5_hex(data));
+
+        if (dependencies && (!user_dependencies_only || !includer.system)) {
+            closure.dependencies.push_back(includer.name);
+        }
+
+        if (!scan_directives(data, directives)) {
+            return false;
+        }
+
+        for (const Directive &directive : directives) {
+            Include found;
+
+            // Files that are not found may be in an #if that is not used,
+            // if not, the compile server reports them as missing.
+            if (resolve(directive, includer, search, cwd, stamps, found)
+                    && seen.insert(make_pair(found.path, includes.size())).second) {
+                includes.push_back(found);
+            }
+        }
+    }
+
+    // The compile server gets all of the search path explicitly, mapped into
+    // the directory with the files.
+    list<string> flags;
+    flags.push_back("-nostdinc");
+
+    if (job.language() == CompileJob::Lang_CXX || job.language() == CompileJob::Lang_OBJCXX) {
+        flags.push_back("-nostdinc++");
+    }
+
+    appendList(flags, defines);
+
+    for (size_t i = 0; i < search.dirs.size(); ++i) {
+        flags.push_back(i < search.quote_count ? "-iquote" : search.user[i] ? "-I" : "-isystem");
+        flags.push_back(search.dirs[i]);
+    }
+
+    appendList(flags, cpp_flags);
+
+    // Keeps __FILE__ from showing where the files are on the compile server.
+    if (search.version >= (search.clang ? 10 : 8)) {
+        flags.push_back("-fmacro-prefix-map=/=/");
+    }
+
+    job.setPreprocessorFlags(flags);
+    put_cached_scan(key, job, closure, stamps);
+    trace() << "sending " << closure.files.size() << " files for preprocessing remotely" << endl;
+    return true;
+}
+
+// The md5 of a file too large to read into memory at once.
+static bool file_md5(const string &path, string &hash)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    md5_state_t state;
+    md5_byte_t digest[16];
+    char hex[33];
+    unsigned char buffer[65536];
+    ssize_t bytes;
+
+    md5_init(&state);
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+
+        md5_append(&state, buffer, bytes);
+    }
+
+    close(fd);
+    md5_finish(&state, digest);
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(hex + di * 2, "%02x", digest[di]);
+    }
+
+    hash = hex;
+    return true;
+}
+
+string precompiled_header_include(const CompileJob &job, const string &include)
+{
+    string cwd = normalize_path(job.workingDirectory().empty() ? get_cwd() : job.workingDirectory(), "/");
+    string path = normalize_path(include, cwd);
+
+    if (cwd != "/") {
+        cwd += "/";
+    }
+
+    // strip the common directories, each remaining one of cwd is a ..
+    size_t common = 0;
+
+    for (size_t i = 0; i < min(path.size(), cwd.size()) && path[i] == cwd[i]; ++i) {
+        if (cwd[i] == '/') {
+            common = i + 1;
+        }
+    }
+
+    string result;
+
+    for (size_t i = common; i < cwd.size(); ++i) {
+        if (cwd[i] == '/') {
+            result += "../";
+        }
+    }
+
+    return result + path.substr(common);
+}
+
+bool find_precompiled_header(CompileJob &job, IncludeClosure &closure)
+{
+    // GCC only uses a precompiled header for the first -include.
+    list<string> flags = job.localFlags();
+    list<string>::const_iterator it = find(flags.begin(), flags.end(), "-include");
+
+    if (it == flags.end() || ++it == flags.end()) {
+        return false;
+    }
+
+    string cwd = job.workingDirectory().empty() ? get_cwd() : job.workingDirectory();
+    string pch = normalize_path(*it, cwd) + ".gch";
+    struct stat st;
+
+    // The path the server gets it with must be where the compiler finds it.
+    if (stat(pch.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || access(pch.c_str(), R_OK) != 0
+            || !same_file(pch, precompiled_header_include(job, *it) + ".gch")) {
+        return false;
+    }
+
+    // Hashing is slow for large files, so the local daemon remembers the hash.
+    string key = md5_hex("precompiled-header\n" + pch);
+    Stamps stamps;
+    add_stamp(stamps, pch);
+
+    if (!get_cached_scan(key, job, closure)) {
+        string hash;
+
+        if (!file_md5(pch, hash)) {
+            log_perror("reading") << "\t" << pch << endl;
+            return false;
+        }
+
+        closure.files.push_back(pch);
+        closure.hashes.push_back(hash);
+        put_cached_scan(key, job, closure, stamps);
+    }
+
+    job.setPrecompiledHeader(pch);
+    trace() << "sending precompiled header " << pch << endl;
+    return true;
+}
+
+bool write_dependency_file(const IncludeClosure &closure)
+{
+    if (closure.dep_file.empty()) {
+        return true;
+    }
+
+    string text;
+
+    for (const string &target : closure.dep_targets) {
+        text += (text.empty() ? "" : " ") + target;
+    }
+
+    text += ":";
+
+    for (const string &dependency : closure.dependencies) {
+        text += " \\\n " + escape_make(dependency);
+    }
+
+    text += "\n";
+
+    if (closure.dep_phony_targets && !closure.dependencies.empty()) {
+        list<string>::const_iterator it = closure.dependencies.begin();
+
+        for (++it; it != closure.dependencies.end(); ++it) {
+            text += "\n" + escape_make(*it) + ":\n";
+        }
+    }
+
+    FILE *file = fopen(closure.dep_file.c_str(), "w");
+
+    if (!file) {
+        log_perror("fopen") << "\t" << closure.dep_file << endl;
+        return false;
+    }
+
+    bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
@@ -0,0 +1,63 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef _CLIENT_INCLUDES_H_
+#define _CLIENT_INCLUDES_H_
+
+#include <list>
+#include <string>
+
+class CompileJob;
+
+/* What a compile server needs to preprocess a job itself. */
+struct IncludeClosure {
+    // Absolute paths of the input file and all files it may include, the input file first.
+    std::list<std::string> files;
+    // md5 of the contents of files.
+    std::list<std::string> hashes;
+    // The dependency file requested with -MD or -MMD, empty if none.
+    std::string dep_file;
+    std::list<std::string> dep_targets;
+    // Files for the dependency file, named as the compiler would name them.
+    std::list<std::string> dependencies;
+    bool dep_phony_targets = false;
+};
+
+/* Finds the files the job may include by scanning for #include directives
+   (ignoring conditionals, so it may find more than needed) and sets the
+   flags for preprocessing the job on the compile server. Returns false if
+   the job needs to be preprocessed locally, e.g. for computed includes.
+   Scans are cached by the local daemon and reused while none of the files
+   and directories they depend on change.  */
+extern bool scan_includes(CompileJob &job, IncludeClosure &closure);
+
+/* Finds the GCC precompiled header loaded by the first -include of the job,
+   which the compile server then gets sent, and sets it in the job. The
+   closure gets the precompiled header as its only file.  */
+extern bool find_precompiled_header(CompileJob &job, IncludeClosure &closure);
+
+// The argument for -include that lets the compiler find the precompiled header
+// relative to the working directory, where the compile server has it too.
+extern std::string precompiled_header_include(const CompileJob &job, const std::string &include);
+
+// Writes the dependency file requested with -MD or -MMD, if any.
+extern bool write_dependency_file(const IncludeClosure &closure);
+
+#endif
@@ -93,12 +93,18 @@ static void dcc_show_usage()
         "   ICECC_CC                   set C compiler name (default gcc).\n"
         "   ICECC_CXX                  set C++ compiler name (default g++).\n"
         "   ICECC_REMOTE_CPP           set to 1 or 0 to override remote preprocessing\n"
+        "   ICECC_SEND_HEADERS         set to 1 to send headers instead of preprocessing locally,\n"
+        "                              the compile host preprocesses the source itself\n"
+        "   ICECC_PIPELINE_CPP         set to 0 to not preprocess while waiting for a compile host\n"
+        "   ICECC_REMOTE_PCH           set to 1 to send a GCC precompiled header loaded with -include\n"
+        "                              to the compile host instead of preprocessing its contents\n"
         "   ICECC_IGNORE_UNVERIFIED    if set, hosts where environment cannot be verified are not used.\n"
         "   ICECC_EXTRAFILES           additional files used in the compilation.\n"
         "   ICECC_COLOR_DIAGNOSTICS    set to 1 or 0 to override color diagnostics support.\n"
         "   ICECC_CARET_WORKAROUND     set to 1 or 0 to override gcc show caret workaround.\n"
         "   ICECC_COMPRESSION          if set, the libzstd compression level (1 to 19, default: 1)\n"
         "   ICECC_ENV_COMPRESSION      compression type for icecc environments [none|gzip|bzip2|zstd|xz]\n"
+        "   ICECC_ENV_CACHE_DIR        directory to reuse icecc environments built from the same files\n"
         "   ICECC_SLOW_NETWORK         set to 1 to send network data in smaller chunks\n"
         );
 }
@@ -189,6 +195,11 @@ static int create_native(char **args)
         argv.push_back(strdup(env_compression));
     }
 
+    if( const char* env_cache_dir = getenv( "ICECC_ENV_CACHE_DIR" )) {
+        argv.push_back(strdup("--cache-dir"));
+        argv.push_back(strdup(env_cache_dir));
+    }
+
     argv.push_back(nullptr);
     execv(argv[0], argv.data());
     ostringstream errmsg;
@@ -197,36 +208,6 @@ static int create_native(char **args)
     return 1;
 }
 
-static MsgChannel* get_local_daemon()
-{
-    MsgChannel* local_daemon;
-    if (getenv("ICECC_TEST_SOCKET") == nullptr) {
-        /* try several options to reach the local daemon - 3 sockets, one TCP */
-        local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
-
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("/var/run/iceccd.socket");
-        }
-
-        if (!local_daemon && getenv("HOME")) {
-            string path = getenv("HOME");
-            path += "/.iceccd.socket";
-            local_daemon = Service::createChannel(path);
-        }
-
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
-        }
-    } else {
-        local_daemon = Service::createChannel(getenv("ICECC_TEST_SOCKET"));
-        if (!local_daemon) {
-            log_error() << "test socket error" << endl;
-            exit( EXIT_TEST_SOCKET_ERROR );
-        }
-    }
-    return local_daemon;
-}
-
 static void debug_arguments(int argc, char** argv, bool original)
 {
     string argstxt = argv[ 0 ];
@@ -461,6 +442,8 @@ int main(int argc, char **argv)
     }
 
     Environments envs;
+    GetNativeEnvMsg native_request;
+    bool native_with_cs = false;
 
     if (!local) {
         if (getenv("ICECC_VERSION")) {     // if set, use it, otherwise take default
@@ -475,7 +458,6 @@ int main(int argc, char **argv)
             log_warning() << "Local daemon is too old to handle extra files." << endl;
             local = true;
         } else {
-            Msg *umsg = nullptr;
             string compiler;
             if( IS_PROTOCOL_VERSION(41, local_daemon))
                 compiler = get_absfilename( find_compiler( job ));
@@ -484,35 +466,18 @@ int main(int argc, char **argv)
             string env_compression; // empty = default
             if( const char* icecc_env_compression = getenv( "ICECC_ENV_COMPRESSION" ))
                 env_compression = icecc_env_compression;
-            trace() << "asking for native environment for " << compiler << endl;
-            if (!local_daemon->send_msg(GetNativeEnvMsg(compiler, extrafiles,
-                env_compression))) {
-                log_warning() << "failed to write get native environment" << endl;
-                local = true;
-            } else {
-                // the timeout is high because it creates the native version
-                umsg = local_daemon->get_msg(4 * 60);
-            }
-
-            string native;
+            native_request = GetNativeEnvMsg(compiler, extrafiles, env_compression);
 
-            if (umsg && *umsg == Msg::NATIVE_ENV) {
-                native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
-            }
-
-            if (native.empty() || ::access(native.c_str(), R_OK) < 0) {
-                log_warning() << "daemon can't determine native environment. "
-                              "Set $ICECC_VERSION to an icecc environment.\n";
+            // Newer daemons find it when asked for a compile server, saving a round trip.
+            if (IS_PROTOCOL_VERSION(52, local_daemon)) {
+                native_with_cs = true;
             } else {
-                envs.push_back(make_pair(job.targetPlatform(), native));
-                log_info() << "native " << native << endl;
+                envs = get_native_environment(job, local_daemon, native_request);
             }
-
-            delete umsg;
         }
 
         // we set it to local so we tell the local daemon about it - avoiding file locking
-        if (envs.size() == 0) {
+        if (envs.size() == 0 && !native_with_cs) {
             local = true;
         }
 
@@ -535,7 +500,8 @@ int main(int argc, char **argv)
             const char *s = getenv("ICECC_REPEAT_RATE");
             int rate = s ? atoi(s) : 0;
 
-            ret = build_remote(job, local_daemon, envs, rate);
+            ret = build_remote(job, local_daemon, envs, rate,
+                               native_with_cs ? &native_request : nullptr);
 
             /* We have to tell the local daemon that everything is fine and
                that the remote daemon will send the scheduler our done msg.
@@ -37,12 +37,14 @@
 
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 #include <limits.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -50,6 +52,7 @@
 
 #include <comm.h>
 #include "client.h"
+#include "includes.h"
 #include "tempfile.h"
 #include "md5.h"
 #include "util.h"
@@ -239,11 +242,130 @@ static int get_niceness()
     return niceness;
 }
 
-static UseCSMsg *get_server(MsgChannel *local_daemon)
+/* Output of a cpp started before asking for a compile server, kept in memory
+   while waiting so that preprocessing overlaps with the wait. The local cpu
+   is locked while cpp runs.  */
+struct CppSpool {
+    // How much output to keep, cpp blocks on the pipe after that.
+    static const size_t max_size = 16 * 1024 * 1024;
+
+    pid_t pid = -1;
+    int fd = -1;            // the pipe from cpp, -1 after its end
+    bool reaped = false;
+    int status = 255;
+    bool locked = false;
+    string data;            // output not sent yet
+
+    ~CppSpool() { cancel(); }
+
+    // Reads what cpp has written, false on error.
+    bool read_some();
+    // Waits for cpp after the end of its output and unlocks the cpu.
+    void finish();
+    // Stops cpp, e.g. when compiling locally after all.
+    void cancel();
+};
+
+bool CppSpool::read_some()
+{
+    size_t old_size = data.size();
+    data.resize(old_size + 65536);
+    ssize_t bytes;
+
+    while ((bytes = read(fd, &data[old_size], 65536)) < 0 && errno == EINTR) {}
+
+    data.resize(old_size + max(bytes, ssize_t(0)));
+
+    if (bytes < 0) {
+        log_perror("reading from cpp");
+        return false;
+    }
+
+    if (bytes == 0) {
+        trace() << "cpp done while waiting, " << data.size() << " bytes" << endl;
+        finish();
+    }
+
+    return true;
+}
+
+void CppSpool::finish()
+{
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (pid > 0 && !reaped) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+        reaped = true;
+    }
+
+    if (locked) {
+        dcc_unlock();
+        locked = false;
+    }
+}
+
+void CppSpool::cancel()
+{
+    if (pid > 0 && !reaped) {
+        kill(pid, SIGTERM);
+    }
+
+    finish();
+    data.clear();
+}
+
+// Keeps reading cpp output until the local daemon replies or the spool is full.
+static void fill_spool(CppSpool *spool, MsgChannel *local_daemon, time_t deadline)
+{
+    while (spool->fd != -1 && spool->data.size() < CppSpool::max_size
+           && !local_daemon->has_msg()) {
+        time_t left = deadline - time(nullptr);
+
+        if (left <= 0) {
+            break;
+        }
+
+        pollfd pfd[2];
+        pfd[0].fd = local_daemon->fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = spool->fd;
+        pfd[1].events = POLLIN;
+
+        if (poll(pfd, 2, left * 1000) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("poll for cpp");
+            break;
+        }
+
+        // get_msg() reads the reply
+        if (pfd[0].revents) {
+            break;
+        }
+
+        if (pfd[1].revents && !spool->read_some()) {
+            break;
+        }
+    }
+}
+
+static UseCSMsg *get_server(MsgChannel *local_daemon, CppSpool *spool = nullptr)
 {
     int timeout = 4 * 60;
     if( get_niceness() > 0 ) // low priority jobs may take longer to get a slot assigned
         timeout = 60 * 60;
+
+    if (spool) {
+        time_t deadline = time(nullptr) + timeout;
+        fill_spool(spool, local_daemon, deadline);
+        timeout = max(int(deadline - time(nullptr)), 1);
+    }
+
     Msg *umsg = local_daemon->get_msg( timeout );
 
     if (!umsg || *umsg != Msg::USE_CS) {
@@ -258,6 +380,53 @@ static UseCSMsg *get_server(MsgChannel *local_daemon)
     return usecs;
 }
 
+Environments get_native_environment(const CompileJob &job, MsgChannel *local_daemon,
+                                    const GetNativeEnvMsg &request)
+{
+    Environments envs;
+    Msg *umsg = nullptr;
+
+    trace() << "asking for native environment for " << request.compiler << endl;
+    if (!local_daemon->send_msg(request)) {
+        log_warning() << "failed to write get native environment" << endl;
+        return envs;
+    }
+
+    // the timeout is high because it creates the native version
+    umsg = local_daemon->get_msg(4 * 60);
+
+    string native;
+
+    if (umsg && *umsg == Msg::NATIVE_ENV) {
+        native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
+    }
+
+    if (native.empty() || ::access(native.c_str(), R_OK) < 0) {
+        log_warning() << "daemon can't determine native environment. "
+                      "Set $ICECC_VERSION to an icecc environment.\n";
+    } else {
+        envs.push_back(make_pair(job.targetPlatform(), native));
+        log_info() << "native " << native << endl;
+    }
+
+    delete umsg;
+    return envs;
+}
+
+// For when the native environment is needed before asking for a compile server.
+static Environments
+get_native_versions(const CompileJob &job, MsgChannel *local_daemon, const GetNativeEnvMsg &request,
+                    map<string, string> &version_map, map<string, string> &versionfile_map)
+{
+    Environments envs = get_native_environment(job, local_daemon, request);
+
+    if (envs.empty()) {
+        throw client_error(22, "Error 22 - no native environment");
+    }
+
+    return rip_out_paths(envs, version_map, versionfile_map);
+}
+
 static void check_for_failure(Msg *msg, MsgChannel *cserver)
 {
     if (msg && *msg == Msg::STATUS_TEXT) {
@@ -268,6 +437,26 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
+static bool send_chunk(unsigned char *buffer, size_t len, MsgChannel *cserver,
+                       size_t &uncompressed, size_t &compressed)
+{
+    FileChunkMsg fcmsg(buffer, len);
+
+    if (!cserver->send_msg(fcmsg)) {
+        Msg *m = cserver->get_msg(2);
+        check_for_failure(m, cserver);
+
+        log_error() << "write of source chunk to host "
+                    << cserver->name.c_str() << endl;
+        log_perror("failed ");
+        return false;
+    }
+
+    uncompressed += fcmsg.len;
+    compressed += fcmsg.compressed;
+    return true;
+}
+
 // 'unlock_sending' = dcc_lock_host() is held when this is called, temporarily yield the lock
 // while doing network transfers
 static void write_fd_to_server(int fd, MsgChannel *cserver)
@@ -300,21 +489,11 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
 
         if (!bytes || offset == sizeof(buffer)) {
             if (offset) {
-                FileChunkMsg fcmsg(buffer, offset);
-
-                if (!cserver->send_msg(fcmsg)) {
-                    Msg *m = cserver->get_msg(2);
-                    check_for_failure(m, cserver);
-
-                    log_error() << "write of source chunk to host "
-                                << cserver->name.c_str() << endl;
-                    log_perror("failed ");
+                if (!send_chunk(buffer, offset, cserver, uncompressed, compressed)) {
                     close(fd);
                     throw client_error(15, "Error 15 - write to host failed");
                 }
 
-                uncompressed += fcmsg.len;
-                compressed += fcmsg.compressed;
                 offset = 0;
             }
 
@@ -333,6 +512,38 @@ static void write_fd_to_server(int fd, MsgChannel *cserver)
     }
 }
 
+// Sends the spooled and the remaining cpp output, returns the status of cpp.
+static int write_spool_to_server(CppSpool *spool, MsgChannel *cserver)
+{
+    size_t uncompressed = 0;
+    size_t compressed = 0;
+
+    for (size_t sent = 0; sent < spool->data.size(); sent += 100000) {
+        size_t len = min(spool->data.size() - sent, size_t(100000));
+
+        if (!send_chunk(reinterpret_cast<unsigned char *>(&spool->data[sent]), len, cserver,
+                        uncompressed, compressed)) {
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+    }
+
+    if (compressed)
+        trace() << "sent " << compressed << " spooled bytes (" << (compressed * 100 / uncompressed)
+                << "%)" << endl;
+
+    spool->data.clear();
+
+    if (spool->fd != -1) {
+        int fd = spool->fd;
+        spool->fd = -1; // closed by write_fd_to_server()
+        write_fd_to_server(fd, cserver);
+    }
+
+    log_block wait_cpp("wait for cpp");
+    spool->finish();
+    return spool->status;
+}
+
 static void receive_file(const string& output_file, MsgChannel* cserver)
 {
     string tmp_file = output_file + "_icetmp";
@@ -408,9 +619,103 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
     }
 }
 
+// Ask the remote to get the environment from another daemon instead of sending it ourselves.
+static bool fetch_env_from_peer(const CompileJob &job, UseCSMsg *usecs, MsgChannel *cserver)
+{
+    log_block b("Fetch Environment");
+    trace() << "asking " << cserver->name << " to get environment from " << usecs->env_peer_host
+            << ":" << usecs->env_peer_port << endl;
+
+    EnvFetchMsg msg(job.targetPlatform(), job.environmentVersion(), usecs->env_peer_host,
+                    usecs->env_peer_port);
+
+    if (!cserver->send_msg(msg)) {
+        throw client_error(6, "Error 6 - send environment to remote failed");
+    }
+
+    Msg *result = cserver->get_msg(MAX_BUSY_INSTALLING);
+
+    if (!result || *result != Msg::VERIFY_ENV_RESULT) {
+        check_for_failure(result, cserver);
+        delete result;
+        throw client_error(33, "Error 33 - error getting environment from another remote");
+    }
+
+    bool ok = static_cast<VerifyEnvResultMsg*>(result)->ok;
+    delete result;
+
+    if (!ok) {
+        log_info() << "remote " << cserver->name << " could not get the environment from "
+                   << usecs->env_peer_host << ", sending it" << endl;
+    }
+
+    return ok;
+}
+
+// Sends the list of files for preprocessing on the compile server, and then those it doesn't have.
+static void send_headers(const IncludeClosure &headers, MsgChannel *cserver)
+{
+    if (!cserver->send_msg(HeaderListMsg(headers.files, headers.hashes))) {
+        throw client_error(9, "Error 9 - error sending file to remote");
+    }
+
+    Msg *msg = cserver->get_msg(60);
+    check_for_failure(msg, cserver);
+    HeaderListMsg *missing = dynamic_cast<HeaderListMsg*>(msg);
+
+    if (!missing) {
+        delete msg;
+        throw client_error(20, "Error 20 - unexpected message");
+    }
+
+    trace() << "sending " << missing->files.size() << " of " << headers.files.size()
+            << " files to " << cserver->name << endl;
+
+    // Only files of the closure may be sent, whatever the server asks for.
+    set<pair<string, string> > closure;
+
+    for (list<string>::const_iterator file = headers.files.begin(), hash = headers.hashes.begin();
+            file != headers.files.end() && hash != headers.hashes.end(); ++file, ++hash) {
+        closure.insert(make_pair(*file, *hash));
+    }
+
+    if (missing->files.size() != missing->hashes.size()) {
+        delete msg;
+        throw client_error(20, "Error 20 - unexpected message");
+    }
+
+    for (list<string>::const_iterator it = missing->files.begin(), hash = missing->hashes.begin();
+            it != missing->files.end(); ++it, ++hash) {
+        if (!closure.count(make_pair(*it, *hash))) {
+            log_error() << cserver->name << " asked for " << *it << ", which is not to be sent" << endl;
+            delete msg;
+            throw client_error(20, "Error 20 - unexpected message");
+        }
+
+        int fd = open(it->c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            delete msg;
+            throw client_error(16, "Error 16 - error reading local file");
+        }
+
+        write_fd_to_server(fd, cserver);
+
+        if (!cserver->send_msg(EndMsg())) {
+            delete msg;
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+    }
+
+    delete msg;
+}
+
 static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
                             const string &environment, const string &version_file,
-                            const char *preproc_file, bool output)
+                            const char *preproc_file, bool output,
+                            CompileResultMsg *result = nullptr,
+                            const IncludeClosure *headers = nullptr,
+                            CppSpool *spool = nullptr)
 {
     string hostname = usecs->hostname;
     unsigned int port = usecs->port;
@@ -437,7 +742,13 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw client_error(2, "Error 2 - no server found at " + hostname);
         }
 
-        if (!got_env) {
+        bool fetched_env = false;
+
+        if (!got_env && !usecs->env_peer_host.empty() && IS_PROTOCOL_VERSION(46, cserver)) {
+            fetched_env = fetch_env_from_peer(job, usecs, cserver);
+        }
+
+        if (!got_env && !fetched_env) {
             log_block b("Transfer Environment");
             // transfer env
             struct stat buf;
@@ -448,8 +759,10 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
 
             EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
+            // A running cpp already holds the lock.
+            bool lock_env = !spool || !spool->locked;
 
-            if (!dcc_lock_host()) {
+            if (lock_env && !dcc_lock_host()) {
                 log_error() << "can't lock for local cpp" << endl;
                 return EXIT_DISTCC_FAILED;
             }
@@ -471,38 +784,40 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                 throw client_error(8, "Error 8 - write environment to remote failed");
             }
 
-            dcc_unlock();
+            if (lock_env) {
+                dcc_unlock();
+            }
+        }
 
-            if (IS_PROTOCOL_VERSION(31, cserver)) {
-                VerifyEnvMsg verifymsg(job.targetPlatform(), job.environmentVersion());
+        if (!got_env && IS_PROTOCOL_VERSION(31, cserver)) {
+            VerifyEnvMsg verifymsg(job.targetPlatform(), job.environmentVersion());
 
-                if (!cserver->send_msg(verifymsg)) {
-                    throw client_error(22, "Error 22 - error sending environment");
-                }
+            if (!cserver->send_msg(verifymsg)) {
+                throw client_error(22, "Error 22 - error sending environment");
+            }
 
-                Msg *verify_msg = cserver->get_msg(60);
-
-                if (verify_msg && *verify_msg == Msg::VERIFY_ENV_RESULT) {
-                    if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
-                        // The remote can't handle the environment at all (e.g. kernel too old),
-                        // mark it as never to be used again for this environment.
-                        log_warning() << "Host " << hostname
-                                      << " did not successfully verify environment."
-                                      << endl;
-                        BlacklistHostEnvMsg blacklist(job.targetPlatform(),
-                                                      job.environmentVersion(), hostname);
-                        local_daemon->send_msg(blacklist);
-                        delete verify_msg;
-                        throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
-                    } else
-                        trace() << "Verified host " << hostname << " for environment "
-                                << job.environmentVersion() << " (" << job.targetPlatform() << ")"
-                                << endl;
+            Msg *verify_msg = cserver->get_msg(60);
+
+            if (verify_msg && *verify_msg == Msg::VERIFY_ENV_RESULT) {
+                if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
+                    // The remote can't handle the environment at all (e.g. kernel too old),
+                    // mark it as never to be used again for this environment.
+                    log_warning() << "Host " << hostname
+                                  << " did not successfully verify environment."
+                                  << endl;
+                    BlacklistHostEnvMsg blacklist(job.targetPlatform(),
+                                                  job.environmentVersion(), hostname);
+                    local_daemon->send_msg(blacklist);
                     delete verify_msg;
-                } else {
-                    delete verify_msg;
-                    throw client_error(25, "Error 25 - other error verifying environment on remote");
-                }
+                    throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
+                } else
+                    trace() << "Verified host " << hostname << " for environment "
+                            << job.environmentVersion() << " (" << job.targetPlatform() << ")"
+                            << endl;
+                delete verify_msg;
+            } else {
+                delete verify_msg;
+                throw client_error(25, "Error 25 - other error verifying environment on remote");
             }
         }
 
@@ -518,11 +833,14 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             job.appendFlag( job.language() == CompileJob::Lang_OBJC ? "objective-c" : "objective-c++", Arg_Remote );
         }
 
-        if (!dcc_lock_host()) {
+        // Sending headers doesn't need the local cpu, so no lock then.
+        if (!headers && !spool && !dcc_lock_host()) {
             log_error() << "can't lock for local cpp" << endl;
             return EXIT_DISTCC_FAILED;
         }
 
+        // Input that is streamed from cpp arrives at its pace, not at the network's.
+        job.setInputReady(preproc_file || (spool && spool->fd == -1));
         CompileFileMsg compile_file(&job);
         {
             log_block b("send compile_file");
@@ -533,37 +851,55 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
         }
 
-        if (!preproc_file) {
-            int sockets[2];
+        if (headers) {
+            log_block b("send headers");
+            send_headers(*headers, cserver);
 
-            if (create_large_pipe(sockets) != 0) {
-                log_perror("build_remote_in pipe");
-                /* for all possible cases, this is something severe */
-                throw client_error(32, "Error 18 - (fork error?)");
+            // only the precompiled header, the source is preprocessed here
+            if (!job.remotePreprocessing() && !dcc_lock_host()) {
+                log_error() << "can't lock for local cpp" << endl;
+                return EXIT_DISTCC_FAILED;
             }
+        }
 
-            HostUnlock hostUnlock; // automatic dcc_unlock()
+        if (job.remotePreprocessing()) {
+            // the compile server has everything it needs
+        } else if (!preproc_file) {
+            if (spool) {
+                log_block bl2("write spooled cpp output to server");
+                status = write_spool_to_server(spool, cserver);
+            } else {
+                int sockets[2];
 
-            /* This will fork, and return the pid of the child.  It will not
-               return for the child itself.  If it returns normally it will have
-               closed the write fd, i.e. sockets[1].  */
-            pid_t cpp_pid = call_cpp(job, sockets[1], sockets[0]);
+                if (create_large_pipe(sockets) != 0) {
+                    log_perror("build_remote_in pipe");
+                    /* for all possible cases, this is something severe */
+                    throw client_error(32, "Error 18 - (fork error?)");
+                }
 
-            if (cpp_pid == -1) {
-                throw client_error(18, "Error 18 - (fork error?)");
-            }
+                HostUnlock hostUnlock; // automatic dcc_unlock()
 
-            try {
-                log_block bl2("write_fd_to_server from cpp");
-                write_fd_to_server(sockets[0], cserver);
-            } catch (...) {
-                kill(cpp_pid, SIGTERM);
-                throw;
-            }
+                /* This will fork, and return the pid of the child.  It will not
+                   return for the child itself.  If it returns normally it will have
+                   closed the write fd, i.e. sockets[1].  */
+                pid_t cpp_pid = call_cpp(job, sockets[1], sockets[0]);
 
-            log_block wait_cpp("wait for cpp");
+                if (cpp_pid == -1) {
+                    throw client_error(18, "Error 18 - (fork error?)");
+                }
+
+                try {
+                    log_block bl2("write_fd_to_server from cpp");
+                    write_fd_to_server(sockets[0], cserver);
+                } catch (...) {
+                    kill(cpp_pid, SIGTERM);
+                    throw;
+                }
+
+                log_block wait_cpp("wait for cpp");
 
-            while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
+                while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
+            }
 
             if (shell_exit_status(status) != 0) {   // failure
                 delete cserver;
@@ -693,6 +1029,14 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         }
 
         bool have_dwo_file = crmsg->have_dwo_file;
+
+        if (result) {
+            result->status = status;
+            result->out = crmsg->out;
+            result->err = crmsg->err;
+            result->have_dwo_file = have_dwo_file;
+        }
+
         delete crmsg;
 
         if (status == 0 && !job.outputFile().empty()) {
@@ -766,7 +1110,7 @@ md5_for_file(const string & file)
 
 static bool
 maybe_build_local(MsgChannel *local_daemon, UseCSMsg *usecs, CompileJob &job,
-                  int &ret)
+                  int &ret, CppSpool *spool = nullptr)
 {
     remote_daemon = usecs->hostname;
 
@@ -776,6 +1120,11 @@ maybe_build_local(MsgChannel *local_daemon, UseCSMsg *usecs, CompileJob &job,
         if (getenv("ICECC_TEST_REMOTEBUILD") && usecs->port != 0 )
             return false;
         trace() << "building myself, but telling localhost\n";
+
+        if (spool) {
+            spool->cancel();
+        }
+
         int job_id = usecs->job_id;
         job.setJobID(job_id);
         job.setEnvironmentVersion("__client");
@@ -838,12 +1187,24 @@ static int minimalRemoteVersion( const CompileJob& job)
         version = max(version, 35);
     }
 
+    if (job.remotePreprocessing()) {
+        version = max(version, 49);
+    }
+
+    if (!job.precompiledHeader().empty()) {
+        version = max(version, 51);
+    }
+
     return version;
 }
 
-static unsigned int requiredRemoteFeatures()
+static unsigned int requiredRemoteFeatures(const CompileJob &job)
 {
     unsigned int features = 0;
+    if (job.remotePreprocessing())
+        features = features | NODE_FEATURE_REMOTE_CPP;
+    if (!job.precompiledHeader().empty())
+        features = features | NODE_FEATURE_PCH;
     if (const char* icecc_env_compression = getenv( "ICECC_ENV_COMPRESSION" )) {
         if( strcmp( icecc_env_compression, "xz" ) == 0 )
             features = features | NODE_FEATURE_ENV_XZ;
@@ -853,7 +1214,295 @@ static unsigned int requiredRemoteFeatures()
     return features;
 }
 
-int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill)
+static bool send_headers_wanted(const CompileJob &job)
+{
+    const char *env = getenv("ICECC_SEND_HEADERS");
+
+    if (!env || *env == '\0' || *env == '0') {
+        return false;
+    }
+
+    return !compiler_is_clang_tidy(job) && !dcc_is_preprocessed(job.inputFile());
+}
+
+// Only GCC's precompiled headers are supported, and only with the same compiler
+// on the compile server, so this needs to be enabled explicitly.
+static bool remote_pch_wanted(const CompileJob &job)
+{
+    const char *env = getenv("ICECC_REMOTE_PCH");
+
+    if (!env || *env == '\0' || *env == '0') {
+        return false;
+    }
+
+    return !compiler_is_clang(job) && !compiler_is_clang_tidy(job) && !dcc_is_preprocessed(job.inputFile());
+}
+
+// Whether to preprocess while waiting for the compile server, on by default.
+static bool pipeline_cpp_wanted(const CompileJob &job)
+{
+    const char *env = getenv("ICECC_PIPELINE_CPP");
+
+    if (env && *env == '0') {
+        return false;
+    }
+
+    return !compiler_is_clang_tidy(job);
+}
+
+static bool start_spool(CompileJob &job, CppSpool &spool)
+{
+    int sockets[2];
+
+    if (create_large_pipe(sockets) != 0) {
+        log_perror("start_spool pipe");
+        return false;
+    }
+
+    // Without a free slot preprocessing waits until there is a compile server.
+    if (!dcc_lock_host(false)) {
+        trace() << "no cpp slot free, not preprocessing ahead" << endl;
+        close(sockets[0]);
+        close(sockets[1]);
+        return false;
+    }
+
+    spool.locked = true;
+    spool.pid = call_cpp(job, sockets[1], sockets[0]);
+
+    if (spool.pid == -1) {
+        close(sockets[0]);
+        spool.finish();
+        return false;
+    }
+
+    spool.fd = sockets[0];
+    return true;
+}
+
+static bool local_result_cache_enabled()
+{
+    MsgChannel *c = get_local_daemon();
+
+    if (!c) {
+        return false;
+    }
+
+    // An empty key asks whether there is a cache, which is answered by END.
+    bool enabled = false;
+
+    if (IS_PROTOCOL_VERSION(48, c) && c->send_msg(GetResultMsg(string()))) {
+        Msg *msg = c->get_msg(5);
+        enabled = msg && *msg == Msg::END;
+        delete msg;
+    }
+
+    delete c;
+    return enabled;
+}
+
+// Preprocesses the job into preproc_file and returns the key for the result
+// in the local cache, or an empty string if preprocessing failed.
+static string preprocess_for_result_cache(const CompileJob &_job, const Environments &envs,
+                                          const char *preproc_file, const IncludeClosure *pch)
+{
+    CompileJob job = _job;
+    md5_state_t state;
+    md5_init(&state);
+
+    string info = "local-result\n";
+
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        info += it->first + "/" + it->second + "\n";
+    }
+
+    // The preprocessed source only has the path of the precompiled header.
+    if (pch) {
+        info += "pch\n" + pch->hashes.front() + "\n";
+    }
+
+    list<string> fields = job.resultKeyFields();
+
+    for (list<string>::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+        info += *it + '\0';
+    }
+
+    md5_append(&state, (const md5_byte_t *)info.c_str(), info.size() + 1);
+
+    int cpp_fd = open(preproc_file, O_WRONLY | O_TRUNC);
+    int sockets[2];
+
+    if (cpp_fd < 0 || create_large_pipe(sockets) != 0) {
+        if (cpp_fd >= 0) {
+            close(cpp_fd);
+        }
+        return string();
+    }
+
+    if (!dcc_lock_host()) {
+        close(cpp_fd);
+        close(sockets[0]);
+        close(sockets[1]);
+        return string();
+    }
+
+    HostUnlock hostUnlock; // automatic dcc_unlock()
+    pid_t cpp_pid = call_cpp(job, sockets[1], sockets[0]);
+
+    if (cpp_pid == -1) {
+        close(cpp_fd);
+        close(sockets[0]);
+        return string();
+    }
+
+    bool ok = true;
+    md5_byte_t buffer[100000];
+
+    for (;;) {
+        ssize_t bytes = read(sockets[0], buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            ok = bytes == 0;
+            break;
+        }
+
+        md5_append(&state, buffer, bytes);
+
+        if (write(cpp_fd, buffer, bytes) != bytes) {
+            ok = false;
+            break;
+        }
+    }
+
+    close(sockets[0]);
+
+    if (close(cpp_fd) != 0) {
+        ok = false;
+    }
+
+    int status = 255;
+
+    while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (!ok || shell_exit_status(status) != 0) {
+        return string();
+    }
+
+    md5_byte_t digest[16];
+    md5_finish(&state, digest);
+    char hex[33];
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(hex + di * 2, "%02x", digest[di]);
+    }
+
+    return hex;
+}
+
+// Gets the result for key from the local daemon, returns false if it has none.
+static bool get_cached_result(CompileJob &job, const string &key)
+{
+    MsgChannel *c = get_local_daemon();
+
+    if (!c) {
+        return false;
+    }
+
+    Msg *msg = nullptr;
+
+    if (c->send_msg(GetResultMsg(key))) {
+        msg = c->get_msg(60);
+    }
+
+    CompileResultMsg *crmsg = dynamic_cast<CompileResultMsg*>(msg);
+
+    if (!crmsg || crmsg->status != 0) {
+        delete msg;
+        delete c;
+        return false;
+    }
+
+    trace() << "using cached result " << key << endl;
+
+    try {
+        receive_file(job.outputFile(), c);
+        if (crmsg->have_dwo_file) {
+            string dwo_output = job.outputFile().substr(0, job.outputFile().rfind('.')) + ".dwo";
+            receive_file(dwo_output, c);
+        }
+    } catch (const client_error &error) {
+        log_warning() << "getting cached result failed: " << error.what() << endl;
+        delete crmsg;
+        delete c;
+        return false;
+    }
+
+    ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
+
+    if (colorify_wanted(job)) {
+        colorify_output(crmsg->err);
+    } else {
+        ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
+    }
+
+    delete crmsg;
+    delete c;
+    return true;
+}
+
+// Gives the result of a successful remote compile to the local daemon to keep.
+static void put_cached_result(const CompileJob &job, const string &key, const CompileResultMsg &result)
+{
+    MsgChannel *c = get_local_daemon();
+
+    if (!c) {
+        return;
+    }
+
+    try {
+        if (!c->send_msg(PutResultMsg(key)) || !c->send_msg(result)) {
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+
+        int obj_fd = open(job.outputFile().c_str(), O_RDONLY);
+
+        if (obj_fd < 0) {
+            throw client_error(16, "Error 16 - error reading local file");
+        }
+
+        write_fd_to_server(obj_fd, c);
+
+        if (!c->send_msg(EndMsg())) {
+            throw client_error(15, "Error 15 - write to host failed");
+        }
+
+        if (result.have_dwo_file) {
+            string dwo_output = job.outputFile().substr(0, job.outputFile().rfind('.')) + ".dwo";
+            int dwo_fd = open(dwo_output.c_str(), O_RDONLY);
+
+            if (dwo_fd < 0) {
+                throw client_error(16, "Error 16 - error reading local file");
+            }
+
+            write_fd_to_server(dwo_fd, c);
+
+            if (!c->send_msg(EndMsg())) {
+                throw client_error(15, "Error 15 - write to host failed");
+            }
+        }
+    } catch (const client_error &error) {
+        log_warning() << "caching result failed: " << error.what() << endl;
+    }
+
+    delete c;
+}
+
+int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill,
+                 const GetNativeEnvMsg *native)
 {
     srand(time(nullptr) + getpid());
 
@@ -877,7 +1526,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
     map<string, string> versionfile_map, version_map;
     Environments envs = rip_out_paths(_envs, version_map, versionfile_map);
 
-    if (!envs.size()) {
+    if (!envs.size() && !native) {
         log_error() << "$ICECC_VERSION needs to point to .tar files" << endl;
         throw client_error(22, "Error 22 - $ICECC_VERSION needs to point to .tar files");
     }
@@ -885,6 +1534,45 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
     const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
 
     if (torepeat == 1) {
+        // With a result cache in the local daemon, preprocess first, so that
+        // repeated compiles need neither the scheduler nor a compile server.
+        // Otherwise preprocessing is overlapped with waiting for the server.
+        char *preproc = nullptr;
+        string result_key;
+        IncludeClosure pch;
+        bool remote_pch = remote_pch_wanted(job) && find_precompiled_header(job, pch);
+
+        if (!job.outputFile().empty() && !compiler_is_clang_tidy(job)
+            && local_result_cache_enabled()) {
+            // The key for the result includes the environment.
+            if (native) {
+                envs = get_native_versions(job, local_daemon, *native, version_map, versionfile_map);
+                native = nullptr;
+            }
+
+            dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
+            result_key = preprocess_for_result_cache(job, envs, preproc, remote_pch ? &pch : nullptr);
+
+            if (!result_key.empty() && get_cached_result(job, result_key)) {
+                ::unlink(preproc);
+                free(preproc);
+                return 0;
+            }
+
+            // On failure preprocess again the usual way, which handles the errors.
+            if (result_key.empty()) {
+                ::unlink(preproc);
+                free(preproc);
+                preproc = nullptr;
+            }
+        }
+
+        const CharBufferDeleter preproc_holder(preproc);
+
+        // Or let the compile server preprocess, sending it the headers.
+        IncludeClosure headers;
+        bool remote_cpp = !preproc && !remote_pch && send_headers_wanted(job)
+                          && scan_includes(job, headers);
         string fake_filename;
         list<string> args = job.remoteFlags();
 
@@ -903,32 +1591,83 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         GetCSMsg getcs(envs, fake_filename, job.language(), torepeat,
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
-                       minimalRemoteVersion(job), requiredRemoteFeatures(),
+                       minimalRemoteVersion(job), requiredRemoteFeatures(job),
                        get_niceness());
 
+        if (native) {
+            getcs.native_compiler = native->compiler;
+            getcs.native_extrafiles = native->extrafiles;
+            getcs.native_compression = native->compression;
+        }
+
+        // Preprocess while the scheduler picks a compile server.
+        CppSpool spool;
+        bool spooled = !preproc && !remote_cpp && !remote_pch && pipeline_cpp_wanted(job)
+                       && start_spool(job, spool);
+
         trace() << "asking for host to use" << endl;
         if (!local_daemon->send_msg(getcs)) {
             log_warning() << "asked for CS" << endl;
             throw client_error(24, "Error 24 - asked for CS");
         }
 
-        UseCSMsg *usecs = get_server(local_daemon);
+        UseCSMsg *usecs = get_server(local_daemon, spooled ? &spool : nullptr);
         int ret;
+        CompileResultMsg result;
+        result.status = 255;
 
         try {
-            if (!maybe_build_local(local_daemon, usecs, job, ret))
+            if (!maybe_build_local(local_daemon, usecs, job, ret, spooled ? &spool : nullptr)) {
+                if (native) {
+                    string native_env = usecs->native_env;
+
+                    if (native_env.empty() || ::access(native_env.c_str(), R_OK) < 0) {
+                        log_warning() << "daemon can't determine native environment. "
+                                      "Set $ICECC_VERSION to an icecc environment.\n";
+                        throw client_error(22, "Error 22 - no native environment");
+                    }
+
+                    log_info() << "native " << native_env << endl;
+                    rip_out_paths(Environments(1, make_pair(job.targetPlatform(), native_env)),
+                                  version_map, versionfile_map);
+                }
+
                 ret = build_remote_int(job, usecs, local_daemon,
                                        version_map[usecs->host_platform],
                                        versionfile_map[usecs->host_platform],
-                                       nullptr, true);
+                                       preproc, true, &result,
+                                       remote_cpp ? &headers : remote_pch ? &pch : nullptr,
+                                       spooled ? &spool : nullptr);
+
+                // The compiler didn't run here to write it.
+                if (remote_cpp && ret == 0 && !write_dependency_file(headers)) {
+                    log_error() << "failed to write dependency file " << headers.dep_file << endl;
+                    ret = EXIT_DISTCC_FAILED;
+                }
+            }
         } catch(...) {
             delete usecs;
+            if (preproc) {
+                ::unlink(preproc);
+            }
             throw;
         }
 
         delete usecs;
+
+        if (preproc) {
+            if (ret == 0 && result.status == 0) {
+                put_cached_result(job, result_key, result);
+            }
+            ::unlink(preproc);
+        }
+
         return ret;
     } else {
+        if (native) {
+            envs = get_native_versions(job, local_daemon, *native, version_map, versionfile_map);
+        }
+
         char *preproc = nullptr;
         dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
         const CharBufferDeleter preproc_holder(preproc);
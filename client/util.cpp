@@ -163,9 +163,64 @@ static bool dcc_open_lockfile(const string &fname, int &plockfd)
 
 static bool dcc_lock_host_slot(string fname, int lock, bool block);
 
-bool dcc_lock_host()
+/**
+ * Get a slot from the local daemon, which hands them out in order as they
+ * become free and takes the load into account. The slot is held until the
+ * connection is closed. Without BLOCK, BUSY is set if the daemon has no slot
+ * free right now.
+ **/
+static bool dcc_lock_host_daemon(bool block, bool &busy)
+{
+    const char *icecc = getenv("ICECC");
+
+    if (icecc && strcasecmp(icecc, "disable") == 0) {
+        return false;
+    }
+
+    MsgChannel *daemon = get_local_daemon();
+
+    if (!daemon) {
+        return false;
+    }
+
+    bool locked = false;
+
+    // Older daemons would always make us wait.
+    if (!block && IS_PROTOCOL_VERSION(53, daemon) && !IS_PROTOCOL_VERSION(57, daemon)) {
+        busy = true;
+    } else if (IS_PROTOCOL_VERSION(53, daemon) && daemon->send_msg(CppSlotMsg(block))) {
+        Msg *msg = daemon->get_msg(40 * 60);
+
+        if (msg && *msg == Msg::CPP_SLOT) {
+            lock_fd = dup(daemon->fd);
+
+            if (lock_fd != -1) {
+                set_cloexec_flag(lock_fd, true);
+                locked = true;
+            }
+        } else if (msg && *msg == Msg::END) {
+            busy = true;
+        }
+
+        delete msg;
+    }
+
+    delete daemon;
+    return locked;
+}
+
+bool dcc_lock_host(bool block)
 {
     assert(lock_fd == -1);
+    bool busy = false;
+
+    if (dcc_lock_host_daemon(block, busy)) {
+        return true;
+    }
+
+    if (busy) {
+        return false;
+    }
 
     string fname = "/tmp/.icecream-";
     struct passwd *pwd = getpwuid(getuid());
@@ -195,6 +250,10 @@ bool dcc_lock_host()
             return true;
     }
     // If not, block on the first selected one.
+    if (!block) {
+        lock_fd = -1;
+        return false;
+    }
     return dcc_lock_host_slot( fname, lock_offset % max_cpu, true );
 }
 
@@ -369,3 +428,33 @@ std::string get_cwd()
 
     return string(&buffer[0]);
 }
+
+MsgChannel* get_local_daemon()
+{
+    MsgChannel* local_daemon;
+    if (getenv("ICECC_TEST_SOCKET") == nullptr) {
+        /* try several options to reach the local daemon - 3 sockets, one TCP */
+        local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
+
+        if (!local_daemon) {
+            local_daemon = Service::createChannel("/var/run/iceccd.socket");
+        }
+
+        if (!local_daemon && getenv("HOME")) {
+            string path = getenv("HOME");
+            path += "/.iceccd.socket";
+            local_daemon = Service::createChannel(path);
+        }
+
+        if (!local_daemon) {
+            local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
+        }
+    } else {
+        local_daemon = Service::createChannel(getenv("ICECC_TEST_SOCKET"));
+        if (!local_daemon) {
+            log_error() << "test socket error" << endl;
+            exit( EXIT_TEST_SOCKET_ERROR );
+        }
+    }
+    return local_daemon;
+}
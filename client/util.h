@@ -28,6 +28,7 @@
 #include "services/util.h"
 
 class CompileJob;
+class MsgChannel;
 
 /* util.c */
 extern int set_cloexec_flag(int desc, int value);
@@ -41,10 +42,13 @@ extern bool ignore_unverified();
 extern int resolve_link(const std::string &file, std::string &resolved);
 extern std::string get_cwd();
 
-extern bool dcc_lock_host();
+extern bool dcc_lock_host(bool block = true);
 extern void dcc_unlock();
 extern int dcc_locked_fd();
 
+// Connects to the local daemon, returns nullptr if it is not running.
+extern MsgChannel *get_local_daemon();
+
 class HostUnlock
 {
 public:
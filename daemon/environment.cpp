@@ -33,17 +33,35 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#ifdef HAVE_UNSHARE
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/statvfs.h>
+#endif
 
 #include "comm.h"
 #include "exitcode.h"
+#include "md5.h"
+#include "pipes.h"
 #include "util.h"
 
+#include <set>
+
 #include <archive.h>
 #include <archive_entry.h>
 
 using namespace std;
 
-size_t sumup_dir(const string &dir)
+#ifdef HAVE_UNSHARE
+// Remote jobs in user and mount namespaces instead of a chroot as root,
+// see init_namespace_sandbox().
+static bool namespace_sandbox = false;
+#endif
+
+/* Files with more links than one are counted once, and not at all if they are shared
+   through the store, which is counted by cleanup_env_store().  */
+size_t sumup_dir(const string &dir, const set<ino_t> &stored, set<ino_t> &counted)
 {
     size_t res = 0;
     DIR *envdir = opendir(dir.c_str());
@@ -67,8 +85,9 @@ size_t sumup_dir(const string &dir)
         }
 
         if (S_ISDIR(st.st_mode)) {
-            res += sumup_dir(tdir + ent->d_name);
-        } else if (S_ISREG(st.st_mode)) {
+            res += sumup_dir(tdir + ent->d_name, stored, counted);
+        } else if (S_ISREG(st.st_mode)
+                   && (st.st_nlink == 1 || (!stored.count(st.st_ino) && counted.insert(st.st_ino).second))) {
             res += st.st_size;
         }
 
@@ -220,7 +239,7 @@ Environments available_environments(const string &basedir)
 // Returns fd for icecc-create-env output
 int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
                      const std::string &compiler, const list<string> &extrafiles,
-                     const std::string &compression)
+                     const std::string &compression, const std::string &cachedir)
 {
     string nativedir = basedir + "/native/";
     if (mkdir(nativedir.c_str(), 0775) && errno != EEXIST) {
@@ -319,6 +338,10 @@ int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
         setenv( "ICECC_ENV_COMPRESSION", compression.c_str(), 1 );
     }
 
+    if (!cachedir.empty()) {
+        setenv( "ICECC_ENV_CACHE_DIR", cachedir.c_str(), 1 );
+    }
+
     if (!exec_and_wait(argv)) {
         log_error() << BINDIR "/icecc --build-native failed" << endl;
         _exit(1);
@@ -371,7 +394,125 @@ size_t finish_create_env(int pipe, const string &basedir, string &native_environ
 
 
 
-static int copy_data(struct archive *ar, struct archive *aw)
+// Received tarballs are kept next to the installed environment to be sent to other daemons.
+string env_tarball_path(const string &basedir, const string &env)
+{
+    return basedir + "/target=" + env + ".tarball";
+}
+
+static string env_store_dir(const string &basedir)
+{
+    return basedir + "/store";
+}
+
+// Removes store files no environment links to anymore, returns the size of the rest.
+size_t cleanup_env_store(const string &basedir)
+{
+    string storedir = env_store_dir(basedir);
+    DIR *dir = opendir(storedir.c_str());
+
+    if (!dir) {
+        return 0;
+    }
+
+    size_t res = 0;
+
+    while (dirent *f = readdir(dir)) {
+        if (f->d_name[0] == '.') {
+            continue;
+        }
+
+        string fullpath = storedir + '/' + f->d_name;
+        struct stat st;
+
+        if (lstat(fullpath.c_str(), &st) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (st.st_nlink == 1) {
+            if (unlink(fullpath.c_str()) != 0) {
+                log_perror("unlink failed") << "\t" << fullpath << endl;
+            }
+        } else {
+            res += st.st_size;
+        }
+    }
+
+    closedir(dir);
+    return res;
+}
+
+static set<ino_t> env_store_inodes(const string &basedir)
+{
+    set<ino_t> inodes;
+    string storedir = env_store_dir(basedir);
+    DIR *dir = opendir(storedir.c_str());
+
+    if (!dir) {
+        return inodes;
+    }
+
+    while (dirent *f = readdir(dir)) {
+        struct stat st;
+
+        if (f->d_name[0] != '.' && lstat((storedir + '/' + f->d_name).c_str(), &st) == 0) {
+            inodes.insert(st.st_ino);
+        }
+    }
+
+    closedir(dir);
+    return inodes;
+}
+
+/* Files linked into several environments must not be changed by a job of any of them.
+   Jobs run as the uid owning the files, so that only holds if the environment is
+   mounted read-only for them.  */
+static bool env_files_read_only()
+{
+#ifdef HAVE_UNSHARE
+    return namespace_sandbox;
+#else
+    return false;
+#endif
+}
+
+// Replaces the file by a hardlink to an identical one already in the store,
+// or adds it to the store if it's the first one with this content.
+static void dedup_env_file(const string &storedir, const string &file, const md5_byte_t digest[16])
+{
+    struct stat st;
+
+    if (lstat(file.c_str(), &st) || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+        return;
+    }
+
+    // Hardlinks share the mode, so files differing only in it must not be merged.
+    char name[48];
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(name + di * 2, "%02x", digest[di]);
+    }
+
+    sprintf(name + 32, "-%o", (unsigned int)(st.st_mode & 07777));
+    string stored = storedir + "/" + name;
+
+    if (link(file.c_str(), stored.c_str()) == 0 || errno != EEXIST) {
+        return;
+    }
+
+    string tmpfile = file + ".icecc-dedup";
+
+    if (link(stored.c_str(), tmpfile.c_str()) != 0) {
+        return;
+    }
+
+    if (rename(tmpfile.c_str(), file.c_str()) != 0) {
+        log_perror("rename failed") << "\t" << file << endl;
+        unlink(tmpfile.c_str());
+    }
+}
+
+static int copy_data(struct archive *ar, struct archive *aw, md5_state_t *state)
 {
     int r;
     const void *buff;
@@ -387,6 +528,8 @@ static int copy_data(struct archive *ar, struct archive *aw)
         if (r == ARCHIVE_EOF){
             return (ARCHIVE_OK);
         }
+        md5_append(state, (const md5_byte_t *)&offset, sizeof(offset));
+        md5_append(state, (const md5_byte_t *)buff, size);
         r= archive_write_data_block(aw, buff, size, offset);
         if(r != ARCHIVE_OK){
             trace() << "copy_data(): Error after write: "<< archive_error_string(aw)<<endl;
@@ -395,6 +538,57 @@ static int copy_data(struct archive *ar, struct archive *aw)
     }
 }
 
+// Decompresses the environment tarball from in_fd and writes the plain tar to out_fd.
+static bool decompress_environment(int in_fd, int out_fd)
+{
+    struct archive *a = archive_read_new();
+    archive_read_support_filter_all(a);
+    archive_read_support_format_raw(a);
+
+    struct archive_entry *entry;
+    bool ok = archive_read_open_fd(a, in_fd, 65536) == ARCHIVE_OK
+              && archive_read_next_header(a, &entry) == ARCHIVE_OK;
+
+    if (!ok) {
+        log_error() << "decompress_environment: " << archive_error_string(a) << endl;
+    }
+
+    char buffer[65536];
+
+    while (ok) {
+        la_ssize_t size = archive_read_data(a, buffer, sizeof(buffer));
+
+        if (size == 0) {
+            break;
+        }
+
+        if (size < 0) {
+            log_error() << "decompress_environment: " << archive_error_string(a) << endl;
+            ok = false;
+            break;
+        }
+
+        for (la_ssize_t off = 0; off < size;) {
+            ssize_t bytes = write(out_fd, buffer + off, size - off);
+
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes < 0) {
+                // the extraction has failed or already finished
+                ok = false;
+                break;
+            }
+
+            off += bytes;
+        }
+    }
+
+    archive_read_free(a);
+    return ok;
+}
+
 pid_t start_install_environment(const std::string &basename, const std::string &target,
                                 const std::string &name, MsgChannel *c,
                                 int &pipe_to_child, int &pipe_from_child, FileChunkMsg *&fmsg,
@@ -416,6 +610,7 @@ pid_t start_install_environment(const std::string &basename, const std::string &
     }
 
     string dirname = basename + "/target=" + target;
+    string storedir = env_store_dir(basename);
     Msg *msg = c->get_msg(30);
 
     if (!msg || *msg != Msg::FILE_CHUNK) {
@@ -435,6 +630,15 @@ pid_t start_install_environment(const std::string &basename, const std::string &
         return 0;
     }
 
+    // Without the store environments are simply not deduplicated.
+    if (!env_files_read_only()) {
+        storedir.clear();
+    } else if (mkdir(storedir.c_str(), 0770) && errno != EEXIST) {
+        log_perror("mkdir store") << "\t" << storedir << endl;
+    } else if (chown(storedir.c_str(), user_uid, user_gid) || chmod(storedir.c_str(), 0770)) {
+        log_perror("chown,chmod store") << "\t" << storedir << endl;
+    }
+
     dirname = dirname + "/" + name;
 
     if (mkdir(dirname.c_str(), 0770)) {
@@ -450,7 +654,7 @@ pid_t start_install_environment(const std::string &basename, const std::string &
     int fds_in[2]; // for receiving data
     int fds_out[2]; // for sending out final status
 
-    if (pipe(fds_in) == -1 || pipe(fds_out) == -1) {
+    if (create_large_pipe(fds_in) == -1 || pipe(fds_out) == -1) {
         log_perror("start_install_environment: pipe creation failed for receiving environment");
         return 0;
     }
@@ -517,16 +721,40 @@ pid_t start_install_environment(const std::string &basename, const std::string &
         log_warning() << "failed to set nice value: " << strerror(errno) << endl;
     }
 
+    // Decompress in another process, so that decompressing and writing
+    // out the files run in parallel.
+    int fds_tar[2];
+
+    if (create_large_pipe(fds_tar) == -1) {
+        log_perror("start_install_environment: pipe creation failed for decompressing");
+        _exit(1);
+    }
+
+    pid_t decompress_pid = fork();
+
+    if (decompress_pid == -1) {
+        log_perror("start_install_environment: fork() for decompressing failed");
+        _exit(1);
+    }
+
+    if (decompress_pid == 0) {
+        close(fds_tar[0]);
+        close(fds_out[1]);
+        _exit(decompress_environment(fds_in[0], fds_tar[1]) ? 0 : 1);
+    }
+
+    close(fds_in[0]);
+    close(fds_tar[1]);
+
     /* libarchive stream reader */
     struct archive *a;
     struct archive *ext;
     struct archive_entry *entry;
     int flags;
 
+    // ACLs and file flags are not used by environments, restoring them costs syscalls per file
     flags = ARCHIVE_EXTRACT_TIME;
     flags |= ARCHIVE_EXTRACT_PERM;
-    flags |= ARCHIVE_EXTRACT_ACL;
-    flags |= ARCHIVE_EXTRACT_FFLAGS;
 
     a=archive_read_new();
     archive_read_support_format_all(a);
@@ -535,7 +763,7 @@ pid_t start_install_environment(const std::string &basename, const std::string &
     archive_write_disk_set_options(ext, flags);
     archive_write_disk_set_standard_lookup(ext);
 
-    if(archive_read_open_fd(a, fds_in[0], fmsg->len) != ARCHIVE_OK){
+    if(archive_read_open_fd(a, fds_tar[0], 65536) != ARCHIVE_OK){
         log_error() << "start_install_environment: archive_read_open_fd() failed"<< endl;
         _exit(1);
     }
@@ -557,8 +785,13 @@ pid_t start_install_environment(const std::string &basename, const std::string &
         archive_entry_set_pathname(entry, fullOutputPath.c_str());
         r = archive_write_header(ext, entry);
 
+        md5_state_t state;
+        md5_init(&state);
+        bool dedup = !storedir.empty() && archive_entry_filetype(entry) == AE_IFREG && archive_entry_hardlink(entry) == nullptr
+                     && archive_entry_size(entry) > 0;
+
         if(archive_entry_size(entry) > 0){
-            r= copy_data(a, ext);
+            r= copy_data(a, ext, &state);
             if(r < ARCHIVE_WARN){
                 log_error()<< "start_install_environment: " << archive_error_string(ext)<<endl;
                 _exit(1);
@@ -569,6 +802,12 @@ pid_t start_install_environment(const std::string &basename, const std::string &
             log_error() << "start_install_environment: " << archive_error_string(ext)<<endl;
             _exit(1);
         }
+
+        if (dedup) {
+            md5_byte_t digest[16];
+            md5_finish(&state, digest);
+            dedup_env_file(storedir, fullOutputPath, digest);
+        }
     }
     archive_read_close(a);
     archive_read_free(a);
@@ -576,6 +815,19 @@ pid_t start_install_environment(const std::string &basename, const std::string &
     archive_write_free(ext);
     /*libarchive stream reader ends*/
 
+    // Trailing bytes after the end of the archive are not read anymore,
+    // so the decompressing process may get killed by SIGPIPE.
+    close(fds_tar[0]);
+    int status;
+
+    while (waitpid(decompress_pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            && !(WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE)) {
+        log_error() << "start_install_environment: decompressing failed" << endl;
+        _exit(1);
+    }
+
     // Tell our parent that we have successfully finished.
     char resultByte = 0;
     ignore_result(write(fds_out[1], &resultByte, 1));
@@ -597,12 +849,73 @@ size_t finalize_install_environment(const std::string &basename, const std::stri
                     << strerror(errno) << endl;
     }
 
-    return sumup_dir(dirname);
+    set<ino_t> counted;
+    size_t size = sumup_dir(dirname, env_store_inodes(basename), counted);
+    struct stat st;
+
+    if (stat(env_tarball_path(basename, target).c_str(), &st) == 0) {
+        size += st.st_size;
+    }
+
+    return size;
+}
+
+// Returns the pid of the child sending the tarball, 0 if there is nothing to send
+pid_t start_send_environment(const string &basedir, const string &target, const string &name,
+                             MsgChannel *c)
+{
+    string tarball = env_tarball_path(basedir, target + "/" + name);
+    int fd = open(tarball.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        trace() << "no tarball to send for " << target << "/" << name << endl;
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("start_send_environment - fork()");
+        close(fd);
+        return 0;
+    }
+
+    if (pid) {
+        close(fd);
+        return pid;
+    }
+
+    reset_debug();
+    bool ok = c->send_msg(EnvTransferMsg(target, name));
+    unsigned char buffer[100000];
+
+    while (ok) {
+        ssize_t bytes = read(fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            ok = bytes == 0;
+            break;
+        }
+
+        ok = c->send_msg(FileChunkMsg(buffer, bytes));
+    }
+
+    if (ok) {
+        ok = c->send_msg(EndMsg());
+    }
+
+    _exit(ok ? 0 : 1);
 }
 
 void remove_environment_files(const string &basename, const string &env)
 {
     string dirname = basename + "/target=" + env;
+    string tarball = env_tarball_path(basename, env);
 
     flush_debug();
     pid_t pid = fork();
@@ -628,12 +941,13 @@ void remove_environment_files(const string &basename, const string &env)
     // else
 
     char **argv;
-    argv = new char*[5];
+    argv = new char*[6];
     argv[0] = strdup("/bin/rm");
     argv[1] = strdup("-rf");
     argv[2] = strdup("--");
     argv[3] = strdup(dirname.c_str());
-    argv[4] = nullptr;
+    argv[4] = strdup(tarball.c_str());
+    argv[5] = nullptr;
 
     execv(argv[0], argv);
     ostringstream errmsg;
@@ -657,6 +971,25 @@ void remove_native_environment_files(const string &env)
     }
 }
 
+// The name of the native environment tarball without the path and suffix, as clients
+// name environments when asking the scheduler for a compile server.
+string native_environment_version(const string &env)
+{
+    static const char *suffs[] = { ".tar.xz", ".tar.zst", ".tar.bz2", ".tar.gz", ".tar", ".tgz", nullptr };
+
+    string version = find_basename(env);
+
+    for (int i = 0; suffs[i] != nullptr; i++) {
+        size_t len = strlen(suffs[i]);
+
+        if (version.size() > len && version.compare(version.size() - len, len, suffs[i]) == 0) {
+            return version.substr(0, version.size() - len);
+        }
+    }
+
+    return version;
+}
+
 static void
 error_client(MsgChannel *client, string error)
 {
@@ -665,8 +998,175 @@ error_client(MsgChannel *client, string error)
     }
 }
 
-void chdir_to_environment(MsgChannel *client, const string &dirname, uid_t user_uid, gid_t user_gid)
+#ifdef HAVE_UNSHARE
+static bool write_proc_file(const char *path, const string &content)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = write(fd, content.c_str(), content.size()) == ssize_t(content.size());
+    close(fd);
+    return ok;
+}
+
+static bool enter_namespaces(uid_t user_uid, gid_t user_gid)
 {
+    // Never compile as root, not even as root inside the namespace.
+    if (getuid() == 0
+            && (setgroups(0, nullptr) < 0 || setgid(user_gid) < 0 || setuid(user_uid) < 0)) {
+        log_perror("dropping privileges failed");
+        return false;
+    }
+
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS) < 0) {
+        log_perror("unshare() failed");
+        return false;
+    }
+
+    // Changing ids, or the daemon, made us non-dumpable, which keeps the id maps from us.
+    prctl(PR_SET_DUMPABLE, 1);
+
+    // The ids stay the same inside.  Older kernels don't have the setgroups file.
+    if ((!write_proc_file("/proc/self/setgroups", "deny") && errno != ENOENT)
+            || !write_proc_file("/proc/self/uid_map", toString(uid) + " " + toString(uid) + " 1")
+            || !write_proc_file("/proc/self/gid_map", toString(gid) + " " + toString(gid) + " 1")) {
+        log_perror("writing user namespace id maps failed");
+        return false;
+    }
+
+    // Nothing mounted for the job shows up outside of it.
+    if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) < 0) {
+        log_perror("making mounts private failed");
+        return false;
+    }
+
+    return true;
+}
+
+static void enter_namespace_sandbox(MsgChannel *client, const string &dirname,
+                                    uid_t user_uid, gid_t user_gid, size_t tmpfs_size)
+{
+    if (!enter_namespaces(user_uid, user_gid)) {
+        error_client(client, "cannot create namespaces for the environment");
+        _exit(146);
+    }
+
+    // The environment read-only, except for /tmp.  The flags the kernel locks
+    // for mounts in a user namespace have to be kept.
+    unsigned long flags = MS_BIND | MS_REMOUNT | MS_RDONLY;
+    struct statvfs st;
+
+    if (statvfs(dirname.c_str(), &st) == 0) {
+        const unsigned long locked[][2] = {
+            { ST_NOSUID, MS_NOSUID }, { ST_NODEV, MS_NODEV }, { ST_NOEXEC, MS_NOEXEC },
+            { ST_NOATIME, MS_NOATIME }, { ST_NODIRATIME, MS_NODIRATIME },
+            { ST_RELATIME, MS_RELATIME }
+        };
+
+        for (const auto &flag : locked) {
+            if (st.f_flag & flag[0]) {
+                flags |= flag[1];
+            }
+        }
+    }
+
+    if (mount(dirname.c_str(), dirname.c_str(), nullptr, MS_BIND | MS_REC, nullptr) < 0) {
+        error_client(client, string("mounting ") + dirname + " failed");
+        log_perror("mount() failed") << "\t" << dirname << endl;
+        _exit(144);
+    }
+
+    // Outputs of the job go to memory if there is a size for it, and go away
+    // with the job.  Output too large for it fails the job like a full disk does.
+    string tmpdir = dirname + "/tmp";
+    string options = "mode=1777,size=" + toString(tmpfs_size);
+    int ret;
+
+    if (tmpfs_size) {
+        ret = mount("tmpfs", tmpdir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, options.c_str());
+    } else {
+        ret = mount(tmpdir.c_str(), tmpdir.c_str(), nullptr, MS_BIND, nullptr);
+    }
+
+    if (ret < 0) {
+        error_client(client, string("mounting ") + tmpdir + " failed");
+        log_perror("mount() failed") << "\t" << tmpdir << endl;
+        _exit(144);
+    }
+
+    if (mount(nullptr, dirname.c_str(), nullptr, flags, nullptr) < 0) {
+        error_client(client, string("mounting ") + dirname + " read-only failed");
+        log_perror("mount() failed") << "\t" << dirname << endl;
+        _exit(144);
+    }
+
+    if (chdir(dirname.c_str()) < 0) {
+        error_client(client, string("chdir to ") + dirname + "failed");
+        log_perror("chdir() failed") << "\t" << dirname << endl;
+        _exit(145);
+    }
+
+    if (chroot(dirname.c_str()) < 0) {
+        error_client(client, string("chroot ") + dirname + "failed");
+        log_perror("chroot() failed") << "\t" << dirname << endl;
+        _exit(144);
+    }
+}
+#endif
+
+bool init_namespace_sandbox(uid_t user_uid, gid_t user_gid)
+{
+#ifdef HAVE_UNSHARE
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork failed");
+        return false;
+    }
+
+    if (pid == 0) {
+        _exit(enter_namespaces(user_uid, user_gid) ? 0 : 1);
+    }
+
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    namespace_sandbox = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    // Without root the jobs run as our user, so keep them from ptracing us or
+    // reading our memory. They are made dumpable again to set up their namespaces.
+    if (namespace_sandbox && getuid() != 0 && prctl(PR_SET_DUMPABLE, 0) < 0) {
+        log_perror("prctl(PR_SET_DUMPABLE) failed");
+    }
+
+    return namespace_sandbox;
+#else
+    (void) user_uid;
+    (void) user_gid;
+    return false;
+#endif
+}
+
+void chdir_to_environment(MsgChannel *client, const string &dirname, uid_t user_uid, gid_t user_gid,
+                          size_t tmpfs_size)
+{
+#ifdef HAVE_UNSHARE
+    if (namespace_sandbox) {
+        enter_namespace_sandbox(client, dirname, user_uid, user_gid, tmpfs_size);
+        return;
+    }
+#else
+    (void) tmpfs_size;
+#endif
+
 #ifdef HAVE_LIBCAP_NG
 
     if (chdir(dirname.c_str()) < 0) {
@@ -33,7 +33,7 @@ extern bool cleanup_cache(const std::string &basedir, uid_t user_uid, gid_t user
 extern int start_create_env(const std::string &basedir,
                             uid_t user_uid, gid_t user_gid,
                             const std::string &compiler, const std::list<std::string> &extrafiles,
-                            const std::string &compression);
+                            const std::string &compression, const std::string &cachedir);
 extern size_t finish_create_env(int pipe, const std::string &basedir, std::string &native_environment);
 Environments available_environments(const std::string &basename);
 extern pid_t start_install_environment(const std::string &basename,
@@ -42,11 +42,20 @@ extern pid_t start_install_environment(const std::string &basename,
                                        MsgChannel *c, int& pipe_to_child, int& pipe_from_child,
                                        FileChunkMsg*& fmsg,
                                        uid_t user_uid, gid_t user_gid, int extract_priority);
+extern std::string env_tarball_path(const std::string &basedir, const std::string &env);
+extern pid_t start_send_environment(const std::string &basedir, const std::string &target,
+                                    const std::string &name, MsgChannel *c);
 extern size_t finalize_install_environment(const std::string &basename, const std::string &target,
                                            uid_t user_uid, gid_t user_gid);
 extern void remove_environment_files(const std::string &basedir, const std::string &env);
+extern size_t cleanup_env_store(const std::string &basedir);
 extern void remove_native_environment_files(const std::string &env);
-extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid);
+extern std::string native_environment_version(const std::string &env);
+// Lets remote jobs run in user and mount namespaces, if the system allows that.
+extern bool init_namespace_sandbox(uid_t user_uid, gid_t user_gid);
+// tmpfs_size is for /tmp of the job with namespaces, 0 to keep it on disk.
+extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid,
+                                 size_t tmpfs_size = 0);
 extern bool verify_env(MsgChannel *c, const std::string &basedir, const std::string &target,
                        const std::string &env, uid_t user_uid, gid_t user_gid);
 
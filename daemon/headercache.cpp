@@ -0,0 +1,315 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <list>
+#include <set>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <comm.h>
+
+#include "file_util.h"
+#include "headercache.h"
+#include "logging.h"
+#include "md5.h"
+#include "resultcache.h"
+
+using namespace std;
+
+// Only absolute paths without . and .. components can be mapped into the job directory.
+static bool valid_client_path(const string &path)
+{
+    if (path.empty() || path[0] != '/' || path[path.size() - 1] == '/') {
+        return false;
+    }
+
+    size_t pos = 0;
+
+    while (pos < path.size()) {
+        size_t next = path.find('/', pos + 1);
+        string component = path.substr(pos + 1, next == string::npos ? string::npos : next - pos - 1);
+
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+
+        pos = next == string::npos ? path.size() : next;
+    }
+
+    return true;
+}
+
+static bool valid_hash(const string &hash)
+{
+    return hash.size() == 32 && hash.find_first_not_of("0123456789abcdef") == string::npos;
+}
+
+static bool write_all(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t bytes = write(fd, data, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        data += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+// Receives a file as FILE_CHUNKs and END and adds it to the cache if its contents match hash.
+static bool receive_header(MsgChannel *c, int cache_fd, const string &hash)
+{
+    string tmp_name = hash + ".tmp" + to_string(getpid());
+    int fd = openat(cache_fd, tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0;
+    md5_state_t state;
+    md5_init(&state);
+
+    for (;;) {
+        Msg *msg = c->get_msg(40);
+
+        if (!msg || (*msg != Msg::FILE_CHUNK && *msg != Msg::END)) {
+            delete msg;
+            ok = false;
+            break;
+        }
+
+        if (*msg == Msg::END) {
+            delete msg;
+            break;
+        }
+
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+        md5_append(&state, fcmsg->buffer, fcmsg->len);
+
+        if (ok) {
+            ok = write_all(fd, fcmsg->buffer, fcmsg->len);
+        }
+
+        delete msg;
+    }
+
+    md5_byte_t digest[16];
+    md5_finish(&state, digest);
+    char hex[33];
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(hex + di * 2, "%02x", digest[di]);
+    }
+
+    if (fd >= 0 && close(fd) != 0) {
+        ok = false;
+    }
+
+    if (ok && hash != hex) {
+        log_error() << "header with hash " << hash << " has contents with hash " << hex << endl;
+        ok = false;
+    }
+
+    if (ok && renameat(cache_fd, tmp_name.c_str(), cache_fd, hash.c_str()) == 0) {
+        return true;
+    }
+
+    unlinkat(cache_fd, tmp_name.c_str(), 0);
+    return false;
+}
+
+static bool copy_header(int cache_fd, const string &hash, const string &path)
+{
+    int in_fd = openat(cache_fd, hash.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (in_fd < 0) {
+        return false;
+    }
+
+    int out_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    bool ok = out_fd >= 0;
+    unsigned char buffer[65536];
+
+    while (ok) {
+        ssize_t bytes = read(in_fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            ok = bytes == 0;
+            break;
+        }
+
+        ok = write_all(out_fd, buffer, bytes);
+    }
+
+    close(in_fd);
+
+    if (out_fd >= 0 && close(out_fd) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+string receive_headers(MsgChannel *c, int cache_fd, const string &root, ResultCache *result_cache)
+{
+    Msg *msg = c->get_msg(40);
+    HeaderListMsg *hmsg = dynamic_cast<HeaderListMsg *>(msg);
+
+    if (!hmsg || hmsg->files.empty() || hmsg->files.size() != hmsg->hashes.size()) {
+        log_error() << "expected the list of headers, got "
+                    << (msg ? msg->to_string() : string("nothing")) << endl;
+        delete msg;
+        return string();
+    }
+
+    list<string> missing_files;
+    list<string> missing_hashes;
+    set<string> missing;
+
+    for (list<string>::const_iterator file = hmsg->files.begin(), hash = hmsg->hashes.begin();
+            file != hmsg->files.end(); ++file, ++hash) {
+        if (!valid_client_path(*file) || !valid_hash(*hash)) {
+            log_error() << "invalid header " << *file << " " << *hash << endl;
+            delete msg;
+            return string();
+        }
+
+        // Mark it as recently used for trim_header_cache().
+        if (utimensat(cache_fd, hash->c_str(), nullptr, 0) != 0 && missing.insert(*hash).second) {
+            missing_files.push_back(*file);
+            missing_hashes.push_back(*hash);
+        }
+    }
+
+    trace() << "job needs " << hmsg->files.size() << " files, " << missing_files.size()
+            << " of them are not cached" << endl;
+
+    if (!c->send_msg(HeaderListMsg(missing_files, missing_hashes))) {
+        delete msg;
+        return string();
+    }
+
+    for (list<string>::const_iterator hash = missing_hashes.begin(); hash != missing_hashes.end(); ++hash) {
+        if (!receive_header(c, cache_fd, *hash)) {
+            log_error() << "failed to receive header " << *hash << endl;
+            delete msg;
+            return string();
+        }
+    }
+
+    for (list<string>::const_iterator file = hmsg->files.begin(), hash = hmsg->hashes.begin();
+            file != hmsg->files.end(); ++file, ++hash) {
+        string path = root + *file;
+
+        if (!mkpath(path.substr(0, path.rfind('/')))) {
+            log_perror("mkpath") << "\t" << path << endl;
+            delete msg;
+            return string();
+        }
+
+        // A copy, not a link, as the job runs as the uid owning the cache and could
+        // change the cached file for all later jobs.
+        if (!copy_header(cache_fd, *hash, path) && errno != EEXIST) {
+            log_perror("copying header") << "\t" << path << endl;
+            delete msg;
+            return string();
+        }
+
+        if (result_cache) {
+            string entry = *file + '\0' + *hash;
+            result_cache->add_input((const unsigned char *)entry.c_str(), entry.size() + 1);
+        }
+    }
+
+    string input_file = hmsg->files.front();
+    delete msg;
+    return input_file;
+}
+
+size_t trim_header_cache(const string &dir, size_t limit)
+{
+    DIR *cachedir = opendir(dir.c_str());
+
+    if (!cachedir) {
+        return 0;
+    }
+
+    vector<pair<time_t, string> > by_use;
+    vector<size_t> sizes;
+    size_t total = 0;
+
+    for (struct dirent *ent = readdir(cachedir); ent; ent = readdir(cachedir)) {
+        string name = ent->d_name;
+        struct stat st;
+
+        if (name[0] == '.' || fstatat(dirfd(cachedir), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+
+        by_use.push_back(make_pair(st.st_mtime, name));
+        total += st.st_size;
+    }
+
+    if (total > limit) {
+        sort(by_use.begin(), by_use.end());
+
+        for (vector<pair<time_t, string> >::const_iterator it = by_use.begin();
+                it != by_use.end() && total > limit; ++it) {
+            struct stat st;
+
+            if (fstatat(dirfd(cachedir), it->second.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+
+            // Files being received are still growing, leave them alone.
+            if (it->second.find(".tmp") != string::npos && st.st_mtime > time(nullptr) - 3600) {
+                continue;
+            }
+
+            if (unlinkat(dirfd(cachedir), it->second.c_str(), 0) == 0) {
+                total -= min(total, (size_t)st.st_size);
+            }
+        }
+
+        trace() << "header cache trimmed to " << total << " bytes" << endl;
+    }
+
+    closedir(cachedir);
+    return total;
+}
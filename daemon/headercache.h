@@ -0,0 +1,42 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_HEADERCACHE_H
+#define ICECREAM_HEADERCACHE_H
+
+#include <string>
+
+class MsgChannel;
+class ResultCache;
+
+/* Sources and headers of jobs preprocessed on this host are kept in a
+   directory, named by the md5 of their contents, so that clients only
+   need to send those that are not there yet.  */
+
+// Gets the HEADER_LIST for a job from the client, gets the missing files
+// into the cache at cache_fd and links all the files into root at their
+// paths on the client. Adds the files to the key of result_cache, if any.
+// Returns the path of the input file, or an empty string on failure.
+extern std::string receive_headers(MsgChannel *c, int cache_fd, const std::string &root,
+                                   ResultCache *result_cache);
+// Removes least recently used files until the cache is at most limit bytes, returns its size.
+extern size_t trim_header_cache(const std::string &dir, size_t limit);
+
+#endif
@@ -0,0 +1,87 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+
+#include "includecache.h"
+#include "logging.h"
+
+using namespace std;
+
+static size_t list_size(const list<string> &l)
+{
+    size_t size = 0;
+
+    for (const string &s : l) {
+        size += s.size() + sizeof(string);
+    }
+
+    return size;
+}
+
+const IncludeScanMsg *IncludeScanCache::find(const string &key)
+{
+    map<string, Entry>::iterator it = m_entries.find(key);
+
+    if (it == m_entries.end()) {
+        return nullptr;
+    }
+
+    m_by_use.splice(m_by_use.begin(), m_by_use, it->second.use);
+    return &it->second.scan;
+}
+
+void IncludeScanCache::add(const string &key, const IncludeScanMsg &scan)
+{
+    map<string, Entry>::iterator it = m_entries.find(key);
+
+    if (it != m_entries.end()) {
+        remove(it);
+    }
+
+    Entry entry;
+    entry.scan = scan;
+    entry.size = key.size() + list_size(scan.flags) + list_size(scan.files)
+                 + list_size(scan.hashes) + list_size(scan.dependencies)
+                 + list_size(scan.stamp_paths) + list_size(scan.stamps);
+
+    if (entry.size > m_limit) {
+        return;
+    }
+
+    m_by_use.push_front(key);
+    entry.use = m_by_use.begin();
+    m_entries.insert(make_pair(key, entry));
+    m_size += entry.size;
+
+    while (m_size > m_limit) {
+        remove(m_entries.find(m_by_use.back()));
+    }
+
+    trace() << "include scan cache has " << m_entries.size() << " scans, " << m_size << " bytes" << endl;
+}
+
+void IncludeScanCache::remove(map<string, Entry>::iterator it)
+{
+    m_size -= it->second.size;
+    m_by_use.erase(it->second.use);
+    m_entries.erase(it);
+}
@@ -0,0 +1,72 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_INCLUDECACHE_H
+#define ICECREAM_INCLUDECACHE_H
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <comm.h>
+
+/* Include scans of jobs, kept in memory for the clients on this host so
+   that they do not need to read all the headers of a job again. The clients
+   check that the scans are still valid. Least recently used scans are
+   dropped when the cache grows over its limit.  */
+class IncludeScanCache
+{
+public:
+    explicit IncludeScanCache(size_t limit)
+        : m_size(0)
+        , m_limit(limit)
+    {}
+
+    // Returns the scan for key, or nullptr.
+    const IncludeScanMsg *find(const std::string &key);
+    void add(const std::string &key, const IncludeScanMsg &scan);
+
+    size_t size() const
+    {
+        return m_size;
+    }
+    size_t count() const
+    {
+        return m_entries.size();
+    }
+
+private:
+    struct Entry {
+        IncludeScanMsg scan;
+        size_t size;
+        std::list<std::string>::iterator use;
+    };
+
+    void remove(std::map<std::string, Entry>::iterator it);
+
+    std::map<std::string, Entry> m_entries;
+    // keys, the most recently used first
+    std::list<std::string> m_by_use;
+    size_t m_size;
+    size_t m_limit;
+};
+
+#endif
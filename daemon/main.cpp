@@ -61,6 +61,10 @@
 #include <sys/vfs.h>
 #endif
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #include <arpa/inet.h>
 
 #ifdef HAVE_RESOLV_H
@@ -96,6 +100,9 @@
 #include <comm.h>
 #include "load.h"
 #include "environment.h"
+#include "headercache.h"
+#include "includecache.h"
+#include "resultcache.h"
 #include "platform.h"
 #include "util.h"
 #include "getifaddrs.h"
@@ -127,23 +134,30 @@ public:
      * CLIENTWORK: Client is busy working and we reserve the spot (job_id is set if it's a scheduler job)
      * WAITFORCHILD: Client is waiting for the compile job to finish.
      * WAITCREATEENV: We're waiting for icecc-create-env to finish.
+     * WAITFETCHENV: Client is waiting for the environment to be received from another daemon.
+     * WAITCPP: Client is waiting for a slot to preprocess.
+     * CPPSLOT: Client preprocesses and holds a slot for that until it closes the connection.
      */
     enum Status { UNKNOWN, GOTNATIVE, PENDING_USE_CS, JOBDONE, LINKJOB, TOINSTALL, WAITINSTALL, TOCOMPILE,
-                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV,
-                  LASTSTATE = WAITCREATEENV
+                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV, WAITFETCHENV,
+                  WAITCPP, CPPSLOT,
+                  LASTSTATE = CPPSLOT
                 } status;
     Client() {
         job_id = 0;
         channel = nullptr;
         job = nullptr;
         usecsmsg = nullptr;
+        pending_get_cs = nullptr;
         client_id = 0;
         niceness = 0;
         status = UNKNOWN;
         pipe_from_child = -1;
         pipe_to_child = -1;
+        tarball_fd = -1;
         child_pid = -1;
         fulljob = false;
+        linkslot = false;
     }
 
     static string status_str(Status status) {
@@ -174,6 +188,12 @@ public:
             return "waitforchild";
         case WAITCREATEENV:
             return "waitcreateenv";
+        case WAITFETCHENV:
+            return "waitfetchenv";
+        case WAITCPP:
+            return "waitcpp";
+        case CPPSLOT:
+            return "cppslot";
         }
 
         assert(false);
@@ -186,6 +206,8 @@ public:
         channel = nullptr;
         delete usecsmsg;
         usecsmsg = nullptr;
+        delete pending_get_cs;
+        pending_get_cs = nullptr;
         delete job;
         job = nullptr;
 
@@ -199,6 +221,11 @@ public:
                 log_perror("Failed to close pipe to child process");
             }
         }
+        if (tarball_fd >= 0) {
+            if (-1 == close(tarball_fd) && (errno != EBADF)){
+                log_perror("Failed to close environment tarball");
+            }
+        }
 
     }
     uint32_t job_id;
@@ -212,9 +239,15 @@ public:
     int pipe_from_child;
     // pipe to child process, only valid if TOINSTALL/WAITINSTALL
     int pipe_to_child;
+    // copy of the received environment tarball, only valid if TOINSTALL
+    int tarball_fd;
     pid_t child_pid;
     bool fulljob; // during LINKJOB and CLIENTWORK, reserve all slots if set
+    bool linkslot; // during CLIENTWORK, holds max_link_jobs slots instead of max_kids ones
     string pending_create_env; // only for WAITCREATEENV
+    GetCSMsg *pending_get_cs; // for WAITCREATEENV, to be sent once the native env exists
+    string native_env; // sent with UseCS, if GetCS asked for the native env
+    string fetch_env; // for WAITFETCHENV, and the channel receiving the env from another daemon
 
     string dump() const {
         string ret = status_str(status) + " " + channel->dump();
@@ -230,6 +263,8 @@ public:
             return ret + " ClientID: " + toString(client_id) + " PID: " + toString(child_pid) + " PFD: " + toString(pipe_from_child);
         case WAITCREATEENV:
             return ret + " " + toString(client_id) + " " + pending_create_env;
+        case WAITFETCHENV:
+            return ret + " ClientID: " + toString(client_id) + " " + fetch_env;
         default:
             ret += " ClientID: " + toString(client_id);
             if (job_id) {
@@ -249,8 +284,12 @@ class Clients : public map<MsgChannel*, Client*>
 public:
     Clients() {
         active_processes = 0;
+        active_link_processes = 0;
+        active_cpp_processes = 0;
     }
     unsigned int active_processes;
+    unsigned int active_link_processes;
+    unsigned int active_cpp_processes;
 
     Client *find_by_client_id(int id) const {
         for (auto it : *this)
@@ -415,8 +454,8 @@ void usage(const char *reason = nullptr)
         cerr << reason << endl;
     }
 
-    cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
-        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>] [-i|--interface <net_interface>] [-p|--port <port>]" << endl;
+    cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [--user-namespaces] [--tmp-memory-limit <MB>] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
+        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [--result-cache-limit <MB>] [--header-cache-limit <MB>] [--pch-cache-limit <MB>] [--native-env-cache <dir>] [--max-link-jobs <n>] [--link-mem-limit <MB>] [-N <node_name>] [-i|--interface <net_interface>] [-p|--port <port>]" << endl;
     exit(1);
 }
 
@@ -429,19 +468,52 @@ int mem_limit = 100;
 // Minimum rlimit for a compile job, measured in megabytes.
 const int min_mem_limit = 100;
 
+// At most this many environments are sent to other daemons at the same time.
+const unsigned int max_env_senders = 4;
+
+// Seconds for connecting to a daemon to get an environment from, and for the
+// protocol setup after that.
+const int env_fetch_connect_timeout = 5;
+const int env_fetch_protocol_timeout = 15;
+
 unsigned int max_kids = 0;
 
+// Slots for local jobs (linking, icerun), if 0 they share the max_kids slots.
+unsigned int max_link_jobs = 0;
+
+// Memory in megabytes reserved for each running local job, taken away from
+// what compile jobs may use.
+int link_mem_limit = 0;
+
 size_t cache_size_limit = 256 * 1024 * 1024;
 
+// Maximum size of the cache for results of compile jobs, 0 means no caching.
+size_t result_cache_limit = 0;
+
+// Maximum size of the cache for headers of jobs preprocessed here, 0 means
+// jobs are not preprocessed here.
+size_t header_cache_limit = 128 * 1024 * 1024;
+
+// Maximum size of the precompiled headers kept for each environment, 0 means
+// precompiled headers are not used.
+size_t pch_cache_limit = 512 * 1024 * 1024;
+
+// Memory for the temporary files of all running jobs from other nodes, shared
+// equally, with user namespaces.  0 means they are on disk.
+size_t tmp_memory_limit = 2048UL * 1024 * 1024;
+
 struct NativeEnvironment {
     string name; // the hash
     // Timestamps for files including compiler binaries, if they have changed since the time
     // the native env was built, it needs to be rebuilt.
     map<string, time_t> filetimes;
+    // The files and the tarball are watched and have not changed since they were
+    // last checked, so they do not need checking again.
+    bool unchanged;
     time_t last_use;
     size_t size; // tarball size
     int create_env_pipe; // if in progress of creating the environment
-    NativeEnvironment() : last_use( 0 ), size( 0 ), create_env_pipe( 0 ) {}
+    NativeEnvironment() : unchanged( false ), last_use( 0 ), size( 0 ), create_env_pipe( 0 ) {}
 };
 
 struct ReceivedEnvironment {
@@ -450,17 +522,35 @@ struct ReceivedEnvironment {
     size_t size; // directory size
 };
 
+// A daemon being connected to for getting an environment, without blocking the main loop.
+struct PendingEnvFetch {
+    PendingEnvFetch() : channel( nullptr ), timeout( 0 ), prefetch( false ) {}
+    string target;
+    string name;
+    string hostname;
+    MsgChannel *channel; // once connected, waiting for the protocol setup
+    time_t timeout;
+    bool prefetch; // asked for by the scheduler, not by a job
+};
+
 struct Daemon {
     Clients clients;
     // Installed environments received from other nodes. The key is
     // (job->targetPlatform() + "/" job->environmentVersion()).
     map<string, ReceivedEnvironment> received_environments;
+    // Children sending environments to other daemons.
+    set<pid_t> env_senders;
+    // Environment fetches still connecting, by the fd of the connection.
+    map<int, PendingEnvFetch> pending_env_fetches;
     // Map of native environments, the basic one(s) containing just the compiler
     // and possibly more containing additional files (such as compiler plugins).
     // The key is the compiler name and a concatenated list of the additional files
     // (or just the compiler name for the basic ones).
     map<string, NativeEnvironment> native_environments;
+    int inotify_fd; // watching files of native environments, -1 if not (yet) used
+    map<int, set<string> > inotify_watches; // watch descriptor -> watched paths
     string envbasedir;
+    string native_env_cache; // tarballs shared with other hosts, empty if none
     uid_t user_uid;
     gid_t user_gid;
     int warn_icecc_user_errno;
@@ -472,10 +562,22 @@ struct Daemon {
     bool noremote;
     bool custom_nodename;
     size_t cache_size;
+    size_t store_size; // part of cache_size used by files shared between environments
+    string result_cache_dir; // empty if results are not cached
+    time_t next_result_cache_trim;
+    string header_cache_dir; // empty if jobs are not preprocessed here
+    time_t next_header_cache_trim;
+    IncludeScanCache include_scans; // for local clients sending headers
     map<int, Client*> fd2client;
     int new_client_id;
     string remote_name;
     time_t next_scheduler_connect;
+    time_t scheduler_connected;
+    // The scheduler of another region we serve until lent_until, instead of our own.
+    string lent_scheduler;
+    int lent_port;
+    time_t lent_until;
+    bool lend_pending;
     unsigned long icecream_load;
     struct timeval icecream_usage;
     int current_load;
@@ -492,8 +594,12 @@ struct Daemon {
     int max_scheduler_pong;
     int max_scheduler_ping;
     unsigned int current_kids;
+    unsigned int current_free_mem;
 
-    Daemon() {
+    Daemon()
+        : inotify_fd(-1)
+        , include_scans(32 * 1024 * 1024)
+    {
         warn_icecc_user_errno = 0;
         if (getuid() == 0) {
             struct passwd *pw = getpwnam("icecc");
@@ -517,7 +623,14 @@ struct Daemon {
         unix_listen_fd = -1;
         new_client_id = 0;
         next_scheduler_connect = 0;
+        scheduler_connected = 0;
+        lent_port = 0;
+        lent_until = 0;
+        lend_pending = false;
         cache_size = 0;
+        store_size = 0;
+        next_result_cache_trim = 0;
+        next_header_cache_trim = 0;
         noremote = false;
         custom_nodename = false;
         icecream_load = 0;
@@ -532,6 +645,7 @@ struct Daemon {
         max_scheduler_pong = MAX_SCHEDULER_PONG;
         max_scheduler_ping = MAX_SCHEDULER_PING;
         current_kids = 0;
+        current_free_mem = 0;
     }
 
     ~Daemon() {
@@ -543,9 +657,27 @@ struct Daemon {
     bool handle_transfer_env(Client *client, EnvTransferMsg *msg) __attribute_warn_unused_result__;
     bool handle_env_install_child_done(Client *client);
     bool finish_transfer_env(Client *client, bool cancel = false);
+    bool handle_env_fetch(Client *client, EnvFetchMsg *msg) __attribute_warn_unused_result__;
+    bool start_env_fetch(const string &target, const string &name, const string &hostname,
+                         unsigned int port, const Client *requester);
+    void finish_env_fetch(const string &env_key, bool ok);
+    void handle_pending_env_fetches(const vector<pollfd> &pollfds);
+    bool continue_env_fetch(PendingEnvFetch &fetch);
+    bool env_sender_done(pid_t pid, int status);
+    bool handle_get_env(Client *client, GetEnvMsg *msg) __attribute_warn_unused_result__;
+    bool handle_result_transfer(Client *client, const string &key, bool put) __attribute_warn_unused_result__;
+    bool handle_include_scan(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
+    bool get_native_env(Client *client, const string &compiler, const list<string> &extrafiles,
+                        const string &compression) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
+    bool watch_native_environment(const NativeEnvironment &env);
+    void handle_inotify();
     void handle_old_request();
+    bool local_job_slot_free() const;
+    bool cpp_slot_free() const;
+    bool start_local_job(Client *client) __attribute_warn_unused_result__;
+    void release_job_slots(Client *client);
     bool handle_compile_file(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_activity(Client *client) __attribute_warn_unused_result__;
     bool handle_file_chunk_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
@@ -554,10 +686,13 @@ struct Daemon {
     void clear_children();
     int scheduler_use_cs(UseCSMsg *msg) __attribute_warn_unused_result__;
     int scheduler_no_cs(NoCSMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_env_fetch(EnvFetchMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_lend_cs(LendCSMsg *msg) __attribute_warn_unused_result__;
     bool handle_get_cs(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_local_job(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_job_done(Client *cl, JobDoneMsg *m) __attribute_warn_unused_result__;
     bool handle_compile_done(Client *client) __attribute_warn_unused_result__;
+    size_t job_tmpfs_size() const;
     bool handle_verify_env(Client *client, VerifyEnvMsg *msg) __attribute_warn_unused_result__;
     bool handle_blacklist_host_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     int handle_cs_conf(ConfCSMsg *msg);
@@ -574,6 +709,7 @@ struct Daemon {
     bool setup_listen_tcp_fd( int& fd, const string& interface );
     bool setup_listen_unix_fd();
     void check_cache_size(const string &new_env);
+    void update_store_size();
     void remove_native_environment(const string& env_key);
     void remove_environment(const string& env_key);
     bool create_env_finished(string env_key);
@@ -830,7 +966,25 @@ void Daemon::close_scheduler()
     scheduler = nullptr;
     delete discover;
     discover = nullptr;
-    next_scheduler_connect = time(nullptr) + 20 + (rand() & 31);
+
+    if (lend_pending) {
+        lend_pending = false;
+        next_scheduler_connect = 0;
+        return;
+    }
+
+    // Back to our own scheduler.
+    lent_scheduler.clear();
+    lent_until = 0;
+
+    /* A scheduler that served us for a while has probably gone away and a standby
+       one is taking over, so look again soon, spreading the farm's reconnects a bit.
+       Otherwise back off, the scheduler may not want us.  */
+    if (scheduler_connected + 60 < time(nullptr)) {
+        next_scheduler_connect = time(nullptr) + 1 + (rand() & 3);
+    } else {
+        next_scheduler_connect = time(nullptr) + 20 + (rand() & 31);
+    }
     static bool fast_reconnect = getenv( "ICECC_TESTS" ) != nullptr;
     if( fast_reconnect )
         next_scheduler_connect = time(nullptr) + 3;
@@ -849,7 +1003,8 @@ bool Daemon::maybe_stats(bool force_check)
         unsigned long idleLoad = 0;
         unsigned long niceLoad = 0;
 
-        fill_stats(idleLoad, niceLoad, memory_fillgrade, &msg, clients.active_processes);
+        fill_stats(idleLoad, niceLoad, memory_fillgrade, &msg,
+                   clients.active_processes + clients.active_link_processes);
 
         time_t diff_stat = (now.tv_sec - last_stat.tv_sec) * 1000 + (now.tv_usec - last_stat.tv_usec) / 1000;
         last_stat = now;
@@ -898,7 +1053,9 @@ bool Daemon::maybe_stats(bool force_check)
 
 #endif
 
-        mem_limit = std::max(int(msg.freeMem / std::min(std::max(max_kids, 1U), 4U)), min_mem_limit);
+        current_free_mem = msg.freeMem;
+        int compile_mem = std::max(int(msg.freeMem) - int(clients.active_link_processes) * link_mem_limit, 0);
+        mem_limit = std::max(int(compile_mem / std::min(std::max(max_kids, 1U), 4U)), min_mem_limit);
 
         if (abs(int(msg.load) - current_load) >= 100
             || (msg.load == 1000 && current_load != 1000)
@@ -934,6 +1091,15 @@ string Daemon::dump_internals() const
         result += "  Cache Size: " + toString(cache_size) + "\n";
     }
 
+    if (store_size) {
+        result += "  Shared Files Size: " + toString(store_size) + "\n";
+    }
+
+    if (include_scans.count()) {
+        result += "  Include Scans: " + toString(include_scans.count()) + ", size "
+                  + toString(include_scans.size()) + "\n";
+    }
+
     result += "  Architecture: " + machine_name + "\n";
 
     for (const auto & native_environment : native_environments) {
@@ -950,6 +1116,13 @@ string Daemon::dump_internals() const
 
     result += "  Current kids: " + toString(current_kids) + " (max: " + toString(max_kids) + ")\n";
 
+    if (max_link_jobs) {
+        result += "  Local jobs: " + toString(clients.active_link_processes)
+            + " (max: " + toString(max_link_jobs) + ")\n";
+    }
+
+    result += "  Preprocessing: " + toString(clients.active_cpp_processes) + "\n";
+
     result += "  Supported features: " + supported_features_to_string(supported_features) + "\n";
 
     if (scheduler) {
@@ -961,7 +1134,8 @@ string Daemon::dump_internals() const
     unsigned long idleLoad = 0;
     unsigned long niceLoad = 0;
 
-    fill_stats(idleLoad, niceLoad, memory_fillgrade, &msg, clients.active_processes);
+    fill_stats(idleLoad, niceLoad, memory_fillgrade, &msg,
+               clients.active_processes + clients.active_link_processes);
     result += "  cpu: " + toString(idleLoad) + " idle, "
               + toString(niceLoad) + " nice\n";
     result += "  load: " + toString(msg.loadAvg1 / 1000.) + ", icecream_load: "
@@ -999,6 +1173,7 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
     } else {
         c->usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
                                    msg->job_id, true, 1, msg->matched_job_id);
+        msg->native_env = c->native_env;
 
         if (!c->channel->send_msg(*msg)) {
             handle_end(c, 143);
@@ -1036,6 +1211,58 @@ int Daemon::scheduler_no_cs(NoCSMsg *msg)
 
 }
 
+// Returns 1 to switch to the other scheduler.
+int Daemon::scheduler_lend_cs(LendCSMsg *msg)
+{
+    if (clients.size() > 0) {
+        trace() << "busy, not serving the scheduler at " << msg->hostname << endl;
+        return 0;
+    }
+
+    log_info() << "serving the scheduler at " << msg->hostname << ":" << msg->port
+               << " for " << msg->lease << " seconds" << endl;
+    lent_scheduler = msg->hostname;
+    lent_port = msg->port;
+    lent_until = time(nullptr) + msg->lease;
+    lend_pending = true;
+    return 1;
+}
+
+int Daemon::scheduler_env_fetch(EnvFetchMsg *msg)
+{
+    string target = msg->target;
+
+    if (target.empty()) {
+        target = machine_name;
+    }
+
+    string env_key = target + "/" + msg->name;
+
+    if (received_environments.count(env_key)) {
+        return 0;
+    }
+
+    // Do not let prefetching push out environments that are actually used.
+    if (cache_size >= cache_size_limit / 4 * 3) {
+        trace() << "not prefetching " << env_key << ", cache is full" << endl;
+        return 0;
+    }
+
+    // Prefetching is not urgent, so a peer that does not answer must not pile
+    // up connections, the scheduler asks again later.
+    for (const auto& it : pending_env_fetches) {
+        if (it.second.prefetch) {
+            trace() << "not prefetching " << env_key << ", still connecting to "
+                    << it.second.hostname << endl;
+            return 0;
+        }
+    }
+
+    trace() << "prefetching " << env_key << " from " << msg->hostname << ":" << msg->port << endl;
+    start_env_fetch(target, msg->name, msg->hostname, msg->port, nullptr);
+    return 0;
+}
+
 bool Daemon::handle_transfer_env(Client *client, EnvTransferMsg *emsg)
 {
     log_info() << "handle_transfer_env, client status " << Client::status_str(client->status) <<  endl;
@@ -1071,6 +1298,14 @@ bool Daemon::handle_transfer_env(Client *client, EnvTransferMsg *emsg)
     client->outfile = target + "/" + emsg->name;
     current_kids++;
 
+    // Keep the tarball, so other daemons can get the environment from us.
+    string tarball = env_tarball_path(envbasedir, client->outfile);
+    client->tarball_fd = open(tarball.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+
+    if (client->tarball_fd < 0) {
+        log_perror("open environment tarball") << "\t" << tarball << endl;
+    }
+
     trace() << "PID of child thread running untaring environment: " << pid << endl;
     client->pipe_to_child = pipe_to_child;
     client->pipe_from_child = pipe_from_child;
@@ -1085,6 +1320,26 @@ bool Daemon::handle_transfer_env(Client *client, EnvTransferMsg *emsg)
     return true;
 }
 
+static bool write_full(int fd, const unsigned char *buffer, size_t len)
+{
+    while (len) {
+        ssize_t bytes = write(fd, buffer, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            return false;
+        }
+
+        buffer += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
 bool Daemon::handle_file_chunk_env(Client *client, Msg *msg)
 {
     /* this sucks, we can block when we're writing
@@ -1126,11 +1381,22 @@ bool Daemon::handle_file_chunk_env(Client *client, Msg *msg)
             off += bytes;
         }
 
+        if (client->tarball_fd >= 0 && !write_full(client->tarball_fd, fcmsg->buffer, fcmsg->len)) {
+            log_perror("write to environment tarball failed");
+            close(client->tarball_fd);
+            client->tarball_fd = -1;
+            unlink(env_tarball_path(envbasedir, client->outfile).c_str());
+        }
+
         return true;
     }
 
     if (*msg == Msg::END) {
         trace() << "received end of environment, waiting for child" << endl;
+        if (client->tarball_fd >= 0) {
+            close(client->tarball_fd);
+            client->tarball_fd = -1;
+        }
         close(client->pipe_to_child);
         client->pipe_to_child = -1;
         if( client->child_pid >= 0 ) {
@@ -1202,6 +1468,11 @@ bool Daemon::finish_transfer_env(Client *client, bool cancel)
         close(client->pipe_to_child);
         client->pipe_to_child = -1;
     }
+    if (client->tarball_fd >= 0) {
+        assert( cancel ); // If not cancelled, this is closed by handle_file_chunk_env().
+        close(client->tarball_fd);
+        client->tarball_fd = -1;
+    }
     if (client->child_pid >= 0 ) {
         assert( cancel ); // If not cancelled, this is handled by handle_env_install_child_done().
         kill( client->child_pid, SIGTERM );
@@ -1229,6 +1500,7 @@ bool Daemon::finish_transfer_env(Client *client, bool cancel)
 
     if (installed_size) {
         cache_size += installed_size;
+        update_store_size();
         received_environments[current].last_use = time(nullptr);
         received_environments[current].size = installed_size;
         log_info() << "installed " << current << " size: " << installed_size
@@ -1237,6 +1509,10 @@ bool Daemon::finish_transfer_env(Client *client, bool cancel)
 
     check_cache_size(current);
 
+    // Clients may wait for this environment received from another daemon.
+    client->fetch_env.clear();
+    finish_env_fetch(current, installed_size != 0);
+
     bool r = reannounce_environments(); // do that before the file compiles
 
     if (!maybe_stats(true)) { // update stats in case our disk is too full to accept more jobs
@@ -1246,6 +1522,304 @@ bool Daemon::finish_transfer_env(Client *client, bool cancel)
     return r;
 }
 
+bool Daemon::handle_env_fetch(Client *client, EnvFetchMsg *msg)
+{
+    string target = msg->target;
+
+    if (target.empty()) {
+        target = machine_name;
+    }
+
+    string env_key = target + "/" + msg->name;
+    trace() << "handle_env_fetch " << env_key << " from " << msg->hostname << ":" << msg->port << endl;
+
+    if (received_environments.count(env_key)) {
+        return client->channel->send_msg(VerifyEnvResultMsg(true));
+    }
+
+    client->status = Client::WAITFETCHENV;
+    client->fetch_env = env_key;
+
+    if (!start_env_fetch(target, msg->name, msg->hostname, msg->port, client)) {
+        client->status = Client::UNKNOWN;
+        client->fetch_env.clear();
+        return client->channel->send_msg(VerifyEnvResultMsg(false));
+    }
+
+    return true;
+}
+
+/* Starts getting the environment from the daemon at HOSTNAME:PORT, unless it
+   is already on its way (for somebody else than REQUESTER).  */
+bool Daemon::start_env_fetch(const string &target, const string &name, const string &hostname,
+                             unsigned int port, const Client *requester)
+{
+    string env_key = target + "/" + name;
+
+    // It may be already on its way.
+    for (const auto& it : clients) {
+        Client *other = it.second;
+
+        if (other != requester && ((other->fetch_env == env_key && other->status != Client::WAITFETCHENV)
+                || ((other->status == Client::TOINSTALL || other->status == Client::WAITINSTALL)
+                    && other->outfile == env_key))) {
+            return true;
+        }
+    }
+
+    for (const auto& it : pending_env_fetches) {
+        if (it.second.target + "/" + it.second.name == env_key) {
+            return true;
+        }
+    }
+
+    // The peer may be unreachable, so the connect is finished by the main loop.
+    int fd = Service::startConnect(hostname, port);
+
+    if (fd < 0) {
+        log_warning() << "can't get environment " << env_key << " from " << hostname << endl;
+        return false;
+    }
+
+    PendingEnvFetch &fetch = pending_env_fetches[fd];
+    fetch.target = target;
+    fetch.name = name;
+    fetch.hostname = hostname;
+    fetch.timeout = time(nullptr) + env_fetch_connect_timeout;
+    fetch.prefetch = !requester;
+    return true;
+}
+
+/* Goes on with FETCH when its connection has become ready, returns false when it
+   is done with, having failed or been handed over to a Client.  */
+bool Daemon::continue_env_fetch(PendingEnvFetch &fetch)
+{
+    MsgChannel *peer = fetch.channel;
+
+    if (peer->protocol <= 0) {
+        return true;
+    }
+
+    string env_key = fetch.target + "/" + fetch.name;
+
+    if (!IS_PROTOCOL_VERSION(46, peer) || !peer->send_msg(GetEnvMsg(fetch.target, fetch.name))) {
+        log_warning() << "can't get environment " << env_key << " from " << fetch.hostname << endl;
+        delete peer;
+        finish_env_fetch(env_key, false);
+        return false;
+    }
+
+    Client *peer_client = new Client;
+    peer_client->client_id = ++new_client_id;
+    peer_client->channel = peer;
+    peer_client->fetch_env = env_key;
+    clients[peer] = peer_client;
+    fd2client[peer->fd] = peer_client;
+    trace() << "getting " << env_key << " from " << peer->name << " as " << peer_client->client_id << endl;
+    return false;
+}
+
+void Daemon::handle_pending_env_fetches(const vector<pollfd> &pollfds)
+{
+    time_t now = time(nullptr);
+
+    for (map<int, PendingEnvFetch>::iterator it = pending_env_fetches.begin();
+            it != pending_env_fetches.end();) {
+        int fd = it->first;
+        PendingEnvFetch &fetch = it->second;
+        bool failed = false;
+        bool fd_closed = false;
+
+        if (!fetch.channel && pollfd_is_set(pollfds, fd, POLLOUT)) {
+            fetch.channel = Service::finishConnect(fd);
+            fetch.timeout = now + env_fetch_protocol_timeout;
+            failed = fd_closed = !fetch.channel;
+        } else if (fetch.channel && pollfd_is_set(pollfds, fd, POLLIN)) {
+            failed = !fetch.channel->read_a_bit() || fetch.channel->at_eof();
+        } else if (fetch.timeout <= now) {
+            trace() << "no connection to " << fetch.hostname << " within timeout" << endl;
+            failed = true;
+        }
+
+        if (!failed && fetch.channel && !continue_env_fetch(fetch)) {
+            pending_env_fetches.erase(it++);
+            continue;
+        }
+
+        if (!failed) {
+            ++it;
+            continue;
+        }
+
+        string env_key = fetch.target + "/" + fetch.name;
+        log_warning() << "can't " << (fetch.prefetch ? "prefetch" : "get") << " environment "
+                      << env_key << " from " << fetch.hostname << endl;
+
+        if (fetch.channel) {
+            delete fetch.channel;
+        } else if (!fd_closed) {
+            close(fd);
+        }
+
+        pending_env_fetches.erase(it++);
+        finish_env_fetch(env_key, false);
+    }
+}
+
+void Daemon::finish_env_fetch(const string &env_key, bool ok)
+{
+    for (const auto& it : clients) {
+        Client *client = it.second;
+
+        if (client->status == Client::WAITFETCHENV && client->fetch_env == env_key) {
+            trace() << "finish_env_fetch " << env_key << " for " << client->client_id
+                    << (ok ? "" : " (failed)") << endl;
+            client->status = Client::UNKNOWN;
+            client->fetch_env.clear();
+            // if this fails, the closed connection will be noticed when reading from it
+            client->channel->send_msg(VerifyEnvResultMsg(ok));
+        }
+    }
+}
+
+// Returns false if pid is not a child sending an environment.
+bool Daemon::env_sender_done(pid_t pid, int status)
+{
+    if (!env_senders.erase(pid)) {
+        return false;
+    }
+
+    if (shell_exit_status(status) != 0) {
+        log_warning() << "sending an environment failed, child " << pid << " exited with "
+                      << shell_exit_status(status) << endl;
+    }
+
+    return true;
+}
+
+bool Daemon::handle_get_env(Client *client, GetEnvMsg *msg)
+{
+    string target = msg->target;
+
+    if (target.empty()) {
+        target = machine_name;
+    }
+
+    string env_key = target + "/" + msg->name;
+    trace() << "handle_get_env " << env_key << endl;
+
+    pid_t pid = 0;
+    map<string, ReceivedEnvironment>::iterator env = received_environments.find(env_key);
+
+    if (env != received_environments.end() && env_senders.size() >= max_env_senders) {
+        trace() << "already sending " << env_senders.size() << " environments, refusing " << env_key << endl;
+    } else if (env != received_environments.end()) {
+        env->second.last_use = time(nullptr);
+        pid = start_send_environment(envbasedir, target, msg->name, client->channel);
+
+        if (pid > 0) {
+            env_senders.insert(pid);
+        }
+    }
+
+    if (pid <= 0) {
+        client->channel->send_msg(EndMsg());
+    }
+
+    // the child sends the environment on its own copy of the connection
+    handle_end(client, 0);
+    return false;
+}
+
+/* Returns the user on the other side of a unix socket, which only local
+   clients use, or -1.  */
+static uid_t local_peer_uid(int fd)
+{
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0 || addr.sun_family != AF_UNIX) {
+        return (uid_t)-1;
+    }
+
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0) {
+        return cred.uid;
+    }
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) == 0) {
+        return uid;
+    }
+#endif
+    return (uid_t)-1;
+}
+
+bool Daemon::handle_result_transfer(Client *client, const string &key, bool put)
+{
+    // Results of local compiles are kept separately for each user, so that
+    // nobody can put results in the cache that others would use.
+    uid_t uid = local_peer_uid(client->channel->fd);
+    bool valid_key = key.size() == 32 && key.find_first_not_of("0123456789abcdef") == string::npos;
+    bool usable = !result_cache_dir.empty() && uid != (uid_t)-1;
+    pid_t pid = 0;
+
+    if (key.empty() && !put) {
+        // a client asking whether it is worth preprocessing before anything else
+        if (usable) {
+            client->channel->send_msg(EndMsg());
+        }
+        handle_end(client, 0);
+        return false;
+    }
+
+    if (usable && valid_key) {
+        trace() << (put ? "put" : "get") << " result " << key << " for user " << uid << endl;
+        pid = start_result_transfer(result_cache_dir, toString(uid) + "-" + key, put,
+                                    client->channel, user_uid, user_gid);
+    }
+
+    if (pid <= 0 && !put) {
+        client->channel->send_msg(EndMsg());
+    }
+
+    // the child handles the result on its own copy of the connection
+    handle_end(client, 0);
+    return false;
+}
+
+bool Daemon::handle_include_scan(Client *client, Msg *msg)
+{
+    // Scans are kept separately for each user, like results.
+    uid_t uid = local_peer_uid(client->channel->fd);
+
+    if (*msg == Msg::GET_INCLUDE_SCAN) {
+        const string &key = static_cast<GetIncludeScanMsg *>(msg)->key;
+        const IncludeScanMsg *scan = nullptr;
+
+        if (uid != (uid_t)-1) {
+            scan = include_scans.find(toString(uid) + "-" + key);
+        }
+
+        if (scan) {
+            client->channel->send_msg(*scan);
+        } else {
+            client->channel->send_msg(EndMsg());
+        }
+    } else if (uid != (uid_t)-1) {
+        IncludeScanMsg *scan = static_cast<IncludeScanMsg *>(msg);
+        include_scans.add(toString(uid) + "-" + scan->key, *scan);
+    }
+
+    handle_end(client, 0);
+    return false;
+}
+
 void Daemon::check_cache_size(const string &new_env)
 {
     time_t now = time(nullptr);
@@ -1340,8 +1914,8 @@ void Daemon::check_cache_size(const string &new_env)
 void Daemon::remove_native_environment(const string& env_key)
 {
     assert(!env_key.empty());
-    remove_native_environment_files(env_key);
     const NativeEnvironment &env = native_environments[env_key];
+    remove_native_environment_files(env.name);
     trace() << "removing " << env.name << " " << env.size << endl;
     if (env.create_env_pipe) {
         if ((-1 == close(env.create_env_pipe)) && (errno != EBADF)){
@@ -1363,15 +1937,29 @@ void Daemon::remove_environment(const string& env_key)
     assert( cache_size >= env.size );
     cache_size -= env.size;
     received_environments.erase(env_key);
+    update_store_size();
+}
+
+void Daemon::update_store_size()
+{
+    size_t new_size = cleanup_env_store(envbasedir);
+    cache_size = cache_size - store_size + new_size;
+    store_size = new_size;
 }
 
 bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
+{
+    return get_native_env(client, msg->compiler, msg->extrafiles, msg->compression);
+}
+
+bool Daemon::get_native_env(Client *client, const string &_compiler, const list<string> &extrafiles,
+                            const string &compression)
 {
     string env_key;
     map<string, time_t> filetimes;
     struct stat st;
 
-    string compiler = msg->compiler;
+    string compiler = _compiler;
     // Older clients passed simply "gcc" or "clang" and not a binary.
     if( !IS_PROTOCOL_VERSION(41, client->channel) && compiler.find('/') == string::npos)
         compiler = "/usr/bin/" + compiler;
@@ -1379,9 +1967,27 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
     string ccompiler = get_c_compiler(compiler);
     string cppcompiler = get_cpp_compiler(compiler);
 
-    trace() << "get_native_env for " << msg->compiler
+    trace() << "get_native_env for " << _compiler
         << " (" << ccompiler << "," << cppcompiler << ")" << endl;
 
+    env_key = compression + ":" + ccompiler;
+    for (list<string>::const_iterator it = extrafiles.begin(); it != extrafiles.end(); ++it) {
+        env_key += ':';
+        env_key += *it;
+    }
+
+    map<string, NativeEnvironment>::iterator known = native_environments.find(env_key);
+
+    if (known != native_environments.end() && known->second.unchanged) {
+        client->status = Client::WAITCREATEENV;
+        client->pending_create_env = env_key;
+        return finish_get_native_env(client, env_key);
+    }
+
+    // Watch before checking, so that no change after the check gets missed.
+    bool watched = known != native_environments.end() && known->second.name.length()
+                   && watch_native_environment(known->second);
+
     if (stat(ccompiler.c_str(), &st) != 0) {
         log_error() << "Compiler binary " << ccompiler << " for environment not found." << endl;
         client->channel->send_msg(EndMsg());
@@ -1394,12 +2000,7 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
         filetimes[cppcompiler] = st.st_mtime;
     }
 
-    env_key = msg->compression + ":" + ccompiler;
-    for (list<string>::const_iterator it = msg->extrafiles.begin();
-            it != msg->extrafiles.end(); ++it) {
-        env_key += ':';
-        env_key += *it;
-
+    for (list<string>::const_iterator it = extrafiles.begin(); it != extrafiles.end(); ++it) {
         if (stat(it->c_str(), &st) != 0) {
             log_error() << "Extra file " << *it << " for environment not found." << endl;
             client->channel->send_msg(EndMsg());
@@ -1411,11 +2012,13 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
     }
 
     if (native_environments[env_key].name.length()) {
-        const NativeEnvironment &env = native_environments[env_key];
+        NativeEnvironment &env = native_environments[env_key];
 
         if (env.filetimes != filetimes || access(env.name.c_str(), R_OK) != 0) {
             trace() << "native_env needs rebuild" << endl;
-            remove_native_environment(env.name);
+            remove_native_environment(env_key);
+        } else {
+            env.unchanged = watched;
         }
     }
 
@@ -1433,7 +2036,7 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
             env.filetimes = filetimes;
             trace() << "start_create_env " << env_key << endl;
             env.create_env_pipe = start_create_env(envbasedir, user_uid, user_gid, ccompiler,
-                msg->extrafiles, msg->compression);
+                extrafiles, compression, native_env_cache);
         } else {
             trace() << "waiting for already running create_env " << env_key << endl;
         }
@@ -1445,19 +2048,136 @@ bool Daemon::finish_get_native_env(Client *client, string env_key)
 {
     assert(client->status == Client::WAITCREATEENV);
     assert(client->pending_create_env == env_key);
-    UseNativeEnvMsg m(native_environments[env_key].name);
+    const string &native = native_environments[env_key].name;
+    native_environments[env_key].last_use = time(nullptr);
+    client->pending_create_env.clear();
+
+    if (GetCSMsg *getcs = client->pending_get_cs) {
+        client->pending_get_cs = nullptr;
+        client->native_env = native;
+        getcs->versions.push_back(make_pair(getcs->target, native_environment_version(native)));
+        getcs->native_compiler.clear();
+        getcs->native_extrafiles.clear();
+        getcs->native_compression.clear();
+        bool ret = handle_get_cs(client, getcs);
+        delete getcs;
+        return ret;
+    }
+
+    UseNativeEnvMsg m(native);
 
     if (!client->channel->send_msg(m)) {
         handle_end(client, 138);
         return false;
     }
 
-    native_environments[env_key].last_use = time(nullptr);
     client->status = Client::GOTNATIVE;
-    client->pending_create_env.clear();
     return true;
 }
 
+// Watches the files of a native environment, so that as long as none of them changes,
+// clients can use it without checking the files again. Returns false if that is not possible.
+bool Daemon::watch_native_environment(const NativeEnvironment &env)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if (inotify_fd < 0) {
+            log_perror("inotify_init1 failed");
+            return false;
+        }
+    }
+
+    list<string> files;
+
+    for (map<string, time_t>::const_iterator it = env.filetimes.begin(); it != env.filetimes.end(); ++it) {
+        files.push_back(it->first);
+    }
+
+    files.push_back(env.name);
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        // Also watch every symlink on the way to the file, in case one of them gets
+        // pointed elsewhere (like the chains of update-alternatives).
+        string path = *it;
+        uint32_t mask = 0;
+
+        for (int links = 0; links <= 40; ++links) {
+            int wd = inotify_add_watch(inotify_fd, path.c_str(),
+                                       mask | IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF);
+
+            if (wd < 0) {
+                log_perror("inotify_add_watch failed") << "\t" << path << endl;
+                return false;
+            }
+
+            inotify_watches[wd].insert(*it);
+
+            // First the file that the symlinks end at, then the symlinks themselves.
+            if (mask != IN_DONT_FOLLOW) {
+                mask = IN_DONT_FOLLOW;
+                continue;
+            }
+
+            char buf[PATH_MAX];
+            ssize_t len = readlink(path.c_str(), buf, sizeof(buf));
+
+            if (len <= 0 || len == sizeof(buf)) {
+                break;
+            }
+
+            string target(buf, len);
+
+            if (target[0] != '/') {
+                target = path.substr(0, path.rfind('/') + 1) + target;
+            }
+
+            path = target;
+        }
+    }
+
+    return true;
+#else
+    (void) env;
+    return false;
+#endif
+}
+
+void Daemon::handle_inotify()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len; ) {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            map<int, set<string> >::iterator watch = inotify_watches.find(event->wd);
+
+            if (watch == inotify_watches.end()) {
+                continue;
+            }
+
+            for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
+                 it != native_environments.end(); ++it) {
+                for (const string &file : watch->second) {
+                    if (it->second.unchanged && (it->second.filetimes.count(file) || it->second.name == file)) {
+                        trace() << "native env " << it->first << " needs checking, " << file << " changed" << endl;
+                        it->second.unchanged = false;
+                    }
+                }
+            }
+
+            if (event->mask & IN_IGNORED) {
+                inotify_watches.erase(watch);
+            }
+        }
+    }
+#endif
+}
+
 bool Daemon::create_env_finished(string env_key)
 {
     assert(native_environments.count(env_key));
@@ -1504,10 +2224,7 @@ bool Daemon::create_env_finished(string env_key)
 bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
 {
     if (cl->status == Client::CLIENTWORK) {
-        if(cl->fulljob)
-            clients.active_processes -= std::max((unsigned int)1, max_kids);
-        else
-            clients.active_processes--;
+        release_job_slots(cl);
     }
 
     cl->status = Client::JOBDONE;
@@ -1529,31 +2246,121 @@ bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
     return send_scheduler(*msg);
 }
 
+bool Daemon::local_job_slot_free() const
+{
+    if (clients.active_link_processes >= max_link_jobs) {
+        return false;
+    }
+
+    // Always allow one local job, further ones only if their memory is there.
+    if (clients.active_link_processes == 0 || link_mem_limit == 0 || current_free_mem == 0) {
+        return true;
+    }
+
+    return current_free_mem >= (unsigned int)link_mem_limit;
+}
+
+// Returns false only if the scheduler could not be reached.
+bool Daemon::start_local_job(Client *client)
+{
+    trace() << "send JobLocalBeginMsg to client" << endl;
+
+    if (!client->channel->send_msg(JobLocalBeginMsg())) {
+        log_warning() << "can't send start message to client" << endl;
+        handle_end(client, 112);
+        return true;
+    }
+
+    client->status = Client::CLIENTWORK;
+    client->linkslot = max_link_jobs > 0;
+
+    if(client->fulljob) { // reserve the entire node
+        clients.active_processes += std::max((unsigned int)1, max_kids);
+        if (client->linkslot)
+            clients.active_link_processes += max_link_jobs;
+        trace() << "pushed full local job " << client->client_id << endl;
+    } else {
+        if (client->linkslot)
+            clients.active_link_processes++;
+        else
+            clients.active_processes++;
+        trace() << "pushed local job " << client->client_id << endl;
+    }
+
+    return send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile, client->fulljob));
+}
+
+void Daemon::release_job_slots(Client *client)
+{
+    if (client->fulljob)
+        clients.active_processes -= std::max((unsigned int)1, max_kids);
+    else if (!client->linkslot)
+        clients.active_processes--;
+
+    if (client->linkslot)
+        clients.active_link_processes -= client->fulljob ? max_link_jobs : 1;
+
+    client->linkslot = false;
+}
+
+// Preprocessing does not use the compile slots. It gets a slot per CPU, but only one
+// while the load is at its maximum, as that may be from other local jobs.
+bool Daemon::cpp_slot_free() const
+{
+    if (clients.active_cpp_processes >= (unsigned int)std::max(num_cpus, 1)) {
+        return false;
+    }
+
+    return clients.active_cpp_processes == 0 || current_load < 1000;
+}
+
 void Daemon::handle_old_request()
 {
-    while ((current_kids + clients.active_processes) < std::max((unsigned int)1, max_kids)) {
+    // Hand out slots for preprocessing in the order they were asked for.
+    while (cpp_slot_free()) {
+        Client *client = nullptr;
+
+        for (auto it : clients) {
+            if (it.second->status == Client::WAITCPP
+                && (!client || it.second->client_id < client->client_id)) {
+                client = it.second;
+            }
+        }
+
+        if (!client) {
+            break;
+        }
+
+        if (!client->channel->send_msg(CppSlotMsg())) {
+            handle_end(client, 145);
+            continue;
+        }
+
+        client->status = Client::CPPSLOT;
+        clients.active_cpp_processes++;
+        trace() << "cpp slot for " << client->client_id << endl;
+    }
 
+    // Local jobs with their own slots don't have to wait for compile slots.
+    while (max_link_jobs) {
         Client *client = clients.get_earliest_client(Client::LINKJOB);
 
-        if (client) {
-            trace() << "send JobLocalBeginMsg to client" << endl;
+        if (!client || !local_job_slot_free()) {
+            break;
+        }
 
-            if (!client->channel->send_msg(JobLocalBeginMsg())) {
-                log_warning() << "can't send start message to client" << endl;
-                handle_end(client, 112);
-            } else {
-                client->status = Client::CLIENTWORK;
-                if(client->fulljob) { // reserve the entire node
-                    clients.active_processes += std::max((unsigned int)1, max_kids);
-                    trace() << "pushed full local job " << client->client_id << endl;
-                } else {
-                    clients.active_processes++;
-                    trace() << "pushed local job " << client->client_id << endl;
-                }
-                if (!send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile,
-                        client->fulljob))) {
-                    return;
-                }
+        if (!start_local_job(client)) {
+            return;
+        }
+    }
+
+    while ((current_kids + clients.active_processes) < std::max((unsigned int)1, max_kids)) {
+
+        Client *client = max_link_jobs ? nullptr : clients.get_earliest_client(Client::LINKJOB);
+
+        if (client) {
+            if (!start_local_job(client)) {
+                return;
             }
 
             continue;
@@ -1563,6 +2370,7 @@ void Daemon::handle_old_request()
 
         if (client) {
             trace() << "pending " << client->dump() << endl;
+            client->usecsmsg->native_env = client->native_env;
 
             if (client->channel->send_msg(*client->usecsmsg)) {
                 client->status = Client::CLIENTWORK;
@@ -1594,7 +2402,9 @@ void Daemon::handle_old_request()
 
             string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
             received_environments[envforjob].last_use = time(nullptr);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
+            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid,
+                                    result_cache_dir, header_cache_dir, pch_cache_limit,
+                                    job_tmpfs_size());
             trace() << "handle connection returned " << pid << endl;
 
             if (pid > 0) {
@@ -1617,6 +2427,19 @@ void Daemon::handle_old_request()
     }
 }
 
+// The share of tmp_memory_limit of a job, or 0 if the memory is not free.
+size_t Daemon::job_tmpfs_size() const
+{
+    size_t size = tmp_memory_limit / std::max(max_kids, 1U);
+
+    if (current_free_mem && size_t(current_free_mem) * 1024 * 1024
+            < size + size_t(mem_limit) * 1024 * 1024) {
+        return 0;
+    }
+
+    return size;
+}
+
 bool Daemon::handle_compile_done(Client *client)
 {
     assert(client->status == Client::WAITFORCHILD);
@@ -1628,7 +2451,7 @@ bool Daemon::handle_compile_done(Client *client)
     assert(current_kids > 0);
     current_kids--;
 
-    unsigned int job_stat[8];
+    unsigned int job_stat[JobStatistics::field_count];
     int end_status = 151;
 
     if (read(client->pipe_from_child, job_stat, sizeof(job_stat)) == sizeof(job_stat)) {
@@ -1640,6 +2463,8 @@ bool Daemon::handle_compile_done(Client *client)
         msg->user_msec = job_stat[JobStatistics::user_msec];
         msg->sys_msec = job_stat[JobStatistics::sys_msec];
         msg->pfaults = job_stat[JobStatistics::sys_pfaults];
+        msg->in_msec = job_stat[JobStatistics::in_msec];
+        msg->rtt_usec = job_stat[JobStatistics::rtt_usec];
     }
 
     close(client->pipe_from_child);
@@ -1654,6 +2479,17 @@ bool Daemon::handle_compile_done(Client *client)
 
     if(!send_scheduler(*msg))
         log_warning() << "failed sending scheduler about compile done " << client->job->jobID() << endl;
+
+    if (!result_cache_dir.empty() && next_result_cache_trim <= time(nullptr)) {
+        trim_result_cache(result_cache_dir, result_cache_limit);
+        next_result_cache_trim = time(nullptr) + 60;
+    }
+
+    if (!header_cache_dir.empty() && next_header_cache_trim <= time(nullptr)) {
+        trim_header_cache(header_cache_dir, header_cache_limit);
+        next_header_cache_trim = time(nullptr) + 60;
+    }
+
     handle_end(client, end_status);
     delete msg;
     return false;
@@ -1726,14 +2562,21 @@ void Daemon::handle_end(Client *client, int exitcode)
         finish_transfer_env(client, true);
     }
 
+    if (client->status != Client::WAITFETCHENV && !client->fetch_env.empty()) {
+        // the other daemon closed the connection without sending the environment
+        finish_env_fetch(client->fetch_env, false);
+        client->fetch_env.clear();
+    }
+
     if (client->status == Client::CLIENTWORK) {
-        if(client->fulljob)
-            clients.active_processes -= std::max((unsigned int)1, max_kids);
-        else
-            clients.active_processes--;
+        release_job_slots(client);
     }
     client->fulljob = false;
 
+    if (client->status == Client::CPPSLOT) {
+        clients.active_cpp_processes--;
+    }
+
     if (client->status == Client::WAITCOMPILE && exitcode == 119) {
         /* the client sent us a real good bye, so forget about the scheduler */
         client->job_id = 0;
@@ -1780,6 +2623,9 @@ void Daemon::handle_end(Client *client, int exitcode)
             case Client::TOINSTALL:
             case Client::WAITINSTALL:
             case Client::WAITCREATEENV:
+            case Client::WAITFETCHENV:
+            case Client::WAITCPP:
+            case Client::CPPSLOT:
                 assert(false);   // should not have a job_id
                 break;
             case Client::WAITCOMPILE:
@@ -1825,7 +2671,9 @@ void Daemon::clear_children()
 
         while ((child = waitpid(-1, &status, 0)) < 0 && errno == EINTR) {}
 
-        current_kids--;
+        if (!env_sender_done(child, status)) {
+            current_kids--;
+        }
     }
 
     // they should be all in clients too
@@ -1840,6 +2688,14 @@ bool Daemon::handle_get_cs(Client *client, Msg *msg)
 {
     GetCSMsg *umsg = dynamic_cast<GetCSMsg *>(msg);
     assert(client);
+
+    // Find the native environment first, then continue from finish_get_native_env().
+    if (umsg->versions.empty() && !umsg->native_compiler.empty()) {
+        client->pending_get_cs = new GetCSMsg(*umsg);
+        return get_native_env(client, umsg->native_compiler, umsg->native_extrafiles,
+                              umsg->native_compression);
+    }
+
     client->status = Client::WAITFORCS;
     client->niceness = umsg->niceness;
     umsg->client_id = client->client_id;
@@ -1879,7 +2735,8 @@ bool Daemon::handle_local_job(Client *client, Msg *msg)
 
 bool Daemon::handle_activity(Client *client)
 {
-    assert(client->status != Client::TOCOMPILE && client->status != Client::WAITINSTALL);
+    assert(client->status != Client::TOCOMPILE && client->status != Client::WAITINSTALL
+           && client->status != Client::WAITFETCHENV);
 
     Msg *msg = client->channel->get_msg(0, true);
 
@@ -1925,6 +2782,34 @@ bool Daemon::handle_activity(Client *client)
     case Msg::BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(client, msg);
         break;
+    case Msg::ENV_FETCH:
+        ret = handle_env_fetch(client, dynamic_cast<EnvFetchMsg *>(msg));
+        break;
+    case Msg::GET_ENV:
+        ret = handle_get_env(client, dynamic_cast<GetEnvMsg *>(msg));
+        break;
+    case Msg::GET_RESULT:
+        ret = handle_result_transfer(client, dynamic_cast<GetResultMsg *>(msg)->key, false);
+        break;
+    case Msg::PUT_RESULT:
+        ret = handle_result_transfer(client, dynamic_cast<PutResultMsg *>(msg)->key, true);
+        break;
+    case Msg::GET_INCLUDE_SCAN:
+    case Msg::INCLUDE_SCAN:
+        ret = handle_include_scan(client, msg);
+        break;
+    case Msg::CPP_SLOT:
+        // Without waiting a client gets a slot only if it doesn't jump the queue.
+        if (!static_cast<CppSlotMsg *>(msg)->wait
+                && (!cpp_slot_free() || clients.get_earliest_client(Client::WAITCPP))) {
+            trace() << "no cpp slot free for " << client->client_id << endl;
+            ret = client->channel->send_msg(EndMsg());
+            break;
+        }
+
+        client->status = Client::WAITCPP;
+        ret = true;
+        break;
     default:
         log_error() << "protocol error " << msg->to_string() << " on client "
                     << client->dump() << endl;
@@ -1953,7 +2838,21 @@ void Daemon::answer_client_requests()
     /* reap zombies */
     int status;
 
-    while (waitpid(-1, &status, WNOHANG) < 0 && errno == EINTR) {}
+    for (set<pid_t>::iterator it = env_senders.begin(); it != env_senders.end();) {
+        pid_t pid = *it++;
+
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            env_sender_done(pid, status);
+        }
+    }
+
+    pid_t child;
+
+    while ((child = waitpid(-1, &status, WNOHANG)) < 0 && errno == EINTR) {}
+
+    if (child > 0) {
+        env_sender_done(child, status);
+    }
 
     handle_old_request();
 
@@ -1991,7 +2890,8 @@ void Daemon::answer_client_requests()
         assert(client);
         int current_status = client->status;
         bool ignore_channel = current_status == Client::WAITFORCHILD ||
-                              current_status == Client::WAITINSTALL;
+                              current_status == Client::WAITINSTALL ||
+                              current_status == Client::WAITFETCHENV;
 
         /* when the remote host is full with work, the wait time for it to free up and
            fork a child to compile could be long. If the input is ready to read, we will read
@@ -2035,7 +2935,27 @@ void Daemon::answer_client_requests()
         }
     }
 
-    int ret = poll(pollfds.data(), pollfds.size(), max_scheduler_pong * 1000);
+    if (inotify_fd >= 0) {
+        pfd.fd = inotify_fd;
+        pfd.events = POLLIN;
+        pollfds.push_back(pfd);
+    }
+
+    for (map<int, PendingEnvFetch>::const_iterator it = pending_env_fetches.begin();
+            it != pending_env_fetches.end(); ++it) {
+        pfd.fd = it->first;
+        pfd.events = it->second.channel ? POLLIN : POLLOUT;
+        pollfds.push_back(pfd);
+    }
+
+    // Pending environment fetches time out even without activity.
+    int timeout = max_scheduler_pong * 1000;
+
+    if (!pending_env_fetches.empty()) {
+        timeout = min(timeout, 1000);
+    }
+
+    int ret = poll(pollfds.data(), pollfds.size(), timeout);
 
     if (ret < 0 && errno != EINTR) {
         log_perror("poll");
@@ -2049,6 +2969,10 @@ void Daemon::answer_client_requests()
         reset_debug_if_needed();
     }
 
+    if (ret >= 0) {
+        handle_pending_env_fetches(pollfds);
+    }
+
     if (ret > 0) {
         bool had_scheduler = scheduler;
 
@@ -2079,6 +3003,12 @@ void Daemon::answer_client_requests()
                 case Msg::NO_CS:
                     ret = scheduler_no_cs(static_cast<NoCSMsg *>(msg));
                     break;
+                case Msg::ENV_FETCH:
+                    ret = scheduler_env_fetch(static_cast<EnvFetchMsg *>(msg));
+                    break;
+                case Msg::LEND_CS:
+                    ret = scheduler_lend_cs(static_cast<LendCSMsg *>(msg));
+                    break;
                 case Msg::GET_INTERNALS:
                     ret = scheduler_get_internals();
                     break;
@@ -2146,7 +3076,8 @@ void Daemon::answer_client_requests()
 
                 if (client->status == Client::TOCOMPILE
                         || client->status == Client::WAITFORCHILD
-                        || client->status == Client::WAITINSTALL) {
+                        || client->status == Client::WAITINSTALL
+                        || client->status == Client::WAITFETCHENV) {
                     break;
                 }
             }
@@ -2182,7 +3113,8 @@ void Daemon::answer_client_requests()
                     }
                     else
                     {
-                        assert(client->status != Client::TOCOMPILE && client->status != Client::WAITINSTALL);
+                        assert(client->status != Client::TOCOMPILE && client->status != Client::WAITINSTALL
+                               && client->status != Client::WAITFETCHENV);
 
                         while (!c->read_a_bit() || c->has_msg()) {
                             if (!handle_activity(client)) {
@@ -2191,7 +3123,8 @@ void Daemon::answer_client_requests()
 
                             if (client->status == Client::TOCOMPILE
                                 || client->status == Client::WAITFORCHILD
-                                || client->status == Client::WAITINSTALL) {
+                                || client->status == Client::WAITINSTALL
+                                || client->status == Client::WAITFETCHENV) {
                                 break;
                             }
                         }
@@ -2210,6 +3143,10 @@ void Daemon::answer_client_requests()
                 }
                 ++it;
             }
+
+            if (inotify_fd >= 0 && pollfd_is_set(pollfds, inotify_fd, POLLIN)) {
+                handle_inotify();
+            }
         }
 
         if (had_scheduler && !scheduler) {
@@ -2222,6 +3159,12 @@ void Daemon::answer_client_requests()
 
 bool Daemon::reconnect()
 {
+    if (scheduler && lent_until && lent_until <= time(nullptr) && clients.size() == 0) {
+        log_info() << "done serving the scheduler at " << lent_scheduler << endl;
+        close_scheduler();
+        next_scheduler_connect = 0;
+    }
+
     if (scheduler) {
         return true;
     }
@@ -2236,8 +3179,19 @@ bool Daemon::reconnect()
 #endif
 
     if (!discover || (nullptr == (scheduler = discover->try_get_scheduler()) && discover->timed_out())) {
+        if (discover && !lent_scheduler.empty()) {
+            log_warning() << "cannot reach the scheduler at " << lent_scheduler << ", going back" << endl;
+            lent_scheduler.clear();
+            lent_until = 0;
+        }
+
         delete discover;
-        discover = new DiscoverSched(netname, max_scheduler_pong, schedname, scheduler_port);
+
+        if (lent_scheduler.empty()) {
+            discover = new DiscoverSched(netname, max_scheduler_pong, schedname, scheduler_port);
+        } else {
+            discover = new DiscoverSched(netname, max_scheduler_pong, lent_scheduler, lent_port);
+        }
     }
 
     if (!scheduler) {
@@ -2258,6 +3212,7 @@ bool Daemon::reconnect()
     }
 
     log_info() << "Connected to scheduler (I am known as " << remote_name << ")" << endl;
+    scheduler_connected = time(nullptr);
     current_load = -1000;
     gettimeofday(&last_stat, nullptr);
     icecream_load = 0;
@@ -2265,6 +3220,7 @@ bool Daemon::reconnect()
     LoginMsg lmsg(daemon_port, determine_nodename(), machine_name, supported_features);
     lmsg.envs = available_environments(envbasedir);
     lmsg.max_kids = max_kids;
+    lmsg.max_link_jobs = max_link_jobs;
     lmsg.noremote = noremote;
     return send_scheduler(lmsg);
 }
@@ -2294,6 +3250,7 @@ int main(int argc, char **argv)
     int debug_level = Error;
     string logfile;
     bool detach = false;
+    bool user_namespaces = false;
     nice_level = 5; // defined in serve.h
 
     while (true) {
@@ -2310,7 +3267,15 @@ int main(int argc, char **argv)
             { "env-basedir", 1, nullptr, 'b' },
             { "user-uid", 1, nullptr, 'u'},
             { "cache-limit", 1, nullptr, 0},
+            { "result-cache-limit", 1, nullptr, 0},
+            { "header-cache-limit", 1, nullptr, 0},
+            { "pch-cache-limit", 1, nullptr, 0},
+            { "native-env-cache", 1, nullptr, 0},
             { "no-remote", 0, nullptr, 0},
+            { "user-namespaces", 0, nullptr, 0},
+            { "tmp-memory-limit", 1, nullptr, 0},
+            { "max-link-jobs", 1, nullptr, 0},
+            { "link-mem-limit", 1, nullptr, 0},
             { "interface", 1, nullptr, 'i'},
             { "port", 1, nullptr, 'p'},
             { nullptr, 0, nullptr, 0 }
@@ -2354,8 +3319,52 @@ int main(int argc, char **argv)
                 } else {
                     usage("Error: --cache-limit requires argument");
                 }
+            } else if (optname == "result-cache-limit") {
+                if (optarg && *optarg) {
+                    result_cache_limit = (size_t)std::max(atoi(optarg), 0) * 1024 * 1024;
+                } else {
+                    usage("Error: --result-cache-limit requires argument");
+                }
+            } else if (optname == "header-cache-limit") {
+                if (optarg && *optarg) {
+                    header_cache_limit = (size_t)std::max(atoi(optarg), 0) * 1024 * 1024;
+                } else {
+                    usage("Error: --header-cache-limit requires argument");
+                }
+            } else if (optname == "pch-cache-limit") {
+                if (optarg && *optarg) {
+                    pch_cache_limit = (size_t)std::max(atoi(optarg), 0) * 1024 * 1024;
+                } else {
+                    usage("Error: --pch-cache-limit requires argument");
+                }
+            } else if (optname == "native-env-cache") {
+                if (optarg && *optarg) {
+                    d.native_env_cache = optarg;
+                } else {
+                    usage("Error: --native-env-cache requires argument");
+                }
             } else if (optname == "no-remote") {
                 d.noremote = true;
+            } else if (optname == "user-namespaces") {
+                user_namespaces = true;
+            } else if (optname == "tmp-memory-limit") {
+                if (optarg && *optarg) {
+                    tmp_memory_limit = (size_t)std::max(atoi(optarg), 0) * 1024 * 1024;
+                } else {
+                    usage("Error: --tmp-memory-limit requires argument");
+                }
+            } else if (optname == "max-link-jobs") {
+                if (optarg && *optarg) {
+                    max_link_jobs = std::max(atoi(optarg), 0);
+                } else {
+                    usage("Error: --max-link-jobs requires argument");
+                }
+            } else if (optname == "link-mem-limit") {
+                if (optarg && *optarg) {
+                    link_mem_limit = std::max(atoi(optarg), 0);
+                } else {
+                    usage("Error: --link-mem-limit requires argument");
+                }
             }
 
         }
@@ -2521,7 +3530,6 @@ int main(int argc, char **argv)
 #else
         {
 #endif
-            d.noremote = true;
             remote_disabled = true;
         }
     }
@@ -2530,8 +3538,18 @@ int main(int argc, char **argv)
 
     log_info() << "ICECREAM daemon " VERSION " starting up (nice level "
                << nice_level << ") " << endl;
-    if (remote_disabled)
+    if (user_namespaces && !d.noremote) {
+        if (init_namespace_sandbox(d.user_uid, d.user_gid)) {
+            log_info() << "Remote jobs run in user namespaces." << endl;
+            remote_disabled = false;
+        } else {
+            log_warning() << "Cannot use user namespaces." << endl;
+        }
+    }
+    if (remote_disabled) {
         log_warning() << "Cannot use chroot, no remote jobs accepted." << endl;
+        d.noremote = true;
+    }
     if (d.noremote)
         d.daemon_port = 0;
 
@@ -2561,6 +3579,10 @@ int main(int argc, char **argv)
 
     log_info() << "allowing up to " << max_kids << " active jobs" << endl;
 
+    if (max_link_jobs) {
+        log_info() << "allowing up to " << max_link_jobs << " local jobs" << endl;
+    }
+
     d.determine_supported_features();
     log_info() << "supported features: " << supported_features_to_string(d.supported_features) << endl;
 
@@ -2602,6 +3624,21 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (result_cache_limit && init_result_cache(d.envbasedir + "/results", d.user_uid, d.user_gid)) {
+        d.result_cache_dir = d.envbasedir + "/results";
+        d.supported_features |= NODE_FEATURE_RESULT_CACHE;
+    }
+
+    // Sources and headers of jobs preprocessed here.
+    if (header_cache_limit && init_result_cache(d.envbasedir + "/headers", d.user_uid, d.user_gid)) {
+        d.header_cache_dir = d.envbasedir + "/headers";
+        d.supported_features |= NODE_FEATURE_REMOTE_CPP;
+    }
+
+    if (pch_cache_limit) {
+        d.supported_features |= NODE_FEATURE_PCH;
+    }
+
     list<string> nl = get_netnames(200, d.scheduler_port);
     trace() << "Netnames:" << endl;
 
@@ -2609,6 +3646,11 @@ int main(int argc, char **argv)
         trace() << *it << endl;
     }
 
+    // Before there are any connections it could inherit.
+    if (!d.noremote && !start_compile_launcher()) {
+        log_info() << "no compile launcher, forking jobs from the daemon" << endl;
+    }
+
     if (!d.setup_listen_fds()) { // error
         return 1;
     }
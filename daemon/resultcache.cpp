@@ -0,0 +1,476 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <comm.h>
+#include <job.h>
+
+#include "logging.h"
+#include "resultcache.h"
+
+using namespace std;
+
+static void hash_string(md5_state_t *state, const string &str)
+{
+    // Include the terminating zero, so that the strings are separated.
+    md5_append(state, (const md5_byte_t *)str.c_str(), str.size() + 1);
+}
+
+static bool read_fd(int fd, string &data)
+{
+    char buffer[4096];
+
+    for (;;) {
+        ssize_t bytes = read(fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            return false;
+        }
+
+        if (bytes == 0) {
+            return true;
+        }
+
+        data.append(buffer, bytes);
+    }
+}
+
+static bool write_fd(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t bytes = write(fd, data, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        data += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+ResultCache::ResultCache(int dir_fd, const CompileJob &job)
+    : m_dirFd(dir_fd)
+    , m_objFd(-1)
+    , m_dwoFd(-1)
+{
+    md5_init(&m_state);
+    hash_string(&m_state, job.targetPlatform() + "/" + job.environmentVersion());
+
+    list<string> fields = job.resultKeyFields();
+
+    for (list<string>::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+        hash_string(&m_state, *it);
+    }
+}
+
+ResultCache::ResultCache(int dir_fd, const string &key)
+    : m_dirFd(dir_fd)
+    , m_key(key)
+    , m_objFd(-1)
+    , m_dwoFd(-1)
+{
+}
+
+ResultCache::~ResultCache()
+{
+    if (m_objFd >= 0) {
+        close(m_objFd);
+    }
+
+    if (m_dwoFd >= 0) {
+        close(m_dwoFd);
+    }
+
+    close(m_dirFd);
+}
+
+void ResultCache::add_input(const unsigned char *data, size_t len)
+{
+    md5_append(&m_state, data, len);
+}
+
+void ResultCache::finish_key()
+{
+    if (!m_key.empty()) {
+        return;
+    }
+
+    md5_byte_t digest[16];
+    md5_finish(&m_state, digest);
+    char hex[33];
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(hex + di * 2, "%02x", digest[di]);
+    }
+
+    m_key = hex;
+}
+
+bool ResultCache::lookup(CompileResultMsg &rmsg)
+{
+    finish_key();
+
+    int meta_fd = openat(m_dirFd, (m_key + ".meta").c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (meta_fd < 0) {
+        return false;
+    }
+
+    string meta;
+    bool ok = read_fd(meta_fd, meta);
+    // Mark it as recently used for trim_result_cache().
+    futimens(meta_fd, nullptr);
+    close(meta_fd);
+
+    unsigned int have_dwo;
+    size_t out_len;
+    size_t err_len;
+    int header_len;
+
+    if (!ok || sscanf(meta.c_str(), "icecc-result 1 %u %zu %zu\n%n", &have_dwo, &out_len, &err_len,
+                      &header_len) != 3 || meta.size() != (size_t)header_len + out_len + err_len) {
+        return false;
+    }
+
+    m_objFd = openat(m_dirFd, (m_key + ".o").c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (have_dwo) {
+        m_dwoFd = openat(m_dirFd, (m_key + ".dwo").c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    if (m_objFd < 0 || (have_dwo && m_dwoFd < 0)) {
+        return false;
+    }
+
+    rmsg.status = 0;
+    rmsg.out = meta.substr(header_len, out_len);
+    rmsg.err = meta.substr(header_len + out_len, err_len);
+    rmsg.have_dwo_file = have_dwo;
+    return true;
+}
+
+bool ResultCache::store_file(const string &file, const string &name)
+{
+    int in_fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (in_fd < 0) {
+        return false;
+    }
+
+    string tmp_name = name + ".tmp" + to_string(getpid());
+    int out_fd = openat(m_dirFd, tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = out_fd >= 0;
+    char buffer[65536];
+
+    while (ok) {
+        ssize_t bytes = read(in_fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            ok = bytes == 0;
+            break;
+        }
+
+        ok = write_fd(out_fd, buffer, bytes);
+    }
+
+    close(in_fd);
+
+    if (out_fd >= 0 && close(out_fd) != 0) {
+        ok = false;
+    }
+
+    if (ok && renameat(m_dirFd, tmp_name.c_str(), m_dirFd, name.c_str()) == 0) {
+        return true;
+    }
+
+    unlinkat(m_dirFd, tmp_name.c_str(), 0);
+    return false;
+}
+
+void ResultCache::store(const string &obj_file, const string &dwo_file, const CompileResultMsg &rmsg)
+{
+    finish_key();
+
+    if (!store_file(obj_file, m_key + ".o")
+            || (rmsg.have_dwo_file && !store_file(dwo_file, m_key + ".dwo"))) {
+        log_warning() << "failed to store result " << m_key << " in the result cache" << endl;
+        return;
+    }
+
+    if (store_meta(rmsg)) {
+        trace() << "stored result " << m_key << " in the result cache" << endl;
+    }
+}
+
+bool ResultCache::store_meta(const CompileResultMsg &rmsg)
+{
+    char header[100];
+    sprintf(header, "icecc-result 1 %u %zu %zu\n", rmsg.have_dwo_file ? 1 : 0, rmsg.out.size(), rmsg.err.size());
+    string meta = header + rmsg.out + rmsg.err;
+    string tmp_name = m_key + ".meta.tmp" + to_string(getpid());
+    int fd = openat(m_dirFd, tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = write_fd(fd, meta.data(), meta.size());
+
+    if (close(fd) != 0 || !ok
+            || renameat(m_dirFd, tmp_name.c_str(), m_dirFd, (m_key + ".meta").c_str()) != 0) {
+        unlinkat(m_dirFd, tmp_name.c_str(), 0);
+        return false;
+    }
+
+    return true;
+}
+
+static bool send_fd(MsgChannel *c, int fd)
+{
+    unsigned char buffer[100000];
+
+    for (;;) {
+        ssize_t bytes = read(fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            return false;
+        }
+
+        if (bytes == 0) {
+            return c->send_msg(EndMsg());
+        }
+
+        if (!c->send_msg(FileChunkMsg(buffer, bytes))) {
+            return false;
+        }
+    }
+}
+
+bool ResultCache::send(MsgChannel *c)
+{
+    CompileResultMsg rmsg;
+
+    if (!lookup(rmsg)) {
+        return c->send_msg(EndMsg());
+    }
+
+    return c->send_msg(rmsg) && send_fd(c, m_objFd) && (m_dwoFd < 0 || send_fd(c, m_dwoFd));
+}
+
+bool ResultCache::receive_file(MsgChannel *c, const string &name)
+{
+    string tmp_name = name + ".tmp" + to_string(getpid());
+    int fd = openat(m_dirFd, tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = true;
+
+    for (;;) {
+        Msg *msg = c->get_msg(40);
+
+        if (!msg || (*msg != Msg::FILE_CHUNK && *msg != Msg::END)) {
+            delete msg;
+            ok = false;
+            break;
+        }
+
+        if (*msg == Msg::END) {
+            delete msg;
+            break;
+        }
+
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+        ok = write_fd(fd, (const char *)fcmsg->buffer, fcmsg->len);
+        delete msg;
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    if (close(fd) != 0 || !ok || renameat(m_dirFd, tmp_name.c_str(), m_dirFd, name.c_str()) != 0) {
+        unlinkat(m_dirFd, tmp_name.c_str(), 0);
+        return false;
+    }
+
+    return true;
+}
+
+bool ResultCache::receive(MsgChannel *c)
+{
+    Msg *msg = c->get_msg(40);
+    CompileResultMsg *rmsg = dynamic_cast<CompileResultMsg *>(msg);
+    bool ok = rmsg && rmsg->status == 0
+              && receive_file(c, m_key + ".o")
+              && (!rmsg->have_dwo_file || receive_file(c, m_key + ".dwo"))
+              && store_meta(*rmsg);
+    delete msg;
+    return ok;
+}
+
+pid_t start_result_transfer(const string &dir, const string &key, bool put,
+                            MsgChannel *c, uid_t user_uid, gid_t user_gid)
+{
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("start_result_transfer - fork()");
+        return 0;
+    }
+
+    if (pid) {
+        return pid;
+    }
+
+    reset_debug();
+
+    // The files in the cache belong to the icecc user.
+    if (getuid() == 0 && (setgroups(0, nullptr) < 0 || setgid(user_gid) < 0 || setuid(user_uid) < 0)) {
+        log_perror("start_result_transfer - dropping privileges");
+        _exit(1);
+    }
+
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir_fd < 0) {
+        log_perror("open result cache") << "\t" << dir << endl;
+        _exit(1);
+    }
+
+    ResultCache cache(dir_fd, key);
+    bool ok = put ? cache.receive(c) : cache.send(c);
+    trace() << (put ? "stored " : "sent ") << "result " << key << (ok ? "" : " failed") << endl;
+    _exit(ok ? 0 : 1);
+}
+
+bool init_result_cache(const string &dir, uid_t user_uid, gid_t user_gid)
+{
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        log_perror("mkdir result cache") << "\t" << dir << endl;
+        return false;
+    }
+
+    if (chown(dir.c_str(), user_uid, user_gid) || chmod(dir.c_str(), 0700)) {
+        log_perror("chown,chmod result cache") << "\t" << dir << endl;
+        return false;
+    }
+
+    return true;
+}
+
+size_t trim_result_cache(const string &dir, size_t limit)
+{
+    DIR *cachedir = opendir(dir.c_str());
+
+    if (!cachedir) {
+        return 0;
+    }
+
+    struct Entry {
+        time_t last_use = 0;
+        size_t size = 0;
+        vector<string> files;
+    };
+    map<string, Entry> entries;
+    size_t total = 0;
+
+    for (struct dirent *ent = readdir(cachedir); ent; ent = readdir(cachedir)) {
+        string name = ent->d_name;
+        struct stat st;
+
+        if (name[0] == '.' || fstatat(dirfd(cachedir), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+
+        Entry &entry = entries[name.substr(0, name.find('.'))];
+        entry.size += st.st_size;
+        entry.files.push_back(name);
+        total += st.st_size;
+
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".meta") == 0) {
+            entry.last_use = st.st_mtime;
+        }
+    }
+
+    if (total > limit) {
+        vector<pair<time_t, string> > by_use;
+
+        for (map<string, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+            by_use.push_back(make_pair(it->second.last_use, it->first));
+        }
+
+        // Incomplete entries have no last use time, so they go first.
+        sort(by_use.begin(), by_use.end());
+
+        for (vector<pair<time_t, string> >::const_iterator it = by_use.begin();
+                it != by_use.end() && total > limit; ++it) {
+            const Entry &entry = entries[it->second];
+
+            for (const string &file : entry.files) {
+                unlinkat(dirfd(cachedir), file.c_str(), 0);
+            }
+
+            total -= entry.size;
+        }
+
+        trace() << "result cache trimmed to " << total << " bytes" << endl;
+    }
+
+    closedir(cachedir);
+    return total;
+}
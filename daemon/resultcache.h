@@ -0,0 +1,92 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_RESULTCACHE_H
+#define ICECREAM_RESULTCACHE_H
+
+#include <string>
+#include <sys/types.h>
+
+#include "md5.h"
+
+class CompileJob;
+class CompileResultMsg;
+class MsgChannel;
+
+/* Results of compile jobs, stored in a directory and keyed by the hash of
+   the preprocessed source, the environment and the compiler flags.
+   An entry consists of <key>.o, optionally <key>.dwo, and <key>.meta with
+   the compiler output, which is written last and marks the entry complete.  */
+class ResultCache
+{
+public:
+    // dir_fd is the cache directory, which stays usable after chroot. It is closed
+    // when the object is destroyed.
+    ResultCache(int dir_fd, const CompileJob &job);
+    // For results with a key computed by somebody else.
+    ResultCache(int dir_fd, const std::string &key);
+    ~ResultCache();
+
+    // Adds the next part of the preprocessed source to the key.
+    void add_input(const unsigned char *data, size_t len);
+    // Finishes the key and returns true if there is a result for it,
+    // setting the compiler output in rmsg and opening the result files.
+    bool lookup(CompileResultMsg &rmsg);
+    void store(const std::string &obj_file, const std::string &dwo_file, const CompileResultMsg &rmsg);
+    // Sends the result like a compile server does, or END if there is none.
+    bool send(MsgChannel *c);
+    // Receives a result sent like a compile server does and stores it.
+    bool receive(MsgChannel *c);
+
+    const std::string &key() const
+    {
+        return m_key;
+    }
+    int object_fd() const
+    {
+        return m_objFd;
+    }
+    int dwo_fd() const
+    {
+        return m_dwoFd;
+    }
+
+private:
+    void finish_key();
+    bool store_file(const std::string &file, const std::string &name);
+    bool store_meta(const CompileResultMsg &rmsg);
+    bool receive_file(MsgChannel *c, const std::string &name);
+
+    int m_dirFd;
+    md5_state_t m_state;
+    std::string m_key;
+    int m_objFd;
+    int m_dwoFd;
+};
+
+// Creates the cache directory if needed, returns false if it is not usable.
+extern bool init_result_cache(const std::string &dir, uid_t user_uid, gid_t user_gid);
+// Forks a child that sends (or receives if put) the result for key over c.
+extern pid_t start_result_transfer(const std::string &dir, const std::string &key, bool put,
+                                   MsgChannel *c, uid_t user_uid, gid_t user_gid);
+// Removes least recently used results until the cache is at most limit bytes, returns its size.
+extern size_t trim_result_cache(const std::string &dir, size_t limit);
+
+#endif
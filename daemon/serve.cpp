@@ -47,6 +47,8 @@
 
 #include "environment.h"
 #include "exitcode.h"
+#include "headercache.h"
+#include "resultcache.h"
 #include "tempfile.h"
 #include "workit.h"
 #include "logging.h"
@@ -56,9 +58,11 @@
 
 #include <sys/time.h>
 
-#ifdef __FreeBSD__
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <poll.h>
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
 #endif
 
 #ifndef O_LARGEFILE
@@ -81,6 +85,38 @@ error_client(MsgChannel *client, string error)
     }
 }
 
+static void write_output_fd(int obj_fd, MsgChannel* client)
+{
+    unsigned char buffer[100000];
+
+    do {
+        ssize_t bytes = read(obj_fd, buffer, sizeof(buffer));
+
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
+
+        if (!bytes) {
+            if( !client->send_msg(EndMsg())) {
+                log_info() << "write of obj end failed " << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+            break;
+        }
+
+        FileChunkMsg fcmsg(buffer, bytes);
+
+        if (!client->send_msg(fcmsg)) {
+            log_info() << "write of obj chunk failed " << bytes << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
+    } while (1);
+}
+
 static void write_output_file( const string& file, MsgChannel* client )
 {
     int obj_fd = -1;
@@ -93,34 +129,7 @@ static void write_output_file( const string& file, MsgChannel* client )
             throw myexception(EXIT_DISTCC_FAILED);
         }
 
-        unsigned char buffer[100000];
-
-        do {
-            ssize_t bytes = read(obj_fd, buffer, sizeof(buffer));
-
-            if (bytes < 0) {
-                if (errno == EINTR) {
-                    continue;
-                }
-
-                throw myexception(EXIT_DISTCC_FAILED);
-            }
-
-            if (!bytes) {
-                if( !client->send_msg(EndMsg())) {
-                    log_info() << "write of obj end failed " << endl;
-                    throw myexception(EXIT_DISTCC_FAILED);
-                }
-                break;
-            }
-
-            FileChunkMsg fcmsg(buffer, bytes);
-
-            if (!client->send_msg(fcmsg)) {
-                log_info() << "write of obj chunk failed " << bytes << endl;
-                throw myexception(EXIT_DISTCC_FAILED);
-            }
-        } while (1);
+        write_output_fd(obj_fd, client);
 
     } catch(...) {
         if( obj_fd != -1 )
@@ -132,38 +141,14 @@ static void write_output_file( const string& file, MsgChannel* client )
 }
 
 /**
- * Read a request, run the compiler, and send a response.
+ * Run the compiler for a job and send the response, in a process of its own.
  **/
-int handle_connection(const string &basedir, CompileJob *job,
-                      MsgChannel *client, int &out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid)
+static void run_job(const string &basedir, CompileJob *job,
+                    MsgChannel *client, int out_fd,
+                    unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                    const string &result_cache_dir, const string &header_cache_dir,
+                    size_t pch_cache_limit, size_t tmpfs_size)
 {
-    int socket[2];
-
-    if (pipe(socket) == -1) {
-        log_perror("pipe failed");
-        return -1;
-    }
-
-    flush_debug();
-    pid_t pid = fork();
-    assert(pid >= 0);
-
-    if (pid > 0) {  // parent
-        if ((-1 == close(socket[1])) && (errno != EBADF)){
-            log_perror("close failure");
-        }
-        out_fd = socket[0];
-        fcntl(out_fd, F_SETFD, FD_CLOEXEC);
-        return pid;
-    }
-
-    reset_debug();
-    if ((-1 == close(socket[0])) && (errno != EBADF)){
-        log_perror("close failed");
-    }
-    out_fd = socket[1];
-
     /* internal communication channel, don't inherit to gcc */
     fcntl(out_fd, F_SETFD, FD_CLOEXEC);
 
@@ -175,7 +160,30 @@ int handle_connection(const string &basedir, CompileJob *job,
 
     string tmp_path, obj_file, dwo_file;
     int exit_code = 0;
-    unsigned int job_stat[8];
+    ResultCache *cache = nullptr;
+
+    // The cache directory must be opened before chroot into the environment.
+    if (!result_cache_dir.empty() && job->compilerName().find("clang-tidy") == string::npos) {
+        int cache_fd = open(result_cache_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (cache_fd >= 0) {
+            cache = new ResultCache(cache_fd, *job);
+        } else {
+            log_perror("open result cache") << "\t" << result_cache_dir << endl;
+        }
+    }
+    // headers to preprocess the job with, or its precompiled header
+    bool receives_files = job->remotePreprocessing() || !job->precompiledHeader().empty();
+    int header_cache_fd = -1;
+
+    if (job->remotePreprocessing()) {
+        header_cache_fd = open(header_cache_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (header_cache_fd < 0) {
+            log_perror("open header cache") << "\t" << header_cache_dir << endl;
+        }
+    }
+    unsigned int job_stat[JobStatistics::field_count];
     memset(job_stat, 0, sizeof(job_stat));
 
     try {
@@ -189,7 +197,22 @@ int handle_connection(const string &basedir, CompileJob *job,
                 throw myexception(EXIT_COMPILER_MISSING);
             }
 
-            chdir_to_environment(client, dirname, user_uid, user_gid);
+            // Precompiled headers only work with the compiler that created them,
+            // so they are kept with the environment.
+            if (!job->precompiledHeader().empty()) {
+                string pch_dir = dirname + "/pch";
+
+                if (pch_cache_limit && init_result_cache(pch_dir, user_uid, user_gid)) {
+                    trim_header_cache(pch_dir, pch_cache_limit);
+                    header_cache_fd = open(pch_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                }
+
+                if (header_cache_fd < 0) {
+                    log_error() << "no cache for precompiled headers in " << dirname << endl;
+                }
+            }
+
+            chdir_to_environment(client, dirname, user_uid, user_gid, tmpfs_size);
         } else {
             error_client(client, "empty environment");
             log_error() << "Empty environment (" << job->targetPlatform() << ") " << job->jobID() << endl;
@@ -210,7 +233,8 @@ int handle_connection(const string &basedir, CompileJob *job,
         char prefix_output[32]; // 20 for 2^64 + 6 for "icecc-" + 1 for trailing NULL
         sprintf(prefix_output, "icecc-%u", job_id);
 
-        if (job->dwarfFissionEnabled() && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
+        if ((job->dwarfFissionEnabled() || receives_files)
+                && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
             tmp_path = tmp_output;
             free(tmp_output);
 
@@ -224,6 +248,11 @@ int handle_connection(const string &basedir, CompileJob *job,
             // the work_it() function will rewrite the tmp build directory as root, effectively
             // letting us set up a "chroot"ed environment inside the build folder and letting
             // us set up the paths to mimic the client system
+            //
+            // the same is done for jobs preprocessed here, the sources and headers
+            // are placed in the tmp directory at their paths on the client system,
+            // and for precompiled headers, which the preprocessed source names
+            // relative to the working directory
 
             string job_output_file = job->outputFile();
             string job_working_dir = job->workingDirectory();
@@ -261,15 +290,24 @@ int handle_connection(const string &basedir, CompileJob *job,
             obj_file = output_dir + '/' + file_name;
             dwo_file = obj_file.substr(0, obj_file.rfind('.')) + ".dwo";
 
-            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd);
+            if (receives_files
+                    && (header_cache_fd < 0
+                        || receive_headers(client, header_cache_fd, tmp_path, cache).empty())) {
+                error_client(client, "could not get the headers for the job");
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+
+            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd,
+                          cache);
         }
-        else if (!job->dwarfFissionEnabled() && (ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
+        else if (!job->dwarfFissionEnabled() && !receives_files
+                 && (ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
             obj_file = tmp_output;
             free(tmp_output);
             string build_path = obj_file.substr(0, obj_file.rfind('/'));
             string file_name = obj_file.substr(obj_file.rfind('/')+1);
 
-            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd);
+            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, cache);
         }
 
         if (ret) {
@@ -285,15 +323,23 @@ int handle_connection(const string &basedir, CompileJob *job,
             }
         }
 
-        struct stat st;
-        if (stat(obj_file.c_str(), &st) == 0) {
-            job_stat[JobStatistics::out_uncompressed] += st.st_size;
+        bool cached = cache && cache->object_fd() >= 0;
+
+        // Results from the cache are not counted as output, the scheduler would take
+        // the job for a really fast compile otherwise.
+        if (cached) {
+            rmsg.have_dwo_file = cache->dwo_fd() >= 0;
+        } else {
+            struct stat st;
+            if (stat(obj_file.c_str(), &st) == 0) {
+                job_stat[JobStatistics::out_uncompressed] += st.st_size;
+            }
+            if (stat(dwo_file.c_str(), &st) == 0) {
+                job_stat[JobStatistics::out_uncompressed] += st.st_size;
+                rmsg.have_dwo_file = true;
+            } else
+                rmsg.have_dwo_file = false;
         }
-        if (stat(dwo_file.c_str(), &st) == 0) {
-            job_stat[JobStatistics::out_uncompressed] += st.st_size;
-            rmsg.have_dwo_file = true;
-        } else
-            rmsg.have_dwo_file = false;
 
         if (!client->send_msg(rmsg)) {
             log_info() << "write of result failed" << endl;
@@ -307,11 +353,19 @@ int handle_connection(const string &basedir, CompileJob *job,
             log_perror("close failed");
         }
 
-        if (rmsg.status == 0) {
+        if (rmsg.status == 0 && cached) {
+            write_output_fd(cache->object_fd(), client);
+            if (rmsg.have_dwo_file) {
+                write_output_fd(cache->dwo_fd(), client);
+            }
+        } else if (rmsg.status == 0) {
             write_output_file(obj_file, client);
             if (rmsg.have_dwo_file) {
                 write_output_file(dwo_file, client);
             }
+            if (cache && !rmsg.was_out_of_memory) {
+                cache->store(obj_file, dwo_file, rmsg);
+            }
         }
 
         exit_code = rmsg.status;
@@ -332,6 +386,11 @@ int handle_connection(const string &basedir, CompileJob *job,
 
     delete client;
     client = nullptr;
+    delete cache;
+
+    if (header_cache_fd >= 0) {
+        close(header_cache_fd);
+    }
 
     if (!obj_file.empty()) {
         if (-1 == unlink(obj_file.c_str()) && errno != ENOENT){
@@ -351,3 +410,401 @@ int handle_connection(const string &basedir, CompileJob *job,
 
     _exit(exit_code);
 }
+
+/* The daemon can be large, with all its clients and environments, and forking it
+   for every job costs.  So a small process is forked from it at startup, which
+   forks the jobs instead.  The client connection and the pipe for the job
+   statistics are passed to it with the job.  The job processes end up as children
+   of the daemon, so that it can wait for them and gets their resource usage.  */
+
+// What is sent to the launcher for each job, followed by the strings and
+// a CompileFileMsg.  The client connection and the pipe come with it.
+struct LaunchRequest {
+    uint32_t protocol;
+    uint32_t mem_limit;
+    uint32_t user_uid;
+    uint32_t user_gid;
+    uint64_t pch_cache_limit;
+    uint64_t tmpfs_size;
+    // basedir, result cache dir, header cache dir, client name, unread input
+    uint32_t lengths[5];
+};
+
+static MsgChannel *launcher = nullptr;
+static pid_t launcher_pid = -1;
+
+static bool wait_for_fd(int fd, short events, int timeout)
+{
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+
+    for (;;) {
+        int ret = poll(&pfd, 1, timeout);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        return ret > 0;
+    }
+}
+
+static bool send_all(int fd, const void *buf, size_t len)
+{
+    const char *data = (const char *) buf;
+
+    while (len) {
+        ssize_t ret = write(fd, data, len);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN && wait_for_fd(fd, POLLOUT, 10 * 1000)) {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+// timeout in milliseconds, -1 for none
+static bool receive_all(int fd, void *buf, size_t len, int timeout)
+{
+    char *data = (char *) buf;
+
+    while (len) {
+        ssize_t ret = read(fd, data, len);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN && wait_for_fd(fd, POLLIN, timeout)) {
+                continue;
+            }
+
+            return false;
+        }
+
+        if (ret == 0) {
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+static bool send_request(int fd, const LaunchRequest &req, int client_fd, int out_fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = (void *) &req;
+    iov.iov_len = sizeof(req);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { client_fd, out_fd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    for (;;) {
+        ssize_t ret = sendmsg(fd, &msg, 0);
+
+        if (ret < 0) {
+            if (errno == EINTR || (errno == EAGAIN && wait_for_fd(fd, POLLOUT, 10 * 1000))) {
+                continue;
+            }
+
+            return false;
+        }
+
+        // The descriptors went with the first byte.
+        return send_all(fd, (const char *) &req + ret, sizeof(req) - ret);
+    }
+}
+
+static bool receive_request(int fd, LaunchRequest &req, int &client_fd, int &out_fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+
+    struct iovec iov;
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    for (;;) {
+        ssize_t ret = recvmsg(fd, &msg, 0);
+
+        if (ret < 0) {
+            if (errno == EINTR || (errno == EAGAIN && wait_for_fd(fd, POLLIN, -1))) {
+                continue;
+            }
+
+            return false;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        if (ret == 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS
+                || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+            return false;
+        }
+
+        int fds[2];
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        client_fd = fds[0];
+        out_fd = fds[1];
+        return receive_all(fd, (char *) &req + ret, sizeof(req) - ret, 10 * 1000);
+    }
+}
+
+static void run_launcher(int fd)
+{
+    MsgChannel *daemon = Service::createChannel(fd, nullptr, 0);
+
+    if (!daemon) {
+        _exit(1);
+    }
+
+    for (;;) {
+        LaunchRequest req;
+        int client_fd = -1;
+        int out_fd = -1;
+
+        // Nothing more to receive once the daemon is gone.
+        if (!receive_request(fd, req, client_fd, out_fd)) {
+            _exit(0);
+        }
+
+        string strings[5];
+
+        for (int i = 0; i < 5; ++i) {
+            strings[i].resize(req.lengths[i]);
+
+            if (!receive_all(fd, &strings[i][0], req.lengths[i], 10 * 1000)) {
+                _exit(1);
+            }
+        }
+
+        Msg *msg = daemon->get_msg();
+
+        if (!msg || *msg != Msg::COMPILE_FILE) {
+            log_error() << "compile launcher did not get a job" << endl;
+            _exit(1);
+        }
+
+        CompileJob *job = dynamic_cast<CompileFileMsg *>(msg)->takeJob();
+        delete msg;
+
+        flush_debug();
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            pid_t job_pid = fork();
+
+            if (job_pid == 0) {
+                reset_debug();
+                close(fd);
+                MsgChannel *client = Service::createChannel(client_fd, req.protocol, strings[4]);
+
+                if (!client) {
+                    _exit(EXIT_DISTCC_FAILED);
+                }
+
+                client->name = strings[3];
+                run_job(strings[0], job, client, out_fd, req.mem_limit, req.user_uid, req.user_gid,
+                        strings[1], strings[2], req.pch_cache_limit, req.tmpfs_size);
+            }
+
+            // Exiting right away leaves the job to the daemon.
+            ignore_result(send_all(fd, &job_pid, sizeof(job_pid)));
+            _exit(0);
+        }
+
+        if (pid < 0) {
+            log_perror("fork failed");
+            ignore_result(send_all(fd, &pid, sizeof(pid)));
+        } else {
+            while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+
+        close(client_fd);
+        close(out_fd);
+        delete job;
+    }
+}
+
+bool start_compile_launcher()
+{
+#if defined(HAVE_SYS_PRCTL_H) && defined(PR_SET_CHILD_SUBREAPER)
+    int sockets[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        log_perror("socketpair()");
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork failed");
+        close(sockets[0]);
+        close(sockets[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(sockets[0]);
+        run_launcher(sockets[1]);
+    }
+
+    close(sockets[1]);
+    launcher_pid = pid;
+    launcher = Service::createChannel(sockets[0], nullptr, 0);
+
+    // Orphaned jobs, whose parent in the launcher exited, are reparented to us.
+    if (!launcher || prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+        log_perror("starting compile launcher failed");
+        stop_compile_launcher();
+        return false;
+    }
+
+    trace() << "compile launcher PID " << launcher_pid << endl;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void stop_compile_launcher()
+{
+    delete launcher;
+    launcher = nullptr;
+
+    if (launcher_pid > 0) {
+        while (waitpid(launcher_pid, nullptr, 0) < 0 && errno == EINTR) {}
+        launcher_pid = -1;
+    }
+}
+
+static pid_t launch_job(const string &basedir, CompileJob *job,
+                        MsgChannel *client, int out_fd,
+                        unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                        const string &result_cache_dir, const string &header_cache_dir,
+                        size_t pch_cache_limit, size_t tmpfs_size)
+{
+    string strings[5] = { basedir, result_cache_dir, header_cache_dir, client->name,
+                          client->unread_input() };
+    LaunchRequest req;
+    req.protocol = client->protocol;
+    req.mem_limit = mem_limit;
+    req.user_uid = user_uid;
+    req.user_gid = user_gid;
+    req.pch_cache_limit = pch_cache_limit;
+    req.tmpfs_size = tmpfs_size;
+
+    for (int i = 0; i < 5; ++i) {
+        req.lengths[i] = strings[i].size();
+    }
+
+    bool ok = send_request(launcher->fd, req, client->fd, out_fd);
+
+    for (int i = 0; ok && i < 5; ++i) {
+        ok = send_all(launcher->fd, strings[i].data(), strings[i].size());
+    }
+
+    pid_t pid = -1;
+
+    if (!ok || !launcher->send_msg(CompileFileMsg(job))
+            || !receive_all(launcher->fd, &pid, sizeof(pid), 10 * 1000)) {
+        log_error() << "compile launcher failed, forking jobs from the daemon" << endl;
+        stop_compile_launcher();
+        return -1;
+    }
+
+    return pid;
+}
+
+/**
+ * Read a request, run the compiler, and send a response.
+ **/
+int handle_connection(const string &basedir, CompileJob *job,
+                      MsgChannel *client, int &out_fd,
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const string &result_cache_dir, const string &header_cache_dir,
+                      size_t pch_cache_limit, size_t tmpfs_size)
+{
+    int socket[2];
+
+    if (pipe(socket) == -1) {
+        log_perror("pipe failed");
+        return -1;
+    }
+
+    pid_t pid = -1;
+
+    if (launcher) {
+        pid = launch_job(basedir, job, client, socket[1], mem_limit, user_uid, user_gid,
+                         result_cache_dir, header_cache_dir, pch_cache_limit, tmpfs_size);
+    }
+
+    if (pid <= 0) {
+        flush_debug();
+        pid = fork();
+        assert(pid >= 0);
+    }
+
+    if (pid > 0) {  // parent
+        if ((-1 == close(socket[1])) && (errno != EBADF)){
+            log_perror("close failure");
+        }
+        out_fd = socket[0];
+        fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+        return pid;
+    }
+
+    reset_debug();
+    if ((-1 == close(socket[0])) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    run_job(basedir, job, client, socket[1], mem_limit, user_uid, user_gid,
+            result_cache_dir, header_cache_dir, pch_cache_limit, tmpfs_size);
+    return -1;
+}
@@ -31,8 +31,15 @@ class MsgChannel;
 
 extern int nice_level;
 
+// Jobs are forked from a small process started early, instead of from the
+// whole daemon, if possible.
+bool start_compile_launcher();
+void stop_compile_launcher();
+
 int handle_connection(const std::string &basedir, CompileJob *job,
                       MsgChannel *serv, int & out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid);
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const std::string &result_cache_dir, const std::string &header_cache_dir,
+                      size_t pch_cache_limit, size_t tmpfs_size);
 
 #endif
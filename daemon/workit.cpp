@@ -44,6 +44,8 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #if HAVE_SYS_USER_H && !defined(__DragonFly__)
 #  include <sys/user.h>
 #endif
@@ -63,10 +65,13 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <algorithm>
+#include <iterator>
 #include <string>
 
 #include "comm.h"
 #include "platform.h"
+#include "resultcache.h"
 #include "util.h"
 
 using namespace std;
@@ -97,9 +102,25 @@ error_client(MsgChannel *client, string error)
  * (in the error cases which exit quickly).
  */
 
+// The kernel's smoothed round trip time to the client, 0 if it can't tell.
+static unsigned int client_rtt_usec(int fd)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        return info.tcpi_rtt;
+    }
+#else
+    (void)fd;
+#endif
+    return 0;
+}
+
 int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileResultMsg &rmsg,
             const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-            unsigned long int mem_limit, int client_fd)
+            unsigned long int mem_limit, int client_fd, ResultCache *cache)
 {
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
@@ -260,7 +281,24 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 #endif
 #endif
 
+        // Absolute paths of the client are mapped into tmp_root, where the files were put,
+        // relative ones are relative to the working directory there.
+        std::list<string> cpp_flags = j.preprocessorFlags();
+
+        for (std::list<string>::iterator it = cpp_flags.begin(); it != cpp_flags.end(); ++it) {
+            if ((*it == "-I" || *it == "-iquote" || *it == "-isystem" || *it == "-include"
+                    || *it == "-imacros") && std::next(it) != cpp_flags.end()) {
+                ++it;
+                if ((*it)[0] == '/') {
+                    *it = tmp_root + *it;
+                }
+            } else if (it->compare(0, 19, "-fmacro-prefix-map=") == 0) {
+                it->insert(19, tmp_root);
+            }
+        }
+
         int argc = list.size();
+        argc += cpp_flags.size();
         argc++; // the program
         argc += 6; // -x c - -o file.o -fpreprocessed
         argc += 4; // gpc parameters
@@ -299,7 +337,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             }
         }
 
-        if( clang ) {
+        if( clang && !j.remotePreprocessing()) {
             // gcc seems to handle setting main file name and working directory fine
             // (it gets it from the preprocessed info), but clang needs help
             if( !j.inputFile().empty()) {
@@ -326,7 +364,34 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             argv[i++] = strdup(it->c_str());
         }
 
-        if(!clang_tidy) {
+        for (std::list<string>::const_iterator it = cpp_flags.begin();
+                it != cpp_flags.end(); ++it) {
+            argv[i++] = strdup(it->c_str());
+        }
+
+        if (j.remotePreprocessing()) {
+            // relative paths are relative to the working directory in tmp_root
+            if (j.inputFile()[0] == '/') {
+                argv[i++] = strdup((tmp_root + j.inputFile()).c_str());
+            } else {
+                argv[i++] = strdup(j.inputFile().c_str());
+            }
+            argv[i++] = strdup("-o");
+            argv[i++] = strdup(file_name.c_str());
+            sprintf(buffer, "-fdebug-prefix-map=%s/=/", tmp_root.c_str());
+            argv[i++] = strdup(buffer);
+
+            if (!clang) {
+                argv[i++] = strdup("--param");
+                sprintf(buffer, "ggc-min-expand=%d", ggc_min_expand_heuristic(mem_limit));
+                argv[i++] = strdup(buffer);
+                argv[i++] = strdup("--param");
+                sprintf(buffer, "ggc-min-heapsize=%d", ggc_min_heapsize_heuristic(mem_limit));
+                argv[i++] = strdup(buffer);
+            } else {
+                argv[i++] = strdup("-no-canonical-prefixes");    // otherwise clang tries to access /proc/self/exe
+            }
+        } else if(!clang_tidy) {
             if (!clang) {
                 argv[i++] = strdup("-fpreprocessed");
             }
@@ -347,7 +412,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             if (clang) {
                 argv[i++] = strdup("-no-canonical-prefixes");    // otherwise clang tries to access /proc/self/exe
             }
-            if (!clang && j.dwarfFissionEnabled()) {
+            if (!clang && (j.dwarfFissionEnabled() || !j.precompiledHeader().empty())) {
                 sprintf(buffer, "-fdebug-prefix-map=%s/=/", tmp_root.c_str());
                 argv[i++] = strdup(buffer);
             }
@@ -528,10 +593,16 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 
     struct timeval starttv;
     gettimeofday(&starttv, nullptr);
+    // When the first input arrived, for telling the scheduler how fast the link is.
+    struct timeval inputtv;
+    timerclear(&inputtv);
 
     int return_value = 0;
     // Got EOF for preprocessed input. stdout send may be still pending.
     bool input_complete = false;
+    // The result is in the cache, the compiler has been killed.
+    bool cached = false;
+    CompileResultMsg cached_rmsg;
     bool has_received_file = false;
     // Pending data to send to stdin
     FileChunkMsg *fcmsg = nullptr;
@@ -564,6 +635,16 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                             continue;
                         } else {
                             input_complete = true;
+
+                            if (timerisset(&inputtv) && j.inputReady()) {
+                                struct timeval endtv;
+                                gettimeofday(&endtv, nullptr);
+                                // At least 1, 0 says it was not timed.
+                                job_stat[JobStatistics::in_msec] = max(((endtv.tv_sec - inputtv.tv_sec) * 1000)
+                                                                       + ((long(endtv.tv_usec) - long(inputtv.tv_usec)) / 1000), 1L);
+                                job_stat[JobStatistics::rtt_usec] = client_rtt_usec(client_fd);
+                            }
+
                             if (!fcmsg && ct_sock[1] != -1) {
                                 if (-1 == close(ct_sock[1])){
                                     log_perror("close failed");
@@ -579,6 +660,12 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                                 sock_in[1] = -1;
                             }
                             delete msg;
+
+                            if (cache && cache->lookup(cached_rmsg)) {
+                                trace() << "result " << cache->key() << " found in the result cache" << endl;
+                                cached = true;
+                                kill(pid, SIGTERM);
+                            }
                         }
                         
                         delete fcmsg;
@@ -587,8 +674,16 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                         fcmsg = static_cast<FileChunkMsg*>(msg);
                         off = 0;
 
+                        if (!timerisset(&inputtv)) {
+                            gettimeofday(&inputtv, nullptr);
+                        }
+
                         job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
                         job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
+
+                        if (cache) {
+                            cache->add_input(fcmsg->buffer, fcmsg->len);
+                        }
                     } else {
                         log_error() << "protocol error while reading preprocessed file" << endl;
                         input_complete = true;
@@ -815,6 +910,16 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return EXIT_DISTCC_FAILED;
                 }
 
+                if (cached) {
+                    // Drop anything the killed compiler has written, and don't
+                    // let its times into the stats.
+                    rmsg.status = cached_rmsg.status;
+                    rmsg.out = cached_rmsg.out;
+                    rmsg.err = cached_rmsg.err;
+                    job_stat[JobStatistics::exit_code] = 0;
+                    return 0;
+                }
+
                 if(clang_tidy) {
                     rmpath(compilation_path.c_str());
                 }
@@ -32,6 +32,7 @@
 
 class MsgChannel;
 class CompileResultMsg;
+class ResultCache;
 
 // No icecream ;(
 class myexception : public std::exception
@@ -47,12 +48,13 @@ public:
 namespace JobStatistics
 {
 enum job_stat_fields { in_compressed, in_uncompressed, out_uncompressed, exit_code,
-                       real_msec, user_msec, sys_msec, sys_pfaults
+                       real_msec, user_msec, sys_msec, sys_pfaults, in_msec, rtt_usec,
+                       field_count
                      };
 }
 
 extern int work_it(CompileJob &j, unsigned int job_stats[], MsgChannel *client, CompileResultMsg &msg,
                    const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-                   unsigned long int mem_limit, int client_fd);
+                   unsigned long int mem_limit, int client_fd, ResultCache *cache = nullptr);
 
 #endif
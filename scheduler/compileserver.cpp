@@ -47,6 +47,7 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_hostPlatform()
     , m_load(1000)
     , m_maxJobs(0)
+    , m_maxLinkJobs(0)
     , m_noRemote(false)
     , m_jobList()
     , m_state(CONNECTED)
@@ -198,8 +199,10 @@ bool CompileServer::is_eligible_now(const Job *job) const
     int jobs_now = local_jobs_now + currentJobCountRemote();
     bool jobs_okay = jobs_now < m_maxJobs;
     // allow a job for preloading, but only if the node isn't fully
-    // busy with local jobs (that may possibly take long)
-    if( m_maxJobs > 0 && jobs_now < m_maxJobs + maxPreloadCount() && local_jobs_now < m_maxJobs)
+    // busy with local jobs (that may possibly take long), or linking
+    // in its separate local job slots
+    if( m_maxJobs > 0 && jobs_now < m_maxJobs + maxPreloadCount() && local_jobs_now < m_maxJobs
+        && currentLinkJobCount() == 0)
         jobs_okay = true;
     bool load_okay = m_load < 1000;
     bool eligible = jobs_okay
@@ -295,12 +298,32 @@ int CompileServer::currentJobCountRemote() const
 
 int CompileServer::currentJobCountLocal() const
 {
+    // Only full jobs take compile slots if the node has separate local job slots.
     int count = 0;
     for( const std::pair<const int, CompileServer::LocalJobInfo>& info : m_clientLocalMap )
-        count += info.second.fulljob ? m_maxJobs : 1;
+        count += info.second.fulljob ? m_maxJobs : ( m_maxLinkJobs > 0 ? 0 : 1 );
     return count;
 }
 
+int CompileServer::maxLinkJobs() const
+{
+    return m_maxLinkJobs;
+}
+
+void CompileServer::setMaxLinkJobs(int jobs)
+{
+    m_maxLinkJobs = jobs;
+}
+
+int CompileServer::currentLinkJobCount() const
+{
+    if (m_maxLinkJobs <= 0) {
+        return 0;
+    }
+
+    return m_clientLocalMap.size();
+}
+
 int CompileServer::currentJobCount() const
 {
     return currentJobCountRemote() + currentJobCountLocal();
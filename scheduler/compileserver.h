@@ -48,7 +48,8 @@ public:
         UNKNOWN,
         DAEMON,
         MONITOR,
-        LINE
+        LINE,
+        REGION // a scheduler below us
     };
 
     CompileServer(const int fd, struct sockaddr *_addr, const socklen_t _len, const bool text_based);
@@ -87,6 +88,9 @@ public:
     int currentJobCount() const;
     int currentJobCountRemote() const;
     int currentJobCountLocal() const;
+    int maxLinkJobs() const;
+    void setMaxLinkJobs(const int jobs);
+    int currentLinkJobCount() const;
 
     bool noRemote() const;
     void setNoRemote(const bool value);
@@ -165,6 +169,7 @@ private:
     // LOAD is load * 1000
     unsigned int m_load;
     int m_maxJobs;
+    int m_maxLinkJobs; // 0 if local jobs take compile slots
     bool m_noRemote;
     list<Job *> m_jobList;
     State m_state;
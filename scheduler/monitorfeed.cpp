@@ -0,0 +1,264 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "monitorfeed.h"
+#include "../services/logging.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+// SIGPIPE is blocked in the thread.
+#define MSG_NOSIGNAL 0
+#endif
+
+// A monitor that has this much waiting to be sent can't keep up and gets closed.
+#define MAX_MONITOR_BACKLOG (1024 * 1024)
+
+using namespace std;
+
+MonitorFeed::MonitorFeed()
+{
+}
+
+MonitorFeed::~MonitorFeed()
+{
+    stop();
+}
+
+void MonitorFeed::start()
+{
+    // Signals are for the main loop, so the thread starts with them blocked.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    thread = std::thread(&MonitorFeed::run, this);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+void MonitorFeed::stop()
+{
+    if (thread.joinable()) {
+        queue_item(Item::STOP, -1);
+        thread.join();
+    }
+
+    for (map<int, MsgChannel *>::iterator it = monitors.begin(); it != monitors.end(); ++it) {
+        delete it->second;
+    }
+
+    monitors.clear();
+    closing.clear();
+    released.clear();
+}
+
+void MonitorFeed::add(MsgChannel *monitor)
+{
+    // From now on only the thread writes to it.
+    monitor->flush();
+    monitors[monitor->fd] = monitor;
+    queue_item(Item::ADD, monitor->fd);
+}
+
+void MonitorFeed::send(Msg *msg, MsgChannel *only)
+{
+    // Monitors with the same protocol get the same bytes.
+    map<pair<int, bool>, shared_ptr<const string> > serialized;
+
+    for (map<int, MsgChannel *>::iterator it = monitors.begin(); it != monitors.end();) {
+        MsgChannel *monitor = it->second;
+        ++it;
+
+        if ((only && monitor != only) || closing.count(monitor->fd)) {
+            continue;
+        }
+
+        shared_ptr<const string> &data = serialized[make_pair(monitor->protocol, monitor->is_text_based())];
+
+        if (!data) {
+            string bytes;
+
+            if (!monitor->serialize_msg(*msg, bytes)) {
+                remove(monitor->fd);
+                continue;
+            }
+
+            data = make_shared<const string>(bytes);
+        }
+
+        queue_item(Item::DATA, monitor->fd, data);
+    }
+
+    delete msg;
+}
+
+void MonitorFeed::clear()
+{
+    for (map<int, MsgChannel *>::iterator it = monitors.begin(); it != monitors.end(); ++it) {
+        if (!closing.count(it->first)) {
+            remove(it->first);
+        }
+    }
+}
+
+void MonitorFeed::reap()
+{
+    vector<int> fds;
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        fds.swap(released);
+    }
+
+    // The thread is done with these fds, so they may be closed and reused now.
+    for (vector<int>::const_iterator fd = fds.begin(); fd != fds.end(); ++fd) {
+        map<int, MsgChannel *>::iterator it = monitors.find(*fd);
+
+        if (it != monitors.end()) {
+            trace() << "monitor " << it->second->name << " is gone or blocking, removing" << endl;
+            delete it->second;
+            monitors.erase(it);
+        }
+
+        closing.erase(*fd);
+    }
+}
+
+void MonitorFeed::remove(int fd)
+{
+    closing.insert(fd);
+    queue_item(Item::REMOVE, fd);
+}
+
+void MonitorFeed::queue_item(Item::What what, int fd, const shared_ptr<const string> &data)
+{
+    Item item;
+    item.what = what;
+    item.fd = fd;
+    item.data = data;
+
+    lock_guard<std::mutex> lock(mutex);
+    items.push_back(item);
+    wakeup.notify_one();
+}
+
+void MonitorFeed::release(int fd)
+{
+    lock_guard<std::mutex> lock(mutex);
+    released.push_back(fd);
+}
+
+// Writes what the socket takes without blocking, false if the monitor is to be closed.
+bool MonitorFeed::write_backlog(int fd, Backlog &backlog)
+{
+    while (!backlog.data.empty()) {
+        const string &data = *backlog.data.front();
+        ssize_t ret = ::send(fd, data.data() + backlog.offset, data.size() - backlog.offset,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        if (ret <= 0) {
+            return false;
+        }
+
+        backlog.offset += ret;
+        backlog.size -= ret;
+
+        if (backlog.offset == data.size()) {
+            backlog.data.pop_front();
+            backlog.offset = 0;
+        }
+    }
+
+    return backlog.size <= MAX_MONITOR_BACKLOG;
+}
+
+void MonitorFeed::run()
+{
+    map<int, Backlog> backlogs;
+    deque<Item> batch;
+    bool stopping = false;
+
+    while (!stopping) {
+        {
+            unique_lock<std::mutex> lock(mutex);
+            bool pending = false;
+
+            for (map<int, Backlog>::const_iterator it = backlogs.begin(); it != backlogs.end(); ++it) {
+                pending = pending || it->second.size;
+            }
+
+            // What a socket didn't take is retried a bit later.
+            if (pending) {
+                wakeup.wait_for(lock, chrono::milliseconds(100), [this] { return !items.empty(); });
+            } else {
+                wakeup.wait(lock, [this] { return !items.empty(); });
+            }
+
+            batch.swap(items);
+        }
+
+        for (const Item &item : batch) {
+            switch (item.what) {
+            case Item::ADD:
+                backlogs[item.fd] = Backlog();
+                break;
+            case Item::DATA: {
+                // Data for a monitor given up on already is dropped.
+                map<int, Backlog>::iterator it = backlogs.find(item.fd);
+
+                if (it != backlogs.end()) {
+                    it->second.data.push_back(item.data);
+                    it->second.size += item.data->size();
+                }
+
+                break;
+            }
+            case Item::REMOVE:
+                if (backlogs.erase(item.fd)) {
+                    release(item.fd);
+                }
+                break;
+            case Item::STOP:
+                stopping = true;
+                break;
+            }
+        }
+
+        batch.clear();
+
+        for (map<int, Backlog>::iterator it = backlogs.begin(); it != backlogs.end();) {
+            map<int, Backlog>::iterator cur = it++;
+
+            if (!write_backlog(cur->first, cur->second)) {
+                release(cur->first);
+                backlogs.erase(cur);
+            }
+        }
+    }
+}
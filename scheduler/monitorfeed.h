@@ -0,0 +1,107 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MONITORFEED_H
+#define MONITORFEED_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../services/comm.h"
+
+/* Sends the messages for the monitors from a thread of its own, so that many or slow
+   monitors don't delay scheduling. The channels stay with the main thread, which
+   serializes the messages; the thread only writes the bytes to the sockets. It neither
+   logs nor touches MsgChannel, neither of which is thread-safe.  */
+class MonitorFeed
+{
+public:
+    MonitorFeed();
+    ~MonitorFeed();
+
+    void start();
+    // Closes all monitors and waits for the thread.
+    void stop();
+
+    // Takes over the channel of a monitor that has logged in.
+    void add(MsgChannel *monitor);
+    // Sends a message to all monitors, or only to the given one, and deletes it.
+    void send(Msg *msg, MsgChannel *only = nullptr);
+    // Closes all monitors.
+    void clear();
+    // Closes the monitors the thread has given up on, because they broke or couldn't keep up.
+    void reap();
+
+    bool empty() const
+    {
+        return monitors.size() == closing.size();
+    }
+
+private:
+    struct Item {
+        enum What {
+            ADD,
+            DATA,
+            REMOVE,
+            STOP
+        };
+        What what;
+        int fd;
+        std::shared_ptr<const std::string> data;
+    };
+
+    // What is still to be written to one monitor, used by the thread only.
+    struct Backlog {
+        Backlog()
+            : offset(0)
+            , size(0)
+        {}
+        std::deque<std::shared_ptr<const std::string> > data;
+        size_t offset; // of what has been written of the first one
+        size_t size;
+    };
+
+    void remove(int fd);
+    void queue_item(Item::What what, int fd, const std::shared_ptr<const std::string> &data = nullptr);
+    void run();
+    void release(int fd);
+    bool write_backlog(int fd, Backlog &backlog);
+
+    // Used by the main thread only, monitors by their fd.
+    std::map<int, MsgChannel *> monitors;
+    // Removed monitors whose fds the thread may still use.
+    std::set<int> closing;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<Item> items;
+    // The fds the thread doesn't use anymore, for reap().
+    std::vector<int> released;
+    std::thread thread;
+};
+
+#endif
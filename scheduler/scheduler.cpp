@@ -59,6 +59,7 @@
 
 #include "compileserver.h"
 #include "job.h"
+#include "monitorfeed.h"
 #include "scheduler.h"
 
 /* TODO:
@@ -105,7 +106,7 @@ static unsigned int scheduler_port = 8765;
 
 // A subset of connected_hosts representing the compiler servers
 static list<CompileServer *> css;
-static list<CompileServer *> monitors;
+static MonitorFeed monitor_feed;
 static list<CompileServer *> controls;
 static list<string> block_css;
 static unsigned int new_job_id;
@@ -130,6 +131,62 @@ static list<JobRequestsGroup *> job_requests;
 static list<JobStat> all_job_stats;
 static JobStat cum_job_stats;
 
+/* What completed jobs have shown about the network between a submitter and a server,
+   keyed by their addresses and smoothed over the recent jobs.  */
+struct LinkStat {
+    float bytes = 0; // compressed input of a job
+    float msec = 0; // time it took to receive that
+    float rtt_msec = 0;
+};
+static map<pair<string, string>, LinkStat> link_stats;
+// The smoothed compressed input and output sizes of the jobs of each submitter.
+static map<string, pair<float, float>> transfer_sizes;
+
+// How many daemons should have a popular environment installed in advance (0 = no prefetching).
+static unsigned int env_replicas = 0;
+// An environment is popular if it has been requested at least this many times recently.
+#define ENV_PREFETCH_REQUESTS 8
+// How often the requests are counted again, and prefetching is considered.
+#define ENV_PREFETCH_INTERVAL 10
+
+struct EnvUsage {
+    string host_platform;
+    // Number of recent job requests, halved every ENV_PREFETCH_INTERVAL.
+    unsigned int requests;
+    // Host ids of daemons told to prefetch the environment, with the time.
+    map<unsigned int, time_t> prefetching;
+    EnvUsage() : requests(0) {}
+};
+// Keyed by (target platform, environment name).
+static map<pair<string, string>, EnvUsage> env_usage;
+static time_t last_env_prefetch;
+
+// The host id of the last CS with a result cache that compiled a file, keyed by
+// result_affinity_key(). Sending the file there again may hit the cache.
+static map<string, unsigned int> result_affinity;
+#define MAX_RESULT_AFFINITY 100000
+
+// Set for a regional scheduler, which reports its capacity to the scheduler above it.
+static string upstream_host;
+static unsigned int upstream_port = 8765;
+static MsgChannel *upstream_channel = nullptr;
+// The socket while connecting to the scheduler above us.
+static int upstream_connect_fd = -1;
+// When to try reaching the scheduler above us again, and how long to wait after that.
+static time_t upstream_retry;
+static unsigned int upstream_backoff;
+static time_t last_region_stats;
+// Jobs its submitter had to take since the last report, because no other host was free.
+static unsigned int region_fallbacks;
+// How often regions report to the scheduler above them.
+#define REGION_STATS_INTERVAL 5
+// The longest wait between attempts to reach the scheduler above us.
+#define MAX_UPSTREAM_BACKOFF 300
+// How long daemons lent to another region serve it.
+#define REGION_LEASE 60
+// The regions reporting to us, with their last stats.
+static map<CompileServer *, RegionStatsMsg> regions;
+
 static float server_speed(CompileServer *cs, Job *job = nullptr, bool blockDebug = false);
 
 /* Searches the queue for JOB and removes it.
@@ -232,24 +289,127 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 #endif
 }
 
+static void smooth(float &value, float sample)
+{
+    value = value == 0 ? sample : 0.8 * value + 0.2 * sample;
+}
+
+static void add_link_stats(Job *job, JobDoneMsg *msg)
+{
+    CompileServer *submitter = job->submitter();
+    CompileServer *server = job->server();
+
+    // Small inputs say more about latency than about bandwidth, and jobs built
+    // by the submitter itself don't cross the network.
+    if (msg->exitcode != 0 || !msg->is_from_server() || !submitter || !server
+            || submitter == server || !IS_PROTOCOL_VERSION(55, server)
+            || msg->in_compressed < 4096 || msg->in_uncompressed == 0) {
+        return;
+    }
+
+    // The server doesn't know how well the result compresses, assume like the input.
+    pair<float, float> &size = transfer_sizes[submitter->name];
+    smooth(size.first, msg->in_compressed);
+    smooth(size.second, float(msg->out_uncompressed) * msg->in_compressed / msg->in_uncompressed);
+
+    // Input streamed from the client's preprocessor is not timed, it would make
+    // the link look as slow as the preprocessor next to the submitter, which sends nothing.
+    if (!IS_PROTOCOL_VERSION(56, server) || msg->in_msec == 0) {
+        return;
+    }
+
+    LinkStat &link = link_stats[make_pair(submitter->name, server->name)];
+    smooth(link.bytes, msg->in_compressed);
+    smooth(link.msec, msg->in_msec);
+    smooth(link.rtt_msec, msg->rtt_usec / 1000.0);
+
+#if DEBUG_SCHEDULER > 1
+    trace() << "link " << submitter->nodeName() << " -> " << server->nodeName() << ": "
+            << link.bytes / link.msec << " bytes/ms, rtt " << link.rtt_msec << " ms" << endl;
+#endif
+}
+
+// Forgets what was learned about the links of a daemon that has left.
+static void remove_link_stats(CompileServer *cs)
+{
+    // Daemons on the same host share its stats.
+    for (CompileServer * const other : css) {
+        if (other != cs && other->type() == CompileServer::DAEMON && other->name == cs->name) {
+            return;
+        }
+    }
+
+    transfer_sizes.erase(cs->name);
+
+    for (map<pair<string, string>, LinkStat>::iterator it = link_stats.begin(); it != link_stats.end();) {
+        if (it->first.first == cs->name || it->first.second == cs->name) {
+            link_stats.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// The expected time to send JOB to CS and its result back, 0 while not known.
+static float transfer_msec(CompileServer *cs, Job *job)
+{
+    CompileServer *submitter = job->submitter();
+
+    if (!submitter || cs == submitter) {
+        return 0;
+    }
+
+    map<pair<string, string>, LinkStat>::const_iterator link
+        = link_stats.find(make_pair(submitter->name, cs->name));
+    map<string, pair<float, float>>::const_iterator size = transfer_sizes.find(submitter->name);
+
+    if (link == link_stats.end() || size == transfer_sizes.end()) {
+        return 0;
+    }
+
+    // Connecting and waiting for the result take a round trip each.
+    return 2 * link->second.rtt_msec
+           + (size->second.first + size->second.second) * link->second.msec / link->second.bytes;
+}
+
+/* The projected time until JOB is done on CS: compiling an average job at the speed
+   of CS, plus the transfers over the link between CS and the submitter.  */
+static float projected_msec(CompileServer *cs, Job *job)
+{
+    float speed = server_speed(cs, job);
+
+    if (speed <= 0 || all_job_stats.empty()) {
+        return numeric_limits<float>::max();
+    }
+
+    return cum_job_stats.outputSize() / float(all_job_stats.size()) / speed + transfer_msec(cs, job);
+}
+
 static bool handle_end(CompileServer *cs, Msg *);
 
+// The message is serialized here, a thread of its own sends it to the monitors.
 static void notify_monitors(Msg *m)
 {
-    list<CompileServer *>::iterator it;
-    list<CompileServer *>::iterator it_old;
+    if (monitor_feed.empty()) {
+        delete m;
+        return;
+    }
 
-    for (it = monitors.begin(); it != monitors.end();) {
-        it_old = it++;
+    monitor_feed.send(m);
+}
+
+/* Channels are corked, so what was sent to them while handling events gets sent
+   here once per main loop iteration, with one send() per channel.  */
+static void flush_channels()
+{
+    for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end();) {
+        CompileServer *cs = it->second;
+        ++it;
 
-        /* If we can't send it, don't be clever, simply close this monitor.  */
-        if (!(*it_old)->send_msg(*m, MsgChannel::SendNonBlocking /*| MsgChannel::SendBulkOnly*/)) {
-            trace() << "monitor is blocking... removing" << endl;
-            handle_end(*it_old, nullptr);
+        if (!cs->flush()) {
+            handle_end(cs, nullptr);
         }
     }
-
-    delete m;
 }
 
 static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
@@ -328,9 +488,10 @@ static float server_speed(CompileServer *cs, Job *job, bool blockDebug)
     }
 }
 
-static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = nullptr)
+// Sends the stats of CS to all monitors, or only to MONITOR.
+static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = nullptr, MsgChannel *monitor = nullptr)
 {
-    if (monitors.empty()) {
+    if (monitor_feed.empty()) {
         return;
     }
 
@@ -342,6 +503,8 @@ static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = nullptr)
     msg += buffer;
     sprintf(buffer, "MaxJobs:%d\n", cs->maxJobs());
     msg += buffer;
+    sprintf(buffer, "MaxLinkJobs:%d\n", cs->maxLinkJobs());
+    msg += buffer;
     sprintf(buffer, "NoRemote:%s\n", cs->noRemote() ? "true" : "false");
     msg += buffer;
     sprintf(buffer, "Platform:%s\n", cs->hostPlatform().c_str());
@@ -369,7 +532,11 @@ static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = nullptr)
         msg += buffer;
     }
 
-    notify_monitors(new MonStatsMsg(cs->hostId(), msg));
+    if (monitor) {
+        monitor_feed.send(new MonStatsMsg(cs->hostId(), msg), monitor);
+    } else {
+        notify_monitors(new MonStatsMsg(cs->hostId(), msg));
+    }
 }
 
 static Job *create_new_job(CompileServer *submitter)
@@ -531,6 +698,14 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         job->setRequiredFeatures(m->required_features);
         job->setNiceness(max(0, min(20,int(m->niceness))));
         enqueue_job_request(job);
+
+        if (env_replicas > 0) {
+            for (const pair<string, string> &env : job->environments()) {
+                EnvUsage &usage = env_usage[make_pair(job->targetPlatform(), env.second)];
+                usage.host_platform = env.first;
+                usage.requests++;
+            }
+        }
         std::ostream &dbg = log_info();
         dbg << "NEW " << job->id() << " client="
             << submitter->nodeName() << " versions=[";
@@ -589,6 +764,58 @@ static bool handle_local_job_done(CompileServer *cs, Msg *_m)
     return true;
 }
 
+/* Returns the least loaded CS other than EXCEPT1 and EXCEPT2 that has
+   ENVIRONMENT installed and can send it to other daemons, or nullptr.  */
+static CompileServer *find_env_holder(const pair<string, string> &environment,
+                                      const CompileServer *except1, const CompileServer *except2)
+{
+    CompileServer *best = nullptr;
+
+    for (CompileServer * const peer : css) {
+        if (peer == except1 || peer == except2 || peer->noRemote()
+                || peer->maximum_remote_protocol < 46) {
+            continue;
+        }
+
+        Environments compilerVersions = peer->compilerVersions();
+
+        if (find(compilerVersions.begin(), compilerVersions.end(), environment) == compilerVersions.end()) {
+            continue;
+        }
+
+        if (!best || peer->load() < best->load()) {
+            best = peer;
+        }
+    }
+
+    return best;
+}
+
+/* Returns a CS other than the submitter that has the environment the job
+   will use on host_platform installed and can send it to CS, or nullptr.  */
+static CompileServer *pick_env_peer(const CompileServer *cs, const Job *job, const string &host_platform)
+{
+    if (cs->maximum_remote_protocol < 46) {
+        return nullptr;
+    }
+
+    string version;
+    Environments environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        if (it->first == host_platform) {
+            version = it->second;
+            break;
+        }
+    }
+
+    if (version.empty()) {
+        return nullptr;
+    }
+
+    return find_env_holder(make_pair(job->targetPlatform(), version), cs, job->submitter());
+}
+
 /* Given a candidate CS and a JOB, check all installed environments
    on the CS for a match.  Return an empty string if none of the required
    environments for this job is installed.  Otherwise return the
@@ -626,6 +853,278 @@ static string envs_match(CompileServer *cs, const Job *job)
     return string();
 }
 
+/* Tells idle daemons to get popular environments from daemons that already
+   have them, until ENV_REPLICAS daemons have each of them (or are getting it).
+   This way jobs do not have to wait for the environment being installed.  */
+static void prefetch_environments()
+{
+    time_t now = time(nullptr);
+
+    for (map<pair<string, string>, EnvUsage>::iterator it = env_usage.begin(); it != env_usage.end();) {
+        const pair<string, string> &environment = it->first;
+        EnvUsage &usage = it->second;
+
+        for (map<unsigned int, time_t>::iterator p = usage.prefetching.begin(); p != usage.prefetching.end();) {
+            if (now - p->second > MAX_BUSY_INSTALLING) {
+                usage.prefetching.erase(p++);
+            } else {
+                ++p;
+            }
+        }
+
+        if (usage.requests >= ENV_PREFETCH_REQUESTS) {
+            unsigned int replicas = 0;
+            list<CompileServer *> candidates;
+
+            for (CompileServer * const cs : css) {
+                Environments compilerVersions = cs->compilerVersions();
+
+                if (find(compilerVersions.begin(), compilerVersions.end(), environment) != compilerVersions.end()) {
+                    usage.prefetching.erase(cs->hostId());
+                    replicas++;
+                } else if (usage.prefetching.count(cs->hostId())) {
+                    replicas++;
+                } else if (cs->maximum_remote_protocol >= 47 && cs->maxJobs() > 0 && !cs->noRemote()
+                           && cs->chrootPossible() && !cs->busyInstalling() && cs->jobList().empty()
+                           && cs->platforms_compatible(usage.host_platform)) {
+                    candidates.push_back(cs);
+                }
+            }
+
+            CompileServer *holder = replicas < env_replicas ? find_env_holder(environment, nullptr, nullptr) : nullptr;
+
+            if (holder) {
+                candidates.sort([](CompileServer *a, CompileServer *b) { return a->load() < b->load(); });
+
+                for (list<CompileServer *>::const_iterator c = candidates.begin();
+                        c != candidates.end() && replicas < env_replicas; ++c) {
+                    if (*c == holder) {
+                        continue;
+                    }
+
+                    trace() << "prefetch " << environment.first << "/" << environment.second << " to "
+                            << (*c)->nodeName() << " from " << holder->nodeName() << endl;
+
+                    if ((*c)->send_msg(EnvFetchMsg(environment.first, environment.second,
+                                                   holder->name, holder->remotePort()))) {
+                        usage.prefetching[(*c)->hostId()] = now;
+                        replicas++;
+                    }
+                }
+            }
+        }
+
+        usage.requests /= 2;
+
+        if (usage.requests == 0 && usage.prefetching.empty()) {
+            env_usage.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// A daemon that could serve another region for a while.
+static bool can_lend(CompileServer *cs)
+{
+    return IS_PROTOCOL_VERSION(54, cs) && cs->maxJobs() > 0 && !cs->noRemote()
+           && cs->jobList().empty() && cs->submittedJobsCount() == 0 && !cs->busyInstalling();
+}
+
+// Waits twice as long as the last time before trying the scheduler above us again.
+static void upstream_unreachable()
+{
+    if (upstream_connect_fd >= 0) {
+        close(upstream_connect_fd);
+        upstream_connect_fd = -1;
+    }
+
+    delete upstream_channel;
+    upstream_channel = nullptr;
+    upstream_backoff = min(max(2 * upstream_backoff, (unsigned int)REGION_STATS_INTERVAL),
+                           (unsigned int)MAX_UPSTREAM_BACKOFF);
+    upstream_retry = time(nullptr) + upstream_backoff;
+    trace() << "cannot reach upstream scheduler " << upstream_host << ":" << upstream_port
+            << ", trying again in " << upstream_backoff << " seconds" << endl;
+}
+
+// The main loop calls this when connecting to the scheduler above us is done.
+static void finish_upstream_connect()
+{
+    upstream_channel = Service::finishConnect(upstream_connect_fd);
+    upstream_connect_fd = -1;
+
+    if (!upstream_channel) {
+        upstream_unreachable();
+        return;
+    }
+
+    log_info() << "reporting to upstream scheduler " << upstream_host << ":" << upstream_port << endl;
+}
+
+static void send_region_stats(const char *netname)
+{
+    // Connecting does not block, and the scheduler above us gets until the next
+    // report to answer.
+    if (upstream_connect_fd >= 0 || (upstream_channel && upstream_channel->protocol <= 0)) {
+        upstream_unreachable();
+        return;
+    }
+
+    if (!upstream_channel) {
+        if (upstream_retry <= time(nullptr)) {
+            upstream_connect_fd = Service::startConnect(upstream_host, upstream_port);
+
+            if (upstream_connect_fd < 0) {
+                upstream_unreachable();
+            }
+        }
+
+        return;
+    }
+
+    upstream_backoff = 0;
+    RegionStatsMsg msg;
+    msg.netname = netname;
+    msg.port = scheduler_port;
+
+    for (CompileServer * const cs : css) {
+        msg.hosts++;
+
+        if (can_lend(cs)) {
+            msg.idle_hosts++;
+        }
+
+        if (!cs->noRemote() && cs->maxJobs() > int(cs->jobList().size())) {
+            msg.free_slots += cs->maxJobs() - cs->jobList().size();
+        }
+    }
+
+    msg.queued_jobs = region_fallbacks;
+    region_fallbacks = 0;
+
+    for (JobRequestsGroup * const group : job_requests) {
+        msg.queued_jobs += group->l.size();
+    }
+
+    if (!upstream_channel->send_msg(msg)) {
+        delete upstream_channel;
+        upstream_channel = nullptr;
+    }
+}
+
+// The scheduler above us wants idle daemons to serve another region.
+static void handle_lend_cs(LendCSMsg *m)
+{
+    unsigned int lent = 0;
+
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end() && lent < m->count;) {
+        CompileServer *cs = *it;
+        ++it;
+
+        if (!can_lend(cs)) {
+            continue;
+        }
+
+        // The daemon reconnects on its own, this just stops using it.
+        if (cs->send_msg(*m) && cs->flush()) {
+            ++lent;
+        }
+
+        handle_end(cs, nullptr);
+    }
+
+    log_info() << "lent " << lent << " daemons to " << m->hostname << ":" << m->port << endl;
+}
+
+// Returns false when the scheduler above us has gone away.
+static bool handle_upstream_activity()
+{
+    if (!upstream_channel->read_a_bit() || upstream_channel->at_eof()) {
+        return false;
+    }
+
+    while (upstream_channel->has_msg()) {
+        Msg *m = upstream_channel->get_msg(0);
+
+        if (!m) {
+            return false;
+        }
+
+        if (*m == Msg::LEND_CS) {
+            handle_lend_cs(static_cast<LendCSMsg *>(m));
+        }
+
+        delete m;
+    }
+
+    return true;
+}
+
+/* Lend idle daemons of regions without queued jobs to regions that have more jobs
+   waiting than free slots. At most half of a region's idle daemons are lent,
+   and the stats are adjusted so that the next report decides again.  */
+static void balance_regions()
+{
+    for (map<CompileServer *, RegionStatsMsg>::iterator needy = regions.begin(); needy != regions.end(); ++needy) {
+        if (needy->second.queued_jobs <= needy->second.free_slots) {
+            continue;
+        }
+
+        map<CompileServer *, RegionStatsMsg>::iterator donor = regions.end();
+
+        for (map<CompileServer *, RegionStatsMsg>::iterator it = regions.begin(); it != regions.end(); ++it) {
+            if (it->second.queued_jobs == 0 && it->second.idle_hosts > 0
+                    && (donor == regions.end() || it->second.idle_hosts > donor->second.idle_hosts)) {
+                donor = it;
+            }
+        }
+
+        if (donor == regions.end()) {
+            return;
+        }
+
+        unsigned int count = min((donor->second.idle_hosts + 1) / 2,
+                                 needy->second.queued_jobs - needy->second.free_slots);
+        log_info() << "lending " << count << " daemons of region " << donor->second.netname
+                   << " to region " << needy->second.netname << endl;
+
+        if (donor->first->send_msg(LendCSMsg(count, needy->first->name, needy->second.port, REGION_LEASE))) {
+            donor->second.idle_hosts -= count;
+            needy->second.free_slots += count;
+        }
+    }
+}
+
+static bool handle_region_stats(CompileServer *cs, Msg *_m)
+{
+    RegionStatsMsg *m = dynamic_cast<RegionStatsMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    if (!regions.count(cs)) {
+        log_info() << "region " << m->netname << " at " << cs->name << ":" << m->port << " reports to us" << endl;
+    }
+
+    regions[cs] = *m;
+    balance_regions();
+    return true;
+}
+
+static string result_affinity_key(const Job *job)
+{
+    string key = job->fileName() + '\n' + job->targetPlatform();
+    Environments environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        key += '\n' + it->second;
+    }
+
+    return key;
+}
+
 static list<CompileServer *> filter_ineligible_servers(Job *job)
 {
     list<CompileServer *> eligible;
@@ -796,7 +1295,8 @@ static CompileServer *pick_server_fastest(Job *job, list<CompileServer *> &eligi
 
 #if DEBUG_SCHEDULER > 1
         trace() << cs->nodeName() << " compiled " << cs->lastCompiledJobs().size() << " got now: " <<
-                cs->currentJobCount() << " speed: " << server_speed(cs, job, true) << " compile time " <<
+                cs->currentJobCount() << " speed: " << server_speed(cs, job, true) << " transfer: " <<
+                transfer_msec(cs, job) << " ms compile time " <<
                 cs->cumCompiled().compileTimeUser() << " produced code " << cs->cumCompiled().outputSize() <<
                 " client count: " << cs->clientCount() << endl;
 #endif
@@ -822,9 +1322,9 @@ static CompileServer *pick_server_fastest(Job *job, list<CompileServer *> &eligi
                 best = cs;
             }
             // Search the server with the earliest projected time to compile
-            // the job.  (XXX currently this is equivalent to the fastest one)
+            // the job, including getting it there and the result back.
             else if ((best->lastCompiledJobs().size() != 0)
-                     && (server_speed(best, job) < server_speed(cs, job))) {
+                     && (projected_msec(cs, job) < projected_msec(best, job))) {
                 if (cs->currentJobCount() < cs->maxJobs()) {
                     best = cs;
                 } else {
@@ -837,9 +1337,9 @@ static CompileServer *pick_server_fastest(Job *job, list<CompileServer *> &eligi
                 bestui = cs;
             }
             // Search the server with the earliest projected time to compile
-            // the job.  (XXX currently this is equivalent to the fastest one)
+            // the job, including getting it there and the result back.
             else if ((bestui->lastCompiledJobs().size() != 0)
-                     && (server_speed(bestui, job) < server_speed(cs, job))) {
+                     && (projected_msec(cs, job) < projected_msec(bestui, job))) {
                 if (cs->currentJobCount() < cs->maxJobs()) {
                     bestui = cs;
                 } else {
@@ -918,6 +1418,22 @@ static CompileServer *pick_server(Job *job, SchedulerAlgorithmName schedulerAlgo
         return nullptr;
     }
 
+    /* a server that has compiled the same file before may have the result in its cache */
+    if (!job->fileName().empty()) {
+        map<string, unsigned int>::const_iterator affinity = result_affinity.find(result_affinity_key(job));
+
+        if (affinity != result_affinity.end()) {
+            for (CompileServer * const cs : eligible) {
+                if (cs->hostId() == affinity->second && cs != job->submitter()) {
+#if DEBUG_SCHEDULER > 1
+                    trace() << "taking " << cs->nodeName() << " for its result cache" << endl;
+#endif
+                    return cs;
+                }
+            }
+        }
+    }
+
     // Don't bother running an algorithm if we don't need to.
     if ( eligible.size() == 0 ) {
         trace() << "no eligible servers" << endl;
@@ -1082,6 +1598,7 @@ static bool empty_queue(SchedulerAlgorithmName schedulerAlgorithm)
                 && job->preferredHost().empty()
                 /* This should be trivially true.  */
                 && use_cs->can_install(job).size()) {
+            region_fallbacks++;
             break;
         }
 
@@ -1102,6 +1619,7 @@ static bool empty_queue(SchedulerAlgorithmName schedulerAlgorithm)
             // so there's no point in delaying.
             log_info() << "No suitable host found, assigning submitter" << endl;
             use_cs = job->submitter();
+            region_fallbacks++;
             break;
         }
     }
@@ -1157,6 +1675,15 @@ static bool empty_queue(SchedulerAlgorithmName schedulerAlgorithm)
     {
         UseCSMsg m2(host_platform, use_cs->name, use_cs->remotePort(), job->id(),
                 gotit, job->localClientId(), matched_job_id);
+
+        // Let the environment come from another CS instead of the client, if possible.
+        if (!gotit) {
+            if (CompileServer *peer = pick_env_peer(use_cs, job, host_platform)) {
+                trace() << use_cs->nodeName() << " will get environment from " << peer->nodeName() << endl;
+                m2.env_peer_host = peer->name;
+                m2.env_peer_port = peer->remotePort();
+            }
+        }
         if (!job->submitter()->send_msg(m2)) {
             trace() << "failed to deliver job " << job->id() << endl;
             handle_end(job->submitter(), nullptr);   // will care for the rest
@@ -1174,6 +1701,15 @@ static bool empty_queue(SchedulerAlgorithmName schedulerAlgorithm)
 #endif
     use_cs->appendJob(job);
 
+    if (use_cs != job->submitter() && !job->fileName().empty()
+            && use_cs->featuresSupported(NODE_FEATURE_RESULT_CACHE)) {
+        if (result_affinity.size() >= MAX_RESULT_AFFINITY) {
+            result_affinity.clear();
+        }
+
+        result_affinity[result_affinity_key(job)] = use_cs->hostId();
+    }
+
     /* if it doesn't have the environment, it will get it. */
     if (!gotit) {
         use_cs->setBusyInstalling(time(nullptr));
@@ -1203,6 +1739,133 @@ static bool empty_queue(SchedulerAlgorithmName schedulerAlgorithm)
     return true;
 }
 
+/* A scheduler that is not the preferred one follows the preferred scheduler as a monitor,
+   so that it knows the speed of the hosts and the job ids in use when it has to take over. */
+static MsgChannel *standby_channel = nullptr;
+static map<string, float> standby_speeds; // by node name
+
+/* The port of another scheduler. When testing, two schedulers on one host use the two
+   ports from ICECC_TEST_SCHEDULER_PORTS.  */
+static unsigned int other_scheduler_port()
+{
+    if (const char *env = getenv("ICECC_TEST_SCHEDULER_PORTS")) {
+        const char *env2 = strchr(env, ':');
+        if (env2 != nullptr) {
+            if ((unsigned int) atoi(env) == scheduler_port) {
+                return atoi(env2 + 1);
+            }
+            if ((unsigned int) atoi(env2 + 1) == scheduler_port) {
+                return atoi(env);
+            }
+        }
+    }
+    return scheduler_port;
+}
+
+static void follow_scheduler(const string &host)
+{
+    if (standby_channel) {
+        return;
+    }
+
+    standby_channel = Service::createChannel(host, other_scheduler_port(), 2);
+
+    if (!standby_channel || !standby_channel->send_msg(MonLoginMsg())) {
+        trace() << "cannot follow scheduler at " << host << endl;
+        delete standby_channel;
+        standby_channel = nullptr;
+        return;
+    }
+
+    log_info() << "standing by for scheduler at " << host << endl;
+}
+
+static void handle_standby_msg(Msg *m)
+{
+    unsigned int job_id = 0;
+
+    if (*m == Msg::MON_STATS) {
+        const string &text = static_cast<MonStatsMsg *>(m)->statmsg;
+        string name;
+        float speed = 0;
+        size_t pos = 0;
+
+        while (pos < text.size()) {
+            size_t end = text.find('\n', pos);
+            if (end == string::npos) {
+                end = text.size();
+            }
+            string line = text.substr(pos, end - pos);
+            pos = end + 1;
+
+            if (line.compare(0, 5, "Name:") == 0) {
+                name = line.substr(5);
+            } else if (line.compare(0, 6, "Speed:") == 0) {
+                speed = atof(line.c_str() + 6);
+            }
+        }
+
+        if (!name.empty() && speed > 0) {
+            standby_speeds[name] = speed;
+        }
+    } else if (*m == Msg::MON_GET_CS) {
+        job_id = static_cast<MonGetCSMsg *>(m)->job_id;
+    } else if (*m == Msg::MON_JOB_BEGIN) {
+        job_id = static_cast<MonJobBeginMsg *>(m)->job_id;
+    }
+
+    // Continue its job ids, daemons may still report jobs it has assigned.
+    if (job_id > new_job_id) {
+        new_job_id = job_id;
+    }
+}
+
+// Returns false when the followed scheduler has gone away.
+static bool handle_standby_activity()
+{
+    if (!standby_channel->read_a_bit() || standby_channel->at_eof()) {
+        return false;
+    }
+
+    while (standby_channel->has_msg()) {
+        Msg *m = standby_channel->get_msg(0);
+
+        if (!m) {
+            return false;
+        }
+
+        handle_standby_msg(m);
+        delete m;
+    }
+
+    return true;
+}
+
+/* Give a host the speed the previous scheduler measured, instead of making it start
+   from scratch. Enough jobs are added for server_speed() to take them as they are. */
+static void seed_server_speed(CompileServer *cs)
+{
+    map<string, float>::iterator it = standby_speeds.find(cs->nodeName());
+
+    if (it == standby_speeds.end()) {
+        return;
+    }
+
+    if (cs->lastCompiledJobs().empty()) {
+        trace() << "speed of " << cs->nodeName() << " from the previous scheduler: " << it->second << endl;
+        JobStat st;
+        st.setCompileTimeUser(1000);
+        st.setOutputSize((unsigned long) (it->second * 1000));
+
+        for (int i = 0; i < 7; ++i) {
+            cs->appendCompiledJob(st);
+            cs->setCumCompiled(cs->cumCompiled() + st);
+        }
+    }
+
+    standby_speeds.erase(it);
+}
+
 static bool handle_login(CompileServer *cs, Msg *_m)
 {
     LoginMsg *m = dynamic_cast<LoginMsg *>(_m);
@@ -1216,6 +1879,7 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     cs->setRemotePort(m->port);
     cs->setCompilerVersions(m->envs);
     cs->setMaxJobs(m->max_kids);
+    cs->setMaxLinkJobs(m->max_link_jobs);
     cs->setNoRemote(m->noremote);
 
     if (m->nodename.length()) {
@@ -1242,6 +1906,7 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     }
     dbg << "]" << endl;
 
+    seed_server_speed(cs);
     handle_monitor_stats(cs);
 
     /* remove any other clients with the same IP and name, they must be stale */
@@ -1303,15 +1968,15 @@ static bool handle_mon_login(CompileServer *cs, Msg *_m)
         return false;
     }
 
-    monitors.push_back(cs);
     // monitors really want to be fed lazily
     cs->setBulkTransfer();
+    fd2cs.erase(cs->fd);   // no expected data from them
+    monitor_feed.add(cs);
 
     for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
-        handle_monitor_stats(*it);
+        handle_monitor_stats(*it, nullptr, cs);
     }
 
-    fd2cs.erase(cs->fd);   // no expected data from them
     return true;
 }
 
@@ -1453,6 +2118,8 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
             << " user=" << m->user_msec
             << " sys=" << m->sys_msec
             << " pfaults=" << m->pfaults
+            << " upload=" << m->in_msec
+            << " rtt=" << m->rtt_usec
             << " server=" << j->server()->nodeName()
             << endl;
     } else {
@@ -1465,6 +2132,7 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
     }
 
     add_job_stats(j, m);
+    add_link_stats(j, m);
     notify_monitors(new MonJobDoneMsg(*m));
     jobs.erase(m->job_id);
     delete j;
@@ -1501,15 +2169,14 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
         }
     }
 
-    for (CompileServer * const c : css)
-        if (c == cs) {
-            c->setLoad(m->load);
-            c->setClientCount(m->client_count);
-            handle_monitor_stats(c, m);
-            return true;
-        }
+    if (cs->type() != CompileServer::DAEMON) {
+        return false;
+    }
 
-    return false;
+    cs->setLoad(m->load);
+    cs->setClientCount(m->client_count);
+    handle_monitor_stats(cs, m);
+    return true;
 }
 
 static bool handle_blacklist_host_env(CompileServer *cs, Msg *_m)
@@ -1637,6 +2304,11 @@ static bool handle_line(CompileServer *cs, Msg *_m)
                     it->currentJobCount(), it->maxJobs(), it->load());
             line += buffer;
 
+            if (it->maxLinkJobs()) {
+                sprintf(buffer, " links=%d/%d", it->currentLinkJobCount(), it->maxLinkJobs());
+                line += buffer;
+            }
+
             if (it->busyInstalling()) {
                 sprintf(buffer, " busy installing since %ld s",  time(nullptr) - it->busyInstalling());
                 line += buffer;
@@ -1765,7 +2437,18 @@ static bool try_login(CompileServer *cs, Msg *m)
         break;
     case Msg::MON_LOGIN:
         cs->setType(CompileServer::MONITOR);
+        cs->setState(CompileServer::LOGGEDIN);
         ret = handle_mon_login(cs, m);
+
+        if (ret) {
+            // The channel belongs to the monitor feed now, don't touch it.
+            delete m;
+            return false;
+        }
+        break;
+    case Msg::REGION_STATS:
+        cs->setType(CompileServer::REGION);
+        ret = handle_region_stats(cs, m);
         break;
     default:
         log_info() << "Invalid first message " << m->to_string() << endl;
@@ -1793,11 +2476,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
 
     switch (toremove->type()) {
     case CompileServer::MONITOR:
-        assert(find(monitors.begin(), monitors.end(), toremove) != monitors.end());
-        monitors.remove(toremove);
-#if DEBUG_SCHEDULER > 1
-        trace() << "handle_end(moni) " << monitors.size() << endl;
-#endif
+        // Only before the login succeeded, then the monitor feed closes it.
         break;
     case CompileServer::DAEMON:
         log_info() << "remove daemon " << toremove->nodeName() << endl;
@@ -1866,11 +2545,16 @@ static bool handle_end(CompileServer *toremove, Msg *m)
             cs->eraseCSFromBlacklist(toremove);
         }
 
+        remove_link_stats(toremove);
         break;
     case CompileServer::LINE:
         toremove->send_msg(TextMsg("200 Good Bye!"));
         controls.remove(toremove);
 
+        break;
+    case CompileServer::REGION:
+        log_info() << "region " << regions[toremove].netname << " gone" << endl;
+        regions.erase(toremove);
         break;
     default:
         trace() << "remote end had UNKNOWN type?" << endl;
@@ -1934,6 +2618,9 @@ static bool handle_activity(CompileServer *cs)
     case Msg::BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(cs, m);
         break;
+    case Msg::REGION_STATS:
+        ret = handle_region_stats(cs, m);
+        break;
     default:
         log_info() << "Invalid message type arrived " << m->to_string() << endl;
         handle_end(cs, m);
@@ -2035,6 +2722,8 @@ static void usage(const std::string reason = "")
          << "  -v[v[v]]]\n"
          << "  -r, --persistent-client-connection\n"
          << "  -a, --algorithm <name>\n"
+         << "  --env-replicas <count>\n"
+         << "  --upstream <host[:port]>\n"
          << endl;
 
     exit(1);
@@ -2055,10 +2744,11 @@ static void trigger_exit(int signum)
     signal(signum, trigger_exit);
 }
 
-static void handle_scheduler_announce(const char* buf, const char* netname, bool persistent_clients, struct sockaddr_in broad_addr)
+/* Another scheduler is announcing it's running, disconnect daemons if it has a better version
+   or the same version but was started earlier, and follow it. Returns true if we are
+   the preferred scheduler. */
+static bool handle_scheduler_announce(const char* buf, const char* netname, bool persistent_clients, struct sockaddr_in broad_addr)
 {
-    /* Another scheduler is announcing it's running, disconnect daemons if it has a better version
-       or the same version but was started earlier. */
     time_t other_time;
     int other_protocol_version;
     string other_netname;
@@ -2077,21 +2767,22 @@ static void handle_scheduler_announce(const char* buf, const char* netname, bool
                         << ":" << ntohs(broad_addr.sin_port)
                         << " (version " << int(other_protocol_version) << ") has announced itself as a preferred"
                         " scheduler, disconnecting all connections." << endl;
-                    if (!css.empty() || !monitors.empty())
+                    while (!css.empty())
                     {
-                        while (!css.empty())
-                        {
-                            handle_end(css.front(), nullptr);
-                        }
-                        while (!monitors.empty())
-                        {
-                            handle_end(monitors.front(), nullptr);
-                        }
+                        handle_end(css.front(), nullptr);
                     }
+                    monitor_feed.clear();
+                    follow_scheduler(inet_ntoa(broad_addr.sin_addr));
                 }
             }
+            // Our own announcement comes back with the same start time.
+            else if (other_protocol_version < PROTOCOL_VERSION || other_time > starttime)
+            {
+                return true;
+            }
         }
     }
+    return false;
 }
 
 int main(int argc, char *argv[])
@@ -2137,6 +2828,8 @@ int main(int argc, char *argv[])
             { "log-file", 1, nullptr, 'l'},
             { "user-uid", 1, nullptr, 'u'},
             { "algorithm", 1, nullptr, 'a' },
+            { "env-replicas", 1, nullptr, 0 },
+            { "upstream", 1, nullptr, 0 },
             { nullptr, 0, nullptr, 0 }
         };
 
@@ -2147,9 +2840,30 @@ int main(int argc, char *argv[])
         }
 
         switch (c) {
-        case 0:
-            (void) long_options[option_index].name;
+        case 0: {
+            string optname = long_options[option_index].name;
+
+            if (optname == "env-replicas") {
+                if (optarg && *optarg) {
+                    env_replicas = atoi(optarg);
+                } else {
+                    usage("Error: --env-replicas requires argument");
+                }
+            } else if (optname == "upstream") {
+                if (optarg && *optarg) {
+                    upstream_host = optarg;
+                    size_t colon = upstream_host.rfind(':');
+
+                    if (colon != string::npos) {
+                        upstream_port = atoi(upstream_host.c_str() + colon + 1);
+                        upstream_host.erase(colon);
+                    }
+                } else {
+                    usage("Error: --upstream requires argument");
+                }
+            }
             break;
+        }
         case 'd':
             detach = true;
             break;
@@ -2350,6 +3064,7 @@ int main(int argc, char *argv[])
     signal(SIGALRM, trigger_exit);
 
     log_info() << "scheduler ready, algorithm: " <<  scheduler_algo << endl;
+    monitor_feed.start();
 
     time_t next_listen = 0;
 
@@ -2363,6 +3078,16 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        if (env_replicas > 0 && last_env_prefetch + ENV_PREFETCH_INTERVAL <= time(nullptr)) {
+            prefetch_environments();
+            last_env_prefetch = time(nullptr);
+        }
+
+        if (!upstream_host.empty() && last_region_stats + REGION_STATS_INTERVAL <= time(nullptr)) {
+            send_region_stats(netname);
+            last_region_stats = time(nullptr);
+        }
+
         /* Announce ourselves from time to time, to make other possible schedulers disconnect
            their daemons if we are the preferred scheduler (daemons with version new enough
            should automatically select the best scheduler, but old daemons connect randomly). */
@@ -2389,25 +3114,47 @@ int main(int argc, char *argv[])
         pfd.events = POLLIN;
         pollfds.push_back( pfd );
 
+        if (standby_channel) {
+            pfd.fd = standby_channel->fd;
+            pfd.events = POLLIN;
+            pollfds.push_back( pfd );
+        }
+
+        if (upstream_channel) {
+            pfd.fd = upstream_channel->fd;
+            pfd.events = POLLIN;
+            pollfds.push_back( pfd );
+        } else if (upstream_connect_fd >= 0) {
+            pfd.fd = upstream_connect_fd;
+            pfd.events = POLLOUT;
+            pollfds.push_back( pfd );
+        }
+
+        // Wake up for the reports, which also time out connecting.
+        if (!upstream_host.empty()) {
+            timeout = min(timeout, REGION_STATS_INTERVAL);
+        }
+
         for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end();) {
-            int i = it->first;
             CompileServer *cs = it->second;
-            bool ok = true;
             ++it;
 
             /* handle_activity() can delete c and make the iterator
                invalid.  */
-            while (ok && cs->has_msg()) {
+            while (cs->has_msg()) {
                 if (!handle_activity(cs)) {
-                    ok = false;
+                    break;
                 }
             }
+        }
 
-            if (ok) {
-                pfd.fd = i;
-                pfd.events = POLLIN;
-                pollfds.push_back( pfd );
-            }
+        flush_channels();
+        monitor_feed.reap();
+
+        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end(); ++it) {
+            pfd.fd = it->first;
+            pfd.events = POLLIN;
+            pollfds.push_back( pfd );
         }
 
         list<CompileServer *> cs_in_tsts;
@@ -2463,6 +3210,7 @@ int main(int argc, char *argv[])
                     CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
                     trace() << "accepted " << cs->name << endl;
                     cs->last_talk = time(nullptr);
+                    cs->cork();
 
                     if (!cs->protocol) { // protocol mismatch
                         delete cs;
@@ -2497,6 +3245,7 @@ int main(int argc, char *argv[])
 
             if (remote_fd >= 0) {
                 CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
+                cs->cork();
                 fd2cs[cs->fd] = cs;
 
                 if (!handle_control_login(cs)) {
@@ -2549,10 +3298,42 @@ int main(int argc, char *argv[])
                 }
             }
             else if(Broadcasts::isSchedulerVersion(buf, buflen)) {
-                handle_scheduler_announce(buf, netname, persistent_clients, broad_addr);
+                /* Let a scheduler that has just started know about us soon, so that it
+                   can follow us as a standby. */
+                if (handle_scheduler_announce(buf, netname, persistent_clients, broad_addr)
+                        && last_announce + 5 < time(nullptr)) {
+                    Broadcasts::broadcastSchedulerVersion(scheduler_port, netname, starttime);
+                    last_announce = time(nullptr);
+                }
             }
         }
 
+        if (active_fds && standby_channel && pollfd_is_set(pollfds, standby_channel->fd, POLLIN)) {
+            active_fds--;
+
+            if (!handle_standby_activity()) {
+                log_info() << "the scheduler we stood by for has gone away, taking over with "
+                           << standby_speeds.size() << " known hosts" << endl;
+                delete standby_channel;
+                standby_channel = nullptr;
+                Broadcasts::broadcastSchedulerVersion(scheduler_port, netname, starttime);
+                last_announce = time(nullptr);
+            }
+        }
+
+        if (active_fds && upstream_channel && pollfd_is_set(pollfds, upstream_channel->fd, POLLIN)) {
+            active_fds--;
+
+            if (!handle_upstream_activity()) {
+                log_info() << "upstream scheduler " << upstream_host << " has gone away" << endl;
+                upstream_unreachable();
+            }
+        } else if (active_fds && upstream_connect_fd >= 0
+                   && pollfd_is_set(pollfds, upstream_connect_fd, POLLOUT)) {
+            active_fds--;
+            finish_upstream_connect();
+        }
+
         for (map<int, CompileServer *>::const_iterator it = fd2cs.begin();
                 active_fds > 0 && it != fd2cs.end();) {
             int i = it->first;
@@ -2596,8 +3377,8 @@ int main(int argc, char *argv[])
     shutdown(broad_fd, SHUT_RDWR);
     while (!css.empty())
         handle_end(css.front(), nullptr);
-    while (!monitors.empty())
-        handle_end(monitors.front(), nullptr);
+    monitor_feed.stop();
+    delete standby_channel;
     if ((-1 == close(broad_fd)) && (errno != EBADF)){
         log_perror("close failed");
     }
@@ -44,6 +44,7 @@
 #include <errno.h>
 #include <string>
 #include <iostream>
+#include <vector>
 #include <assert.h>
 #include <lzo/lzo1x.h>
 #include <zstd.h>
@@ -102,6 +103,17 @@ static int zstd_compression()
  */
 #define MAX_SLOW_WRITE_SIZE 10 * 1024
 
+/*
+ * Reads ask for at least this much, so that one read gets several small messages,
+ * or with a large message also the start of the next one. When reads fill the
+ * buffer, it grows up to MAX_READ_AHEAD, or that much more than a large message.
+ */
+#define MIN_READ_SIZE (4 * 1024)
+#define MAX_READ_AHEAD (1024 * 1024)
+
+// How much a corked channel queues before sending anyway.
+#define MAX_CORKED_SIZE (64 * 1024)
+
 /* TODO
  * buffered in/output per MsgChannel
     + move read* into MsgChannel, create buffer-fill function
@@ -118,15 +130,12 @@ static int zstd_compression()
 bool MsgChannel::read_a_bit()
 {
     chop_input();
-    size_t count = inbuflen - inofs;
 
-    if (count < 128) {
-        inbuflen = (inbuflen + 128 + 127) & ~(size_t) 127;
-        inbuf = (char *) realloc(inbuf, inbuflen);
-        assert(inbuf); // Probably unrecoverable if realloc fails anyway.
-        count = inbuflen - inofs;
+    if (inbuflen - inofs < MIN_READ_SIZE) {
+        grow_inbuf(inofs + MIN_READ_SIZE);
     }
 
+    size_t count = inbuflen - inofs;
     char *buf = inbuf + inofs;
     bool error = false;
 
@@ -156,6 +165,11 @@ bool MsgChannel::read_a_bit()
 
     inofs = buf - inbuf;
 
+    // All the room got used, so probably more is waiting, read more next time.
+    if (!count && inbuflen < MAX_READ_AHEAD) {
+        grow_inbuf(inbuflen * 2);
+    }
+
     if (!update_state()) {
         error = true;
     }
@@ -270,10 +284,10 @@ bool MsgChannel::update_state()
                 return false;
             }
 
-            if (inbuflen - intogo < inmsglen) {
-                inbuflen = (inmsglen + intogo + 127) & ~(size_t)127;
-                inbuf = (char *) realloc(inbuf, inbuflen);
-                assert(inbuf); // Probably unrecoverable if realloc fails anyway.
+            // Room for the whole message, and to read the following ones with it.
+            if (inbuflen - intogo < inmsglen + MIN_READ_SIZE) {
+                chop_input(true);
+                grow_inbuf(inmsglen + min<size_t>(max<size_t>(inmsglen, MIN_READ_SIZE), MAX_READ_AHEAD));
             }
 
             instate = FILL_BUF;
@@ -303,11 +317,11 @@ bool MsgChannel::update_state()
     return true;
 }
 
-void MsgChannel::chop_input()
+void MsgChannel::chop_input(bool force)
 {
     /* Make buffer smaller, if there's much already read in front
        of it, or it is cheap to do.  */
-    if (intogo > 8192 || inofs - intogo <= 16) {
+    if (force || intogo > 8192 || inofs - intogo <= 16) {
         if (inofs - intogo != 0) {
             memmove(inbuf, inbuf + intogo, inofs - intogo);
         }
@@ -317,6 +331,22 @@ void MsgChannel::chop_input()
     }
 }
 
+void MsgChannel::grow_inbuf(size_t size)
+{
+    /* Powers of two, so that messages of varying size don't realloc each time.  */
+    size_t len = inbuflen;
+
+    while (len < size) {
+        len *= 2;
+    }
+
+    if (len != inbuflen) {
+        inbuflen = len;
+        inbuf = (char *) realloc(inbuf, inbuflen);
+        assert(inbuf); // Probably unrecoverable if realloc fails anyway.
+    }
+}
+
 void MsgChannel::chop_output()
 {
     if (msgofs > 8192 || msgtogo <= 16) {
@@ -534,7 +564,53 @@ void MsgChannel::read_environments(Environments &envs)
     }
 }
 
-void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen)
+/* Transfers send and receive many chunks in a row, so keep what compressing
+   and decompressing needs instead of allocating it for every chunk. These are
+   shared by all channels, which must only be used by one thread of a process,
+   like logging. The scheduler's monitor feed thread only gets serialized messages.  */
+static ZSTD_CCtx *zstd_cctx = nullptr;
+static ZSTD_DCtx *zstd_dctx = nullptr;
+static lzo_voidp lzo_wrkmem = nullptr;
+
+/* Likewise for the payload buffers of received FILE_CHUNKs, a few freed ones
+   are kept for reuse.  */
+#define CHUNK_BUFFER_SIZE (128 * 1024)
+#define MAX_POOLED_CHUNK_BUFFERS 4
+#define MAX_POOLED_CHUNK_BUFFER_SIZE (1024 * 1024)
+static vector<pair<unsigned char *, size_t> > chunk_buffers;
+
+static unsigned char *get_chunk_buffer(size_t size, size_t &capacity)
+{
+    for (size_t i = 0; i < chunk_buffers.size(); ++i) {
+        if (chunk_buffers[i].second >= size) {
+            unsigned char *buffer = chunk_buffers[i].first;
+            capacity = chunk_buffers[i].second;
+            chunk_buffers[i] = chunk_buffers.back();
+            chunk_buffers.pop_back();
+            return buffer;
+        }
+    }
+
+    capacity = max<size_t>(size, CHUNK_BUFFER_SIZE);
+    return new unsigned char[capacity];
+}
+
+static void put_chunk_buffer(unsigned char *buffer, size_t capacity)
+{
+    if (!buffer) {
+        return;
+    }
+
+    if (chunk_buffers.size() < MAX_POOLED_CHUNK_BUFFERS
+        && capacity <= MAX_POOLED_CHUNK_BUFFER_SIZE) {
+        chunk_buffers.push_back(make_pair(buffer, capacity));
+    } else {
+        delete[] buffer;
+    }
+}
+
+void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen,
+                                size_t &_bufsize)
 {
     lzo_uint uncompressed_len;
     lzo_uint compressed_len;
@@ -573,25 +649,29 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
         return;
     }
 
-    *uncompressed_buf = new unsigned char[uncompressed_len];
+    *uncompressed_buf = get_chunk_buffer(uncompressed_len, _bufsize);
 
     if (proto == C_ZSTD && uncompressed_len && compressed_len) {
         const void *compressed_buf = inbuf + intogo;
-        size_t ret = ZSTD_decompress(*uncompressed_buf, uncompressed_len,
-                                     compressed_buf, compressed_len);
+
+        if (!zstd_dctx) {
+            zstd_dctx = ZSTD_createDCtx();
+        }
+
+        size_t ret = ZSTD_decompressDCtx(zstd_dctx, *uncompressed_buf, uncompressed_len,
+                                         compressed_buf, compressed_len);
         if (ZSTD_isError(ret)) {
             log_error() << "internal error - decompression of data from " << dump().c_str()
                         << " failed: " << ZSTD_getErrorName(ret) << endl;
-            delete[] *uncompressed_buf;
+            put_chunk_buffer(*uncompressed_buf, _bufsize);
             *uncompressed_buf = nullptr;
             uncompressed_len = 0;
         }
     } else if (proto == C_LZO && uncompressed_len && compressed_len) {
         const lzo_byte *compressed_buf = (lzo_byte *)(inbuf + intogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
+        // LZO1X decompression needs no work memory.
         int ret = lzo1x_decompress(compressed_buf, compressed_len,
-                                   *uncompressed_buf, &uncompressed_len, wrkmem);
-        free(wrkmem);
+                                   *uncompressed_buf, &uncompressed_len, nullptr);
 
         if (ret != LZO_E_OK) {
             /* This should NEVER happen.
@@ -600,7 +680,7 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
             that there actually was something read in.  */
             log_error() << "internal error - decompression of data from " << dump().c_str()
                         << " failed: " << ret << endl;
-            delete [] *uncompressed_buf;
+            put_chunk_buffer(*uncompressed_buf, _bufsize);
             *uncompressed_buf = nullptr;
             uncompressed_len = 0;
         }
@@ -642,9 +722,12 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
 
     if (proto == C_LZO) {
         lzo_byte *out_buf = (lzo_byte *)(msgbuf + msgtogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-        int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, wrkmem);
-        free(wrkmem);
+
+        if (!lzo_wrkmem) {
+            lzo_wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
+        }
+
+        int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, lzo_wrkmem);
 
         if (ret != LZO_E_OK) {
             /* this should NEVER happen */
@@ -653,7 +736,13 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
         }
     } else if (proto == C_ZSTD) {
         void *out_buf = msgbuf + msgtogo;
-        size_t ret = ZSTD_compress(out_buf, out_len, in_buf, in_len, zstd_compression());
+
+        if (!zstd_cctx) {
+            zstd_cctx = ZSTD_createCCtx();
+        }
+
+        size_t ret = ZSTD_compressCCtx(zstd_cctx, out_buf, out_len, in_buf, in_len,
+                                       zstd_compression());
         if (ZSTD_isError(ret)) {
             /* this should NEVER happen */
             log_error() << "internal error - compression failed: " << ZSTD_getErrorName(ret) << endl;
@@ -847,6 +936,59 @@ MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int
     return createChannel(remote_fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
 }
 
+int Service::startConnect(const string &hostname, unsigned short p)
+{
+    struct sockaddr_in remote_addr;
+    int remote_fd = prepare_connect(hostname, p, remote_addr);
+
+    if (remote_fd < 0) {
+        return -1;
+    }
+
+    fcntl(remote_fd, F_SETFL, O_NONBLOCK);
+    fcntl(remote_fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr)) < 0
+            && errno != EINPROGRESS) {
+        log_perror_trace("connect");
+        trace() << "connect failed on " << hostname << endl;
+        if ((-1 == close(remote_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+        return -1;
+    }
+
+    return remote_fd;
+}
+
+MsgChannel *Service::finishConnect(int remote_fd)
+{
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    struct sockaddr_in remote_addr;
+    socklen_t addr_len = sizeof(remote_addr);
+
+    if (getsockopt(remote_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0
+            || getpeername(remote_fd, (struct sockaddr *) &remote_addr, &addr_len) < 0) {
+        trace() << "connect failed: " << strerror(error ? error : errno) << endl;
+        if ((-1 == close(remote_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+        return nullptr;
+    }
+
+    MsgChannel *c = new MsgChannel(remote_fd, (struct sockaddr *) &remote_addr, addr_len, false);
+
+    // protocol is 0 if the initial protocol version couldn't be sent.
+    if (c->protocol == 0) {
+        delete c;
+        return nullptr;
+    }
+
+    trace() << "connected to " << c->name << endl;
+    return c;
+}
+
 MsgChannel *Service::createChannel(const string &socket_path)
 {
     int remote_fd;
@@ -911,6 +1053,23 @@ MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
     return c;
 }
 
+MsgChannel *Service::createChannel(int fd, int protocol, const string &unread_input)
+{
+    MsgChannel *c = new MsgChannel(fd, nullptr, 0, true);
+    c->text_based = false;
+    c->protocol = protocol;
+    c->grow_inbuf(unread_input.size());
+    memcpy(c->inbuf, unread_input.data(), unread_input.size());
+    c->inofs = unread_input.size();
+
+    if (!c->update_state()) {
+        delete c;
+        c = nullptr;
+    }
+
+    return c;
+}
+
 MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     : fd(_fd)
 {
@@ -943,6 +1102,7 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     intogo = 0;
     eof = false;
     text_based = text;
+    corked = false;
     set_error_recursion = false;
     maximum_remote_protocol = -1;
 
@@ -1012,6 +1172,21 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
 
 MsgChannel::~MsgChannel()
 {
+    // What a corked channel still has queued, as far as it goes without blocking.
+    if (fd >= 0 && msgtogo && instate != ERROR) {
+#ifdef MSG_NOSIGNAL
+        ssize_t ret = send(fd, msgbuf + msgofs, msgtogo, MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+        void (*oldsigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+        ssize_t ret = send(fd, msgbuf + msgofs, msgtogo, MSG_DONTWAIT);
+        signal(SIGPIPE, oldsigpipe);
+#endif
+
+        if (ret < 0) {
+            trace() << "dropping queued output for " << dump() << endl;
+        }
+    }
+
     if (fd >= 0) {
         if ((-1 == close(fd)) && (errno != EBADF)){
             log_perror("close failed");
@@ -1038,6 +1213,20 @@ string MsgChannel::dump() const
     return name + ": (" + char((int)instate + 'A') + " eof: " + char(eof + '0') + ")";
 }
 
+string MsgChannel::unread_input() const
+{
+    string input;
+
+    // The length of the message being received was read already.
+    if (instate == FILL_BUF || instate == HAS_MSG) {
+        uint32_t len = htonl(inmsglen);
+        input.assign((const char *) &len, 4);
+    }
+
+    input.append(inbuf + intogo, inofs - intogo);
+    return input;
+}
+
 /* Wait blocking until the protocol setup for this channel is complete.
    Returns false if an error occurred.  */
 bool MsgChannel::wait_for_protocol()
@@ -1107,6 +1296,11 @@ bool MsgChannel::wait_for_msg(int timeout)
         return true;
     }
 
+    // A reply can only come for what was sent.
+    if (msgtogo && !flush_writebuf(true)) {
+        return false;
+    }
+
     if (!read_a_bit()) {
         trace() << "!read_a_bit\n";
         set_error();
@@ -1274,6 +1468,36 @@ Msg *MsgChannel::get_msg(int timeout, bool eofAllowed)
     case Msg::BLACKLIST_HOST_ENV:
         m = new BlacklistHostEnvMsg;
         break;
+    case Msg::ENV_FETCH:
+        m = new EnvFetchMsg;
+        break;
+    case Msg::GET_ENV:
+        m = new GetEnvMsg;
+        break;
+    case Msg::GET_RESULT:
+        m = new GetResultMsg;
+        break;
+    case Msg::PUT_RESULT:
+        m = new PutResultMsg;
+        break;
+    case Msg::HEADER_LIST:
+        m = new HeaderListMsg;
+        break;
+    case Msg::GET_INCLUDE_SCAN:
+        m = new GetIncludeScanMsg;
+        break;
+    case Msg::INCLUDE_SCAN:
+        m = new IncludeScanMsg;
+        break;
+    case Msg::CPP_SLOT:
+        m = new CppSlotMsg;
+        break;
+    case Msg::REGION_STATS:
+        m = new RegionStatsMsg;
+        break;
+    case Msg::LEND_CS:
+        m = new LendCSMsg;
+        break;
     case Msg::TIMEOUT:
         break;
     }
@@ -1333,9 +1557,62 @@ bool MsgChannel::send_msg(const Msg &m, int flags)
         return true;
     }
 
+    if (corked && msgtogo < MAX_CORKED_SIZE) {
+        return true;
+    }
+
     return flush_writebuf((flags & SendBlocking));
 }
 
+bool MsgChannel::serialize_msg(const Msg &m, string &data)
+{
+    if (instate == ERROR || msgtogo) {
+        return false;
+    }
+
+    chop_output();
+
+    if (!text_based) {
+        *this << (uint32_t) 0;
+    }
+
+    m.send_to_channel(this);
+
+    if (!text_based) {
+        uint32_t out_len = msgtogo - 4;
+        if(out_len > MAX_MSG_SIZE) {
+            log_error() << "internal error - size of message to write exceeds max size:" << out_len << endl;
+            msgtogo = 0;
+            return false;
+        }
+        uint32_t len = htonl(out_len);
+        memcpy(msgbuf, &len, 4);
+    }
+
+    data.append(msgbuf, msgtogo);
+    msgtogo = 0;
+    return true;
+}
+
+bool MsgChannel::flush(bool blocking)
+{
+    if (!msgtogo) {
+        return true;
+    }
+
+    if (instate == ERROR) {
+        return false;
+    }
+
+    return flush_writebuf(blocking);
+}
+
+bool MsgChannel::uncork(bool blocking)
+{
+    corked = false;
+    return flush(blocking);
+}
+
 static int get_second_port_for_debug( int port )
 {
     // When running tests, we want to check also interactions between 2 schedulers, but
@@ -1998,6 +2275,15 @@ void GetCSMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_VERSION(43, c)) {
         *c >> niceness;
     }
+
+    native_compiler = string();
+    native_extrafiles.clear();
+    native_compression = string();
+    if (IS_PROTOCOL_VERSION(52, c)) {
+        *c >> native_compiler;
+        *c >> native_extrafiles;
+        *c >> native_compression;
+    }
 }
 
 void GetCSMsg::send_to_channel(MsgChannel *c) const
@@ -2031,6 +2317,11 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_VERSION(43, c)) {
         *c << niceness;
     }
+    if (IS_PROTOCOL_VERSION(52, c)) {
+        *c << native_compiler;
+        *c << native_extrafiles;
+        *c << native_compression;
+    }
 }
 
 void UseCSMsg::fill_from_channel(MsgChannel *c)
@@ -2048,6 +2339,18 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    env_peer_host = string();
+    env_peer_port = 0;
+    if (IS_PROTOCOL_VERSION(46, c)) {
+        *c >> env_peer_host;
+        *c >> env_peer_port;
+    }
+
+    native_env = string();
+    if (IS_PROTOCOL_VERSION(52, c)) {
+        *c >> native_env;
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -2063,6 +2366,15 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_VERSION(28, c)) {
         *c << matched_job_id;
     }
+
+    if (IS_PROTOCOL_VERSION(46, c)) {
+        *c << env_peer_host;
+        *c << env_peer_port;
+    }
+
+    if (IS_PROTOCOL_VERSION(52, c)) {
+        *c << native_env;
+    }
 }
 
 void NoCSMsg::fill_from_channel(MsgChannel *c)
@@ -2136,6 +2448,21 @@ void CompileFileMsg::fill_from_channel(MsgChannel *c)
         job->setOutputFile(outputFile);
         job->setDwarfFissionEnabled(dwarfFissionEnabled);
     }
+    if (IS_PROTOCOL_VERSION(49, c)) {
+        list<string> preprocessorFlags;
+        *c >> preprocessorFlags;
+        job->setPreprocessorFlags(preprocessorFlags);
+    }
+    if (IS_PROTOCOL_VERSION(51, c)) {
+        string precompiledHeader;
+        *c >> precompiledHeader;
+        job->setPrecompiledHeader(precompiledHeader);
+    }
+    if (IS_PROTOCOL_VERSION(56, c)) {
+        uint32_t inputReady = 0;
+        *c >> inputReady;
+        job->setInputReady(inputReady);
+    }
 }
 
 void CompileFileMsg::send_to_channel(MsgChannel *c) const
@@ -2179,6 +2506,15 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
         *c << job->outputFile();
         *c << (uint32_t) job->dwarfFissionEnabled();
     }
+    if (IS_PROTOCOL_VERSION(49, c)) {
+        *c << job->preprocessorFlags();
+    }
+    if (IS_PROTOCOL_VERSION(51, c)) {
+        *c << job->precompiledHeader();
+    }
+    if (IS_PROTOCOL_VERSION(56, c)) {
+        *c << (uint32_t) job->inputReady();
+    }
 }
 
 // Environments created by icecc-create-env always use the same binary name
@@ -2209,14 +2545,14 @@ CompileJob *CompileFileMsg::takeJob()
 void FileChunkMsg::fill_from_channel(MsgChannel *c)
 {
     if (del_buf) {
-        delete [] buffer;
+        put_chunk_buffer(buffer, capacity);
     }
 
     buffer = nullptr;
     del_buf = true;
 
     Msg::fill_from_channel(c);
-    c->readcompressed(&buffer, len, compressed);
+    c->readcompressed(&buffer, len, compressed, capacity);
 }
 
 void FileChunkMsg::send_to_channel(MsgChannel *c) const
@@ -2228,7 +2564,7 @@ void FileChunkMsg::send_to_channel(MsgChannel *c) const
 FileChunkMsg::~FileChunkMsg()
 {
     if (del_buf) {
-        delete [] buffer;
+        put_chunk_buffer(buffer, capacity);
     }
 }
 
@@ -2333,6 +2669,8 @@ JobDoneMsg::JobDoneMsg(int id, int exit, unsigned int _flags, unsigned int _clie
     in_uncompressed = 0;
     out_compressed = 0;
     out_uncompressed = 0;
+    in_msec = 0;
+    rtt_usec = 0;
 }
 
 void JobDoneMsg::fill_from_channel(MsgChannel *c)
@@ -2359,6 +2697,10 @@ void JobDoneMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_VERSION(39, c)) {
         *c >> client_count;
     }
+    if (IS_PROTOCOL_VERSION(55, c)) {
+        *c >> in_msec;
+        *c >> rtt_usec;
+    }
 }
 
 void JobDoneMsg::send_to_channel(MsgChannel *c) const
@@ -2382,6 +2724,10 @@ void JobDoneMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_VERSION(39, c)) {
         *c << client_count;
     }
+    if (IS_PROTOCOL_VERSION(55, c)) {
+        *c << in_msec;
+        *c << rtt_usec;
+    }
 }
 
 void JobDoneMsg::set_unknown_job_client_id( uint32_t clientId )
@@ -2409,6 +2755,7 @@ LoginMsg::LoginMsg(unsigned int myport, const std::string &_nodename, const std:
     : Msg(Msg::LOGIN)
     , port(myport)
     , max_kids(0)
+    , max_link_jobs(0)
     , noremote(false)
     , chroot_possible(false)
     , nodename(_nodename)
@@ -2446,6 +2793,10 @@ void LoginMsg::fill_from_channel(MsgChannel *c)
     if (IS_PROTOCOL_VERSION(42, c)) {
         *c >> supported_features;
     }
+    max_link_jobs = 0;
+    if (IS_PROTOCOL_VERSION(45, c)) {
+        *c >> max_link_jobs;
+    }
 }
 
 void LoginMsg::send_to_channel(MsgChannel *c) const
@@ -2464,6 +2815,9 @@ void LoginMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_VERSION(42, c)) {
         *c << supported_features;
     }
+    if (IS_PROTOCOL_VERSION(45, c)) {
+        *c << max_link_jobs;
+    }
 }
 
 void ConfCSMsg::fill_from_channel(MsgChannel *c)
@@ -2555,6 +2909,170 @@ void EnvTransferMsg::send_to_channel(MsgChannel *c) const
     *c << target;
 }
 
+void EnvFetchMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+    *c >> hostname;
+    *c >> port;
+}
+
+void EnvFetchMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+    *c << hostname;
+    *c << port;
+}
+
+void GetEnvMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+}
+
+void GetEnvMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+}
+
+void GetResultMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+}
+
+void GetResultMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+}
+
+void PutResultMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+}
+
+void PutResultMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+}
+
+void HeaderListMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> files;
+    *c >> hashes;
+}
+
+void HeaderListMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << files;
+    *c << hashes;
+}
+
+void GetIncludeScanMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+}
+
+void GetIncludeScanMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+}
+
+void IncludeScanMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+    *c >> flags;
+    *c >> files;
+    *c >> hashes;
+    *c >> dependencies;
+    *c >> stamp_paths;
+    *c >> stamps;
+}
+
+void IncludeScanMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+    *c << flags;
+    *c << files;
+    *c << hashes;
+    *c << dependencies;
+    *c << stamp_paths;
+    *c << stamps;
+}
+
+void CppSlotMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+
+    if (IS_PROTOCOL_VERSION(57, c)) {
+        *c >> wait;
+    }
+}
+
+void CppSlotMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+
+    if (IS_PROTOCOL_VERSION(57, c)) {
+        *c << wait;
+    }
+}
+
+void RegionStatsMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> netname;
+    *c >> port;
+    *c >> hosts;
+    *c >> idle_hosts;
+    *c >> free_slots;
+    *c >> queued_jobs;
+}
+
+void RegionStatsMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << netname;
+    *c << port;
+    *c << hosts;
+    *c << idle_hosts;
+    *c << free_slots;
+    *c << queued_jobs;
+}
+
+void LendCSMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> count;
+    *c >> hostname;
+    *c >> port;
+    *c >> lease;
+}
+
+void LendCSMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << count;
+    *c << hostname;
+    *c << port;
+    *c << lease;
+}
+
 void MonGetCSMsg::fill_from_channel(MsgChannel *c)
 {
     if (IS_PROTOCOL_VERSION(29, c)) {
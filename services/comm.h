@@ -36,7 +36,7 @@
 #include "job.h"
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 44
+#define PROTOCOL_VERSION 57
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -125,7 +125,32 @@ public:
         // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
         BLACKLIST_HOST_ENV,
         // S --> CS
-        NO_CS
+        NO_CS,
+        // C --> CS, get the environment from another CS, answered by VERIFY_ENV_RESULT
+        // S --> CS, prefetch the environment from another CS, not answered
+        ENV_FETCH,
+        // CS --> CS, answered by TRANFER_ENV with the tarball, or END if not available
+        GET_ENV,
+        // C --> local CS, answered by COMPILE_RESULT and the files, or END if not cached
+        GET_RESULT,
+        // C --> local CS, followed by COMPILE_RESULT and the files to cache
+        PUT_RESULT,
+        // C --> CS, the files needed to preprocess a job or its precompiled header, after COMPILE_FILE
+        // CS --> C, the files of those that are missing, which C then sends
+        HEADER_LIST,
+        // C --> local CS, answered by INCLUDE_SCAN, or END if not cached
+        GET_INCLUDE_SCAN,
+        // C --> local CS, the includes found for a job, to cache
+        // local CS --> C, answer to GET_INCLUDE_SCAN
+        INCLUDE_SCAN,
+        // C --> local CS, asks for a slot to preprocess a job
+        // local CS --> C, the slot, kept until C closes the connection
+        CPP_SLOT,
+        // S --> upstream S (periodic), the capacity of a region, first message sent
+        REGION_STATS,
+        // upstream S --> S, lend idle daemons to another region's scheduler
+        // S --> CS, serve the given scheduler for a while
+        LEND_CS
     };
 
     Msg() = default;
@@ -202,6 +227,26 @@ public:
                 return "BLACKLIST_HOST_ENV";
             case NO_CS:
                 return "NO_CS";
+            case ENV_FETCH:
+                return "ENV_FETCH";
+            case GET_ENV:
+                return "GET_ENV";
+            case GET_RESULT:
+                return "GET_RESULT";
+            case PUT_RESULT:
+                return "PUT_RESULT";
+            case HEADER_LIST:
+                return "HEADER_LIST";
+            case GET_INCLUDE_SCAN:
+                return "GET_INCLUDE_SCAN";
+            case INCLUDE_SCAN:
+                return "INCLUDE_SCAN";
+            case CPP_SLOT:
+                return "CPP_SLOT";
+            case REGION_STATS:
+                return "REGION_STATS";
+            case LEND_CS:
+                return "LEND_CS";
         }
         return nullptr;
     }
@@ -223,6 +268,12 @@ enum Compression {
 const int NODE_FEATURE_ENV_XZ = ( 1 << 0 );
 // The remote node is capable of unpacking environment compressed as .tar.zst .
 const int NODE_FEATURE_ENV_ZSTD = ( 1 << 1 );
+// The remote node keeps results of compile jobs and reuses them for identical jobs.
+const int NODE_FEATURE_RESULT_CACHE = ( 1 << 2 );
+// The remote node preprocesses jobs itself, getting the headers from the client.
+const int NODE_FEATURE_REMOTE_CPP = ( 1 << 3 );
+// The remote node compiles jobs using a GCC precompiled header sent by the client.
+const int NODE_FEATURE_PCH = ( 1 << 4 );
 
 // a list of pairs of host platform, filename
 typedef std::list<std::pair<std::string, std::string> > Environments;
@@ -247,6 +298,19 @@ public:
 
     // false <--> error (msg not send)
     bool send_msg(const Msg &, int SendFlags = SendBlocking);
+    // Appends the message as send_msg() would send it to data, without sending
+    // anything, false on error. Nothing may be queued for sending.
+    bool serialize_msg(const Msg &, std::string &data);
+
+    // While corked, send_msg() only queues messages, so that several go out with one
+    // send(), on flush() or uncork(), or when much is queued or a reply is waited for.
+    void cork()
+    {
+        corked = true;
+    }
+    bool uncork(bool blocking = true);
+    // Sends what is queued, false on error.
+    bool flush(bool blocking = true);
 
     bool has_msg(void) const
     {
@@ -266,7 +330,12 @@ public:
         return text_based;
     }
 
-    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen);
+    // What was received but not read as a message yet, for handing the connection
+    // to another process, see Service::createChannel(int, int, const std::string &).
+    std::string unread_input() const;
+
+    // buf is from a pool, of _bufsize bytes, only for FileChunkMsg.
+    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen, size_t &_bufsize);
     void writecompressed(const unsigned char *in_buf,
                          size_t _in_len, size_t &_out_len);
     void write_environments(const Environments &envs);
@@ -304,7 +373,8 @@ protected:
     void writefull(const void *_buf, size_t count);
     // returns false if there was an error in the protocol setup
     bool update_state(void);
-    void chop_input(void);
+    void chop_input(bool force = false);
+    void grow_inbuf(size_t size);
     void chop_output(void);
     bool wait_for_msg(int timeout);
     void set_error(bool silent = false);
@@ -329,6 +399,7 @@ protected:
     uint32_t inmsglen;
     bool eof;
     bool text_based;
+    bool corked;
 
 private:
     friend class Service;
@@ -346,6 +417,15 @@ public:
     static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout);
     static MsgChannel *createChannel(const std::string &domain_socket);
     static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t);
+    // A connection already set up by another process, no protocol handshake.
+    static MsgChannel *createChannel(int remote_fd, int protocol, const std::string &unread_input);
+    // Starts connecting without blocking, returns the socket or -1. It becomes
+    // writable when connecting is done, then finishConnect() makes the channel.
+    static int startConnect(const std::string &host, unsigned short p);
+    // The channel for a socket from startConnect(), or nullptr if connecting failed
+    // (closing the socket). It doesn't wait for the protocol setup either, which is
+    // done when protocol > 0 after reading from the channel.
+    static MsgChannel *finishConnect(int remote_fd);
 };
 
 class Broadcasts
@@ -501,13 +581,32 @@ public:
     uint32_t required_features;
     uint32_t client_count; // number of CS -> C connections at the moment
     uint32_t niceness; // nice priority (0-20)
+    // C --> local CS only: if versions is empty, the daemon uses the native environment
+    // for this compiler, as for GetNativeEnvMsg, and sends its path with UseCSMsg.
+    std::string native_compiler;
+    std::list<std::string> native_extrafiles;
+    std::string native_compression;
+
+protected:
+    // For MonGetCSMsg, which has its own message type.
+    explicit GetCSMsg(Msg::Value type)
+        : Msg(type)
+        , count(1)
+        , arg_flags(0)
+        , client_id(0)
+        , minimal_host_version(0)
+        , required_features(0)
+        , client_count(0)
+        , niceness(0)
+        {}
 };
 
 class UseCSMsg : public Msg
 {
 public:
     UseCSMsg()
-        : Msg(Msg::USE_CS) {}
+        : Msg(Msg::USE_CS)
+        , env_peer_port(0) {}
     UseCSMsg(std::string platform, std::string host, unsigned int p, unsigned int id, bool gotit,
              unsigned int _client_id, unsigned int matched_host_jobs)
         : Msg(Msg::USE_CS),
@@ -517,7 +616,8 @@ public:
           host_platform(platform),
           got_env(gotit),
           client_id(_client_id),
-          matched_job_id(matched_host_jobs) {}
+          matched_job_id(matched_host_jobs),
+          env_peer_port(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -529,6 +629,11 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    // if got_env is false, a CS that can send the environment instead of the client
+    std::string env_peer_host;
+    uint32_t env_peer_port;
+    // local CS --> C only: the native environment, if asked for by GetCSMsg
+    std::string native_env;
 };
 
 class NoCSMsg : public Msg
@@ -619,13 +724,15 @@ public:
         : Msg(Msg::FILE_CHUNK)
         , buffer(_buffer)
         , len(_len)
-        , del_buf(false) {}
+        , del_buf(false)
+        , capacity(0) {}
 
     FileChunkMsg()
         : Msg(Msg::FILE_CHUNK)
         , buffer(0)
         , len(0)
-        , del_buf(true) {}
+        , del_buf(true)
+        , capacity(0) {}
 
     ~FileChunkMsg();
 
@@ -638,6 +745,8 @@ public:
     bool del_buf;
 
 private:
+    size_t capacity; // of a received buffer
+
     FileChunkMsg(const FileChunkMsg &);
     FileChunkMsg &operator=(const FileChunkMsg &);
 };
@@ -733,6 +842,9 @@ public:
     uint32_t out_compressed;
     uint32_t out_uncompressed;
 
+    uint32_t in_msec; /* time it took to receive the input, if the client had it ready */
+    uint32_t rtt_usec; /* round trip time to the submitter, if known */
+
     uint32_t job_id;
     uint32_t client_count; // number of CS -> C connections at the moment
 };
@@ -776,7 +888,8 @@ public:
              unsigned int my_features);
     LoginMsg()
         : Msg(Msg::LOGIN)
-        , port(0) {}
+        , port(0)
+        , max_link_jobs(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -784,6 +897,7 @@ public:
     uint32_t port;
     Environments envs;
     uint32_t max_kids;
+    uint32_t max_link_jobs; // slots for local jobs, 0 if they share max_kids
     bool noremote;
     bool chroot_possible;
     std::string nodename;
@@ -856,6 +970,196 @@ public:
     std::string target;
 };
 
+class EnvFetchMsg : public Msg
+{
+public:
+    EnvFetchMsg()
+        : Msg(Msg::ENV_FETCH)
+        , port(0) {}
+
+    EnvFetchMsg(const std::string &_target, const std::string &_name, const std::string &_hostname,
+                unsigned int _port)
+        : Msg(Msg::ENV_FETCH)
+        , name(_name)
+        , target(_target)
+        , hostname(_hostname)
+        , port(_port) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+    std::string hostname;
+    uint32_t port;
+};
+
+class GetEnvMsg : public Msg
+{
+public:
+    GetEnvMsg()
+        : Msg(Msg::GET_ENV) {}
+
+    GetEnvMsg(const std::string &_target, const std::string &_name)
+        : Msg(Msg::GET_ENV)
+        , name(_name)
+        , target(_target) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+};
+
+class GetResultMsg : public Msg
+{
+public:
+    GetResultMsg()
+        : Msg(Msg::GET_RESULT) {}
+
+    GetResultMsg(const std::string &_key)
+        : Msg(Msg::GET_RESULT)
+        , key(_key) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+};
+
+class PutResultMsg : public Msg
+{
+public:
+    PutResultMsg()
+        : Msg(Msg::PUT_RESULT) {}
+
+    PutResultMsg(const std::string &_key)
+        : Msg(Msg::PUT_RESULT)
+        , key(_key) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+};
+
+// Files by path on the client and md5 of their contents.
+class HeaderListMsg : public Msg
+{
+public:
+    HeaderListMsg()
+        : Msg(Msg::HEADER_LIST) {}
+
+    HeaderListMsg(const std::list<std::string> &_files, const std::list<std::string> &_hashes)
+        : Msg(Msg::HEADER_LIST)
+        , files(_files)
+        , hashes(_hashes) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::list<std::string> files;
+    std::list<std::string> hashes;
+};
+
+class GetIncludeScanMsg : public Msg
+{
+public:
+    GetIncludeScanMsg()
+        : Msg(Msg::GET_INCLUDE_SCAN) {}
+
+    GetIncludeScanMsg(const std::string &_key)
+        : Msg(Msg::GET_INCLUDE_SCAN)
+        , key(_key) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+};
+
+// What the client found scanning a job for includes, valid as long as the
+// files and directories in stamp_paths have the same stamps.
+class IncludeScanMsg : public Msg
+{
+public:
+    IncludeScanMsg()
+        : Msg(Msg::INCLUDE_SCAN) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+    std::list<std::string> flags;
+    std::list<std::string> files;
+    std::list<std::string> hashes;
+    std::list<std::string> dependencies;
+    std::list<std::string> stamp_paths;
+    std::list<std::string> stamps;
+};
+
+class CppSlotMsg : public Msg
+{
+public:
+    CppSlotMsg(bool _wait = true)
+        : Msg(Msg::CPP_SLOT)
+        , wait(_wait) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // Whether to wait for a slot, otherwise END says that none is free now.
+    uint32_t wait;
+};
+
+class RegionStatsMsg : public Msg
+{
+public:
+    RegionStatsMsg()
+        : Msg(Msg::REGION_STATS)
+        , port(0)
+        , hosts(0)
+        , idle_hosts(0)
+        , free_slots(0)
+        , queued_jobs(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string netname;
+    uint32_t port; // of the region's scheduler, for lent daemons
+    uint32_t hosts;
+    uint32_t idle_hosts; // without jobs, could be lent
+    uint32_t free_slots;
+    uint32_t queued_jobs; // waiting, or built by their submitter for lack of a host
+};
+
+class LendCSMsg : public Msg
+{
+public:
+    LendCSMsg()
+        : Msg(Msg::LEND_CS)
+        , count(0)
+        , port(0)
+        , lease(0) {}
+
+    LendCSMsg(unsigned int _count, const std::string &_hostname, unsigned int _port, unsigned int _lease)
+        : Msg(Msg::LEND_CS)
+        , count(_count)
+        , hostname(_hostname)
+        , port(_port)
+        , lease(_lease) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t count; // only for S
+    std::string hostname;
+    uint32_t port;
+    uint32_t lease; // seconds
+};
+
 class GetInternalStatus : public Msg
 {
 public:
@@ -877,16 +1181,22 @@ class MonGetCSMsg : public GetCSMsg
 {
 public:
     MonGetCSMsg()
-        : GetCSMsg()
-    { // overwrite
-        clientid = job_id = 0;
-    }
+        : GetCSMsg(Msg::MON_GET_CS)
+        , job_id(0)
+        , clientid(0)
+    {}
 
     MonGetCSMsg(int jobid, int hostid, GetCSMsg *m)
-        : GetCSMsg(Environments(), m->filename, m->lang, 1, m->target, 0, std::string(), false, m->client_count, m->niceness)
+        : GetCSMsg(Msg::MON_GET_CS)
         , job_id(jobid)
         , clientid(hostid)
-    {}
+    {
+        filename = m->filename;
+        lang = m->lang;
+        target = m->target;
+        client_count = m->client_count;
+        niceness = m->niceness;
+    }
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -80,6 +80,37 @@ list<string> CompileJob::allFlags() const
     return args;
 }
 
+list<string> CompileJob::resultKeyFields() const
+{
+    list<string> fields;
+    fields.push_back(compilerName());
+    fields.push_back(to_string(language()));
+    fields.push_back(dwarfFissionEnabled() ? "dwo" : "");
+
+    // The paths to the .dwo file are in the object file.
+    if (dwarfFissionEnabled()) {
+        fields.push_back(outputFile());
+        fields.push_back(workingDirectory());
+    }
+
+    // clang is given the source file and working directory of the client for the debug info.
+    if (compilerName().find("clang") != string::npos) {
+        fields.push_back(inputFile());
+        fields.push_back(workingDirectory());
+    }
+
+    list<string> flags = nonLocalFlags();
+    fields.push_back(to_string(flags.size()));
+    fields.splice(fields.end(), flags);
+
+    // Jobs preprocessed by the compile server send sources instead of preprocessed
+    // source, the defines and include paths are only in these flags.
+    flags = preprocessorFlags();
+    fields.push_back(to_string(flags.size()));
+    fields.splice(fields.end(), flags);
+    return fields;
+}
+
 void CompileJob::setTargetPlatform()
 {
     m_target_platform = determine_platform();
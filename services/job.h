@@ -66,6 +66,7 @@ public:
         : m_id(0)
         , m_dwarf_fission(false)
         , m_block_rewrite_includes(false)
+        , m_input_ready(false)
     {
         setTargetPlatform();
     }
@@ -124,6 +125,9 @@ public:
     std::list<std::string> restFlags() const;
     std::list<std::string> nonLocalFlags() const;
     std::list<std::string> allFlags() const;
+    // What the compiled result depends on besides the input and the environment,
+    // the same for the keys of all caches of results.
+    std::list<std::string> resultKeyFields() const;
 
     void setInputFile(const std::string &file)
     {
@@ -166,6 +170,48 @@ public:
         return m_working_directory;
     }
 
+    // Set when the compile server preprocesses the job itself. These are the flags
+    // for its preprocessor, with paths of the client that the server maps into
+    // the directory with the files sent to it.
+    void setPreprocessorFlags(const std::list<std::string> &flags)
+    {
+        m_preprocessor_flags = flags;
+    }
+
+    std::list<std::string> preprocessorFlags() const
+    {
+        return m_preprocessor_flags;
+    }
+
+    bool remotePreprocessing() const
+    {
+        return !m_preprocessor_flags.empty();
+    }
+
+    // Set when the preprocessed source loads a precompiled header, the client's
+    // absolute path of it, which the server gets like the headers it preprocesses.
+    void setPrecompiledHeader(const std::string &file)
+    {
+        m_precompiled_header = file;
+    }
+
+    std::string precompiledHeader() const
+    {
+        return m_precompiled_header;
+    }
+
+    // Set when the client has all of the input before sending it, so that receiving
+    // it is not slowed down by the client's preprocessor.
+    void setInputReady(bool flag)
+    {
+        m_input_ready = flag;
+    }
+
+    bool inputReady() const
+    {
+        return m_input_ready;
+    }
+
     void setJobID(unsigned int id)
     {
         m_id = id;
@@ -216,8 +262,11 @@ private:
     std::string m_input_file, m_output_file;
     std::string m_working_directory;
     std::string m_target_platform;
+    std::list<std::string> m_preprocessor_flags;
+    std::string m_precompiled_header;
     bool m_dwarf_fission;
     bool m_block_rewrite_includes;
+    bool m_input_ready;
 };
 
 inline void appendList(std::list<std::string> &list, const std::list<std::string> &toadd)
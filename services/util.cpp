@@ -238,6 +238,12 @@ string supported_features_to_string(unsigned int features)
         ret += " env_xz";
     if( features & NODE_FEATURE_ENV_ZSTD )
         ret += " env_zstd";
+    if( features & NODE_FEATURE_RESULT_CACHE )
+        ret += " result_cache";
+    if( features & NODE_FEATURE_REMOTE_CPP )
+        ret += " remote_cpp";
+    if( features & NODE_FEATURE_PCH )
+        ret += " pch";
     if( ret.empty())
         ret = "--";
     else
@@ -0,0 +1,217 @@
+#include "compdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+static string test_dir;
+
+static string join(const vector<string> &args)
+{
+    string result;
+
+    for (const string &arg : args) {
+        if (!result.empty()) {
+            result += ", ";
+        }
+        result += "'" + arg + "'";
+    }
+
+    return result;
+}
+
+// Writes the database as a new file, so that it gets a new inode like when a build system
+// regenerates it.
+static string write_db(const string &name, const string &contents)
+{
+    string path = test_dir + "/" + name;
+    string tmp_path = path + ".tmp";
+    ofstream out(tmp_path.c_str());
+    out << contents;
+    out.close();
+
+    if (!out || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        cerr << "cannot write " << path << "\n";
+        exit(1);
+    }
+
+    return path;
+}
+
+// Writes the database in place, keeping its inode.
+static void overwrite_db(const string &path, const string &contents)
+{
+    ofstream out(path.c_str());
+    out << contents;
+    out.close();
+
+    if (!out) {
+        cerr << "cannot write " << path << "\n";
+        exit(1);
+    }
+}
+
+static void test_lookup(const string &prefix, const string &db, const string &file, const string &expected)
+{
+    string got;
+
+    try {
+        got = join(getCompileCommand(db, file));
+    } catch (const runtime_error &e) {
+        got = string("error: ") + e.what();
+    }
+
+    if (got != expected) {
+        cerr << prefix << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+static void test_split(const string &prefix, const string &command, const string &expected)
+{
+    string got = join(splitCommandLine(command));
+
+    if (got != expected) {
+        cerr << prefix << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+static void test_split_command() {
+    test_split("split 1", "gcc  -c\tmain.c -o main.o", "'gcc', '-c', 'main.c', '-o', 'main.o'");
+    test_split("split 2", "gcc -DA='x y' \"-DB=\\\"q\\\"\" a\\ b.c", "'gcc', '-DA=x y', '-DB=\"q\"', 'a b.c'");
+    test_split("split 3", "gcc \"-DC=a\\nb\" '-DD=\\'", "'gcc', '-DC=a\\nb', '-DD=\\'");
+    test_split("split 4", "gcc '' -c", "'gcc', '', '-c'");
+    test_split("split 5", "", "");
+}
+
+static void test_escapes() {
+    string db = write_db("escapes.json",
+        "[ { \"directory\": \"\\/src\", \"file\": \"\\/src\\/main.c\",\n"
+        "    \"arguments\": [ \"gcc\", \"-DS=\\\"a b\\\"\", \"-DP=a\\\\b\", \"-DT=\\t\", \"-DU=\\u00e9\\u0041\" ] } ]\n");
+    string expected = "'gcc', '-DS=\"a b\"', '-DP=a\\b', '-DT=\t', '-DU=\xc3\xa9" "A'";
+    test_lookup("escapes", db, "/src/main.c", expected);
+    // The second lookup goes through the index.
+    test_lookup("escapes indexed", db, "/src/main.c", expected);
+}
+
+static void test_arguments_command() {
+    string db = write_db("forms.json",
+        "[\n"
+        "  { \"directory\": \"/src\", \"file\": \"/src/a.c\", \"arguments\": [ \"gcc\", \"-DX=a b\", \"-c\", \"a.c\" ] },\n"
+        "  { \"directory\": \"/src\", \"file\": \"/src/b.c\", \"command\": \"gcc '-DX=a b' -c b.c\" },\n"
+        "  { \"directory\": \"/src\", \"file\": \"/src/c.c\", \"command\": \"cc -c c.c\", \"arguments\": [ \"gcc\", \"-c\", \"c.c\" ],\n"
+        "    \"output\": \"c.o\", \"extra\": { \"list\": [ 1, true, null, \"x\" ] } }\n"
+        "]\n");
+    test_lookup("arguments", db, "/src/a.c", "'gcc', '-DX=a b', '-c', 'a.c'");
+    test_lookup("command", db, "/src/b.c", "'gcc', '-DX=a b', '-c', 'b.c'");
+    test_lookup("arguments and command", db, "/src/c.c", "'gcc', '-c', 'c.c'");
+    test_lookup("arguments indexed", db, "/src/a.c", "'gcc', '-DX=a b', '-c', 'a.c'");
+    test_lookup("command indexed", db, "/src/b.c", "'gcc', '-DX=a b', '-c', 'b.c'");
+    test_lookup("not found", db, "/src/d.c", "error: Compile command for the specified file was not found.");
+}
+
+static void test_relative_paths() {
+    string db = write_db("relative.json",
+        "[\n"
+        "  { \"directory\": \"/src\", \"file\": \"sub/a.c\", \"command\": \"gcc -c sub/a.c\" },\n"
+        "  { \"directory\": \"" + test_dir + "\", \"file\": \"b.c\", \"command\": \"gcc -c b.c\" },\n"
+        "  { \"directory\": \"/other\", \"file\": \"" + test_dir + "/c.c\", \"command\": \"gcc -c c.c\" }\n"
+        "]\n");
+
+    if (chdir(test_dir.c_str()) != 0) {
+        cerr << "cannot change to " << test_dir << "\n";
+        exit(1);
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        const string indexed = pass ? " indexed" : "";
+        // "file" relative to "directory".
+        test_lookup("directory" + indexed, db, "/src/sub/a.c", "'gcc', '-c', 'sub/a.c'");
+        // "file" as written in the database.
+        test_lookup("file" + indexed, db, "sub/a.c", "'gcc', '-c', 'sub/a.c'");
+        // A relative target is also looked up relative to the current directory.
+        test_lookup("cwd" + indexed, db, "c.c", "'gcc', '-c', 'c.c'");
+        test_lookup("cwd directory" + indexed, db, "b.c", "'gcc', '-c', 'b.c'");
+        test_lookup("wrong directory" + indexed, db, "/other/sub/a.c",
+                    "error: Compile command for the specified file was not found.");
+    }
+}
+
+static void test_rebuild_index() {
+    string db = write_db("rebuild.json", "[ { \"file\": \"/src/a.c\", \"command\": \"gcc -O1 -c a.c\" } ]");
+    test_lookup("before rebuild", db, "/src/a.c", "'gcc', '-O1', '-c', 'a.c'");
+    test_lookup("before rebuild indexed", db, "/src/a.c", "'gcc', '-O1', '-c', 'a.c'");
+    write_db("rebuild.json", "[ { \"file\": \"/src/b.c\", \"command\": \"gcc -c b.c\" },\n"
+                             "  { \"file\": \"/src/a.c\", \"command\": \"gcc -O2 -c a.c\" } ]");
+    test_lookup("after rebuild", db, "/src/a.c", "'gcc', '-O2', '-c', 'a.c'");
+    test_lookup("after rebuild indexed", db, "/src/b.c", "'gcc', '-c', 'b.c'");
+}
+
+static void test_overwrite_index() {
+    string db = write_db("overwrite.json", "[ { \"file\": \"/src/a.c\", \"command\": \"gcc -c a.c\" },\n"
+                                           "  { \"file\": \"/src/b.c\", \"command\": \"gcc -c b.c\" } ]");
+    test_lookup("before overwrite", db, "/src/a.c", "'gcc', '-c', 'a.c'");
+    test_lookup("before overwrite indexed", db, "/src/a.c", "'gcc', '-c', 'a.c'");
+    // The same size and inode, and likely the same second. Coarse timestamps
+    // would not differ without the wait.
+    usleep(20000);
+    overwrite_db(db, "[ { \"file\": \"/src/b.c\", \"command\": \"gcc -c b.c\" },\n"
+                     "  { \"file\": \"/src/a.c\", \"command\": \"gcc -c a.c\" } ]");
+    test_lookup("after overwrite", db, "/src/a.c", "'gcc', '-c', 'a.c'");
+}
+
+static void test_malformed() {
+    const char *invalid = "error: Invalid compile_commands.json file.";
+    test_lookup("missing", test_dir + "/missing.json", "/src/a.c", "error: Cannot open compile_commands.json file.");
+    test_lookup("empty", write_db("empty.json", ""), "/src/a.c", invalid);
+    test_lookup("empty array", write_db("empty-array.json", "[]"), "/src/a.c",
+                "error: Compile command for the specified file was not found.");
+    test_lookup("no array", write_db("no-array.json", "{ \"file\": \"/src/a.c\", \"command\": \"gcc\" }"),
+                "/src/a.c", invalid);
+    test_lookup("unterminated array", write_db("unterminated-array.json",
+                "[ { \"file\": \"/src/a.c\", \"command\": \"gcc\" }"), "/src/a.c", invalid);
+    test_lookup("unterminated object", write_db("unterminated-object.json",
+                "[ { \"file\": \"/src/a.c\", \"command\": \"gcc\" ]"), "/src/a.c", invalid);
+    test_lookup("unterminated string", write_db("unterminated-string.json",
+                "[ { \"file\": \"/src/a.c\", \"command\": \"gcc ]"), "/src/a.c", invalid);
+    test_lookup("trailing escape", write_db("trailing-escape.json",
+                "[ { \"file\": \"/src/a.c\", \"command\": \"gcc\\"), "/src/a.c", invalid);
+    test_lookup("short unicode escape", write_db("short-unicode.json",
+                "[ { \"file\": \"/src/a.c\", \"command\": \"\\u00"), "/src/a.c", invalid);
+    test_lookup("missing colon", write_db("missing-colon.json",
+                "[ { \"file\" \"/src/a.c\", \"command\": \"gcc\" } ]"), "/src/a.c", invalid);
+    test_lookup("arguments not strings", write_db("arguments-numbers.json",
+                "[ { \"file\": \"/src/a.c\", \"arguments\": [ 1, 2 ] } ]"), "/src/a.c", invalid);
+    test_lookup("file not a string", write_db("file-number.json",
+                "[ { \"file\": 1, \"command\": \"gcc\" } ]"), "/src/a.c", invalid);
+}
+
+int main() {
+    char dir[] = "/tmp/icecc-compdb-test.XXXXXX";
+
+    if (mkdtemp(dir) == nullptr) {
+        cerr << "cannot create a temporary directory\n";
+        return 1;
+    }
+
+    test_dir = dir;
+    test_split_command();
+    test_escapes();
+    test_arguments_command();
+    test_relative_paths();
+    test_rebuild_index();
+    test_overwrite_index();
+    test_malformed();
+
+    string command = "rm -rf '" + test_dir + "'";
+    return system(command.c_str()) == 0 ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+#include "client.h"
+#include "includes.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <list>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+static string test_dir;
+
+static void write_file(const string &name, const string &contents)
+{
+    string path = test_dir + "/" + name;
+    ofstream out(path.c_str());
+    out << contents;
+    out.close();
+
+    if (!out) {
+        cerr << "cannot write " << path << "\n";
+        exit(1);
+    }
+}
+
+static void make_dir(const string &name)
+{
+    string path = test_dir + "/" + name;
+
+    if (mkdir(path.c_str(), 0755) != 0) {
+        cerr << "cannot create " << path << "\n";
+        exit(1);
+    }
+}
+
+// The arguments, with the paths in the test directory relative to it. The directories of the
+// compiler (with their -isystem) and -fmacro-prefix-map, which depends on its version, are left
+// out, so that the result does not depend on the compiler installed.
+static string test_args(const list<string> &args)
+{
+    list<string> kept;
+
+    for (const string &arg : args) {
+        if (arg.compare(0, test_dir.size() + 1, test_dir + "/") == 0) {
+            kept.push_back(arg.substr(test_dir.size() + 1));
+        } else if (arg.compare(0, 1, "/") == 0) {
+            if (!kept.empty() && kept.back() == "-isystem") {
+                kept.pop_back();
+            }
+        } else if (arg.compare(0, 18, "-fmacro-prefix-map") != 0) {
+            kept.push_back(arg);
+        }
+    }
+
+    string result;
+
+    for (const string &arg : kept) {
+        if (!result.empty()) {
+            result += ", ";
+        }
+
+        result += arg;
+    }
+
+    return result;
+}
+
+static CompileJob make_job(const string &input, const list<string> &flags)
+{
+    CompileJob job;
+    job.setCompilerName("gcc");
+    job.setLanguage(CompileJob::Lang_C);
+    job.setInputFile(test_dir + "/" + input);
+    job.setOutputFile("main.o");
+    job.setWorkingDirectory(test_dir + "/src");
+    job.appendFlag("-c", Arg_Remote);
+
+    for (const string &flag : flags) {
+        job.appendFlag(flag, Arg_Local);
+    }
+
+    return job;
+}
+
+static void test_scan(const string &prefix, CompileJob job, bool expected_ok, const string &expected_files,
+                      const string &expected_flags)
+{
+    IncludeClosure closure;
+    bool ok = scan_includes(job, closure);
+    string got = string("ok:") + (ok ? "1" : "0");
+    string expected = string("ok:") + (expected_ok ? "1" : "0");
+
+    if (expected_ok) {
+        got += " files:" + test_args(closure.files);
+        got += " flags:" + test_args(job.preprocessorFlags());
+        expected += " files:" + expected_files + " flags:" + expected_flags;
+    }
+
+    if (got != expected) {
+        cerr << prefix << " failed\n";
+        cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+        exit(1);
+    }
+}
+
+static void test_search_order() {
+    write_file("src/main.c",
+               "#include \"local.h\"\n"
+               "#include <angle.h>\n"
+               "#include \"quoted.h\"\n"
+               "#include <quoted2.h>\n"
+               "#include <order.h>\n"
+               "# include <next.h>\n"
+               "#include \"missing.h\"\n"
+               "/* #include \"commented.h\" */\n"
+               "int main() { return 0; }\n");
+    write_file("src/local.h", "");
+    write_file("src/angle.h", "");
+    write_file("src/commented.h", "");
+    write_file("inc/angle.h", "");
+    write_file("inc/order.h", "");
+    write_file("inc/next.h", "#include_next <next.h>\n");
+    write_file("sys/order.h", "");
+    write_file("sys/next.h", "#include <missing2.h>\n");
+    write_file("quote/quoted.h", "");
+    write_file("quote/quoted2.h", "");
+
+    // The compiler orders the directories by kind, not as given.
+    list<string> flags = { "-isystem", test_dir + "/sys", "-I", test_dir + "/inc",
+                           "-iquote", test_dir + "/quote", "-DFOO=1" };
+    test_scan("search order", make_job("src/main.c", flags), true,
+              "src/main.c, src/local.h, inc/angle.h, quote/quoted.h, inc/order.h, inc/next.h, sys/next.h",
+              "-nostdinc, -DFOO=1, -iquote, quote, -I, inc, -isystem, sys");
+
+    // -I given as one argument and relative to the working directory.
+    flags = { "-I../inc", "-isystem", test_dir + "/sys", "-iquote", test_dir + "/quote" };
+    test_scan("relative -I", make_job("src/main.c", flags), true,
+              "src/main.c, src/local.h, inc/angle.h, quote/quoted.h, inc/order.h, inc/next.h, sys/next.h",
+              "-nostdinc, -iquote, quote, -I, ../inc, -isystem, sys");
+
+    // Without -I the system directory is next.
+    flags = { "-isystem", test_dir + "/sys", "-iquote", test_dir + "/quote" };
+    test_scan("no -I", make_job("src/main.c", flags), true,
+              "src/main.c, src/local.h, quote/quoted.h, sys/order.h, sys/next.h",
+              "-nostdinc, -iquote, quote, -isystem, sys");
+}
+
+static void test_include_next() {
+    write_file("next/main.c", "#include \"a.h\"\n");
+    write_file("next/first/a.h", "#include_next \"a.h\"\n#include_next <b.h>\n");
+    write_file("next/second/a.h", "");
+    write_file("next/first/b.h", "");
+    write_file("next/second/b.h", "");
+    write_file("next/third/b.h", "");
+
+    list<string> flags = { "-I", test_dir + "/next/first", "-I", test_dir + "/next/second",
+                           "-I", test_dir + "/next/third" };
+    // #include_next continues after the directory the includer was found in.
+    test_scan("include_next", make_job("next/main.c", flags), true,
+              "next/main.c, next/first/a.h, next/second/a.h, next/second/b.h",
+              "-nostdinc, -I, next/first, -I, next/second, -I, next/third");
+}
+
+static void test_unresolved() {
+    write_file("unresolved/main.c", "#include \"missing.h\"\n#include <missing.h>\n#include <sub/missing.h>\n");
+    // Headers that are not found may not be needed, the compile server reports them if they are.
+    test_scan("unresolved", make_job("unresolved/main.c", {}), true, "unresolved/main.c", "-nostdinc");
+
+    write_file("unresolved/computed.c", "#define HEADER \"stdio.h\"\n#include HEADER\n");
+    test_scan("computed include", make_job("unresolved/computed.c", {}), false, "", "");
+
+    write_file("unresolved/has_include.c", "#if __has_include(HEADER)\n#endif\n");
+    test_scan("computed __has_include", make_job("unresolved/has_include.c", {}), false, "", "");
+
+    list<string> flags = { "-include", "missing.h" };
+    test_scan("missing -include", make_job("unresolved/main.c", flags), false, "", "");
+}
+
+int main() {
+    unsetenv("ICECC_CC");
+    unsetenv("ICECC_CXX");
+    unsetenv("ICECC_TEST_SOCKET");
+    char dir[] = "/tmp/icecc-includes-test.XXXXXX";
+
+    if (mkdtemp(dir) == nullptr) {
+        cerr << "cannot create a temporary directory\n";
+        return 1;
+    }
+
+    test_dir = dir;
+    string src_dir = test_dir + "/src";
+
+    for (const char *name : { "src", "inc", "sys", "quote", "next", "next/first", "next/second",
+                              "next/third", "unresolved" }) {
+        make_dir(name);
+    }
+
+    // The client runs in the working directory of the job.
+    if (chdir(src_dir.c_str()) != 0) {
+        cerr << "cannot change to " << src_dir << "\n";
+        return 1;
+    }
+
+    test_search_order();
+    test_include_next();
+    test_unresolved();
+
+    string command = "rm -rf '" + test_dir + "'";
+    return system(command.c_str()) == 0 ? 0 : 1;
+}
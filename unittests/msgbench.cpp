@@ -0,0 +1,199 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Microbenchmark for receiving messages from a socket. A child process sends
+   messages as fast as it can, the parent counts how often it has to read
+   from the socket per message and how much cpu time that takes. Not run by 'make check',
+   build it with 'make msgbench'.  */
+
+#include "comm.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace std;
+
+// The cpu time used by the receiving process, not waiting for the sender.
+static double cpu_time()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+           + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+enum Kind {
+    Ping,
+    Text,   // not compressed, costs just the channel
+    Chunk   // compressed, like sending files
+};
+
+static void send_messages(int fd, Kind kind, size_t size, int count)
+{
+    MsgChannel *c = Service::createChannel(fd, nullptr, 0);
+
+    if (!c) {
+        _exit(1);
+    }
+
+    // Random data, so that the chunks hardly compress and vary in size.
+    unsigned char *buffers[4];
+    string texts[4];
+    srand(1);
+
+    for (int i = 0; i < 4; ++i) {
+        buffers[i] = new unsigned char[size];
+
+        for (size_t j = 0; j < size; ++j) {
+            buffers[i][j] = rand() % (64 << i);
+        }
+
+        texts[i] = string(size + i * 1000, 'x');
+    }
+
+    for (int i = 0; i < count; ++i) {
+        bool ok;
+
+        if (kind == Ping) {
+            ok = c->send_msg(PingMsg());
+        } else if (kind == Text) {
+            ok = c->send_msg(StatusTextMsg(texts[i % 4]));
+        } else {
+            ok = c->send_msg(FileChunkMsg(buffers[i % 4], size));
+        }
+
+        if (!ok) {
+            _exit(1);
+        }
+    }
+
+    c->send_msg(EndMsg());
+    delete c;
+
+    for (int i = 0; i < 4; ++i) {
+        delete[] buffers[i];
+    }
+
+    _exit(0);
+}
+
+/* With 'queued' all messages are sent before receiving starts, like for a busy
+   daemon, otherwise receiving keeps up with the sender. Queued messages need to
+   fit into the socket buffer.  */
+static bool run(const char *name, Kind kind, size_t size, int count, bool queued)
+{
+    int sockets[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        perror("socketpair");
+        return false;
+    }
+
+    if (queued) {
+        int bufsize = 4 * 1024 * 1024;
+        setsockopt(sockets[0], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+        setsockopt(sockets[1], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        close(sockets[0]);
+        send_messages(sockets[1], kind, size, count);
+    }
+
+    close(sockets[1]);
+    MsgChannel *c = Service::createChannel(sockets[0], nullptr, 0);
+
+    if (!c) {
+        return false;
+    }
+
+    int status = 1;
+
+    if (queued) {
+        waitpid(pid, &status, 0);
+    }
+
+    int reads = 0;
+    int msgs = 0;
+    double start = cpu_time();
+
+    for (;;) {
+        while (!c->has_msg()) {
+            pollfd pfd;
+            pfd.fd = c->fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, 10 * 1000);
+
+            if (!c->read_a_bit() || c->at_eof()) {
+                cerr << name << ": receiving failed" << endl;
+                return false;
+            }
+
+            ++reads;
+        }
+
+        Msg *m = c->get_msg(0);
+
+        if (!m) {
+            cerr << name << ": no message" << endl;
+            return false;
+        }
+
+        bool end = *m == Msg::END;
+        delete m;
+
+        if (end) {
+            break;
+        }
+
+        ++msgs;
+    }
+
+    double elapsed = cpu_time() - start;
+    delete c;
+
+    if (!queued) {
+        waitpid(pid, &status, 0);
+    }
+
+    cout << name << (queued ? " queued" : "") << ": " << msgs << " messages, " << double(reads) / msgs << " reads/message, "
+         << elapsed * 1e6 / msgs << " us cpu/message" << endl;
+    return msgs == count && status == 0;
+}
+
+int main()
+{
+    bool ok = run("ping", Ping, 0, 200000, false);
+    ok = run("4k text", Text, 4096, 20000, false) && ok;
+    ok = run("100k text", Text, 100000, 2000, false) && ok;
+    ok = run("1M text", Text, 1024 * 1024, 200, false) && ok;
+    ok = run("100k chunk", Chunk, 100000, 2000, false) && ok;
+    ok = run("ping", Ping, 0, 2000, true) && ok;
+    ok = run("4k text", Text, 4096, 500, true) && ok;
+    ok = run("100k text", Text, 100000, 30, true) && ok;
+    return ok ? 0 : 1;
+}
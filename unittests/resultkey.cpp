@@ -0,0 +1,114 @@
+#include "comm.h"
+#include "job.h"
+#include "resultcache.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <list>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+static string cache_dir;
+
+// The key the daemon's result cache computes for the job and the given input.
+static string result_key(const CompileJob &job, const string &input)
+{
+    int dir_fd = open(cache_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir_fd < 0) {
+        cerr << "cannot open " << cache_dir << "\n";
+        exit(1);
+    }
+
+    ResultCache cache(dir_fd, job);
+    cache.add_input((const unsigned char *)input.c_str(), input.size());
+    CompileResultMsg rmsg;
+    cache.lookup(rmsg);
+    return cache.key();
+}
+
+static CompileJob make_job(const string &compiler, const list<string> &cpp_flags)
+{
+    CompileJob job;
+    job.setCompilerName(compiler);
+    job.setLanguage(CompileJob::Lang_CXX);
+    job.setEnvironmentVersion("env");
+    job.setTargetPlatform("x86_64");
+    job.setInputFile("main.cpp");
+    job.setWorkingDirectory("/home/a/src");
+    job.setOutputFile("main.o");
+    job.appendFlag("-c", Arg_Remote);
+    job.appendFlag("-O2", Arg_Rest);
+    job.setPreprocessorFlags(cpp_flags);
+    return job;
+}
+
+static void test_keys(const string &prefix, const CompileJob &job1, const CompileJob &job2, bool same)
+{
+    string key1 = result_key(job1, "int main() {}\n");
+    string key2 = result_key(job2, "int main() {}\n");
+
+    if (key1.size() != 32 || (key1 == key2) != same) {
+        cerr << prefix << " failed\n";
+        cerr << "     got: \"" << key1 << "\" and \"" << key2 << "\", expected them "
+             << (same ? "equal" : "different") << "\n";
+        exit(1);
+    }
+}
+
+static void test_same_job() {
+    list<string> cpp_flags = { "-DTEST=1", "-I", "/home/a/src/include" };
+    test_keys("same job", make_job("g++", cpp_flags), make_job("g++", cpp_flags), true);
+}
+
+static void test_defines() {
+    // Preprocessed remotely, the input is the same, only the defines differ.
+    test_keys("defines", make_job("g++", { "-DTEST=1" }), make_job("g++", { "-DTEST=2" }), false);
+}
+
+static void test_include_paths() {
+    test_keys("include paths", make_job("g++", { "-I", "/home/a/src/include" }),
+              make_job("g++", { "-I", "/home/b/src/include" }), false);
+}
+
+static void test_flag_split() {
+    // Flags moving between the compiler's and the preprocessor's flags change the key.
+    CompileJob job1 = make_job("g++", { "-DTEST=1" });
+    CompileJob job2 = make_job("g++", {});
+    job2.appendFlag("-DTEST=1", Arg_Rest);
+    test_keys("flag split", job1, job2, false);
+}
+
+static void test_clang_paths() {
+    // clang gets the working directory for the debug info even without split DWARF.
+    CompileJob job1 = make_job("clang++", {});
+    CompileJob job2 = make_job("clang++", {});
+    job2.setWorkingDirectory("/home/b/src");
+    test_keys("clang paths", job1, job2, false);
+
+    // gcc takes them from the preprocessed source.
+    job1 = make_job("g++", {});
+    job2 = make_job("g++", {});
+    job2.setWorkingDirectory("/home/b/src");
+    test_keys("gcc paths", job1, job2, true);
+}
+
+int main() {
+    char dir[] = "/tmp/icecc-testresultkey.XXXXXX";
+
+    if (!mkdtemp(dir)) {
+        cerr << "cannot create a directory for the cache\n";
+        return 1;
+    }
+
+    cache_dir = dir;
+    test_same_job();
+    test_defines();
+    test_include_paths();
+    test_flag_split();
+    test_clang_paths();
+    rmdir(dir);
+    return 0;
+}